@@ -7,15 +7,18 @@
 #include "BinaryInputBuffer.h"
 
 #include <cassert>
+#include <cstring>
 
-/// read from file
-BinaryInputBuffer::BinaryInputBuffer(const std::string& filename)
+/// read from file, up to cacheSize bytes are loaded at once
+BinaryInputBuffer::BinaryInputBuffer(const std::string& filename, unsigned int cacheSize)
 : m_stream(),
-  m_read(0),
+  m_size(0),
   m_bitsLeft(0),
+  m_unreadBytes(0),
   m_bitBuffer(0),
   m_bitBufferSize(0),
   m_cache(),
+  m_cacheData(NULL),
   m_cacheOffset(0),
   m_cacheSize(0)
 {
@@ -26,24 +29,46 @@ BinaryInputBuffer::BinaryInputBuffer(const std::string& filename)
 
   // get file size
   m_stream.seekg(0, std::ios_base::end);
-  unsigned int size = (unsigned int)m_stream.tellg();
+  m_size = (unsigned int)m_stream.tellg();
   m_stream.seekg(0, std::ios_base::beg);
 
+  // no need for a cache larger than the file, but refill() prefers at least 8 bytes
+  if (cacheSize > m_size)
+    cacheSize = m_size;
+  if (cacheSize < 8)
+    cacheSize = 8;
+  m_cache.resize(cacheSize);
+  m_cacheData = &m_cache[0];
+
   // load first segment (or even the complete file)
-  m_cacheSize = CacheSize;
-  if (m_cacheSize > size)
-    m_cacheSize = size;
-  m_stream.read((char*)m_cache, m_cacheSize);
+  m_unreadBytes = m_size;
+  fillCache();
 
   // compute total number of bits
-  m_bitsLeft = 8 * size;
+  m_bitsLeft = 8 * m_size;
+}
+
+
+/// read from memory, data must remain valid as long as this object exists
+BinaryInputBuffer::BinaryInputBuffer(const unsigned char* data, unsigned int size)
+: m_stream(),
+  m_size(size),
+  m_bitsLeft(8 * size),
+  m_unreadBytes(0),
+  m_bitBuffer(0),
+  m_bitBufferSize(0),
+  m_cache(),
+  m_cacheData(data),
+  m_cacheOffset(0),
+  m_cacheSize(size)
+{
 }
 
 
-/// get number of bytes read so far
+/// get number of bytes read so far (a partially read byte counts as read)
 unsigned int BinaryInputBuffer::getNumBytesRead() const
 {
-  return m_read;
+  return m_size - m_bitsLeft / 8;
 }
 
 
@@ -64,21 +89,18 @@ bool BinaryInputBuffer::empty() const
 /// take a look at the next bits without modifying the buffer
 unsigned int BinaryInputBuffer::peekBits(unsigned char numBits)
 {
-  assert(numBits <= 16);
-  assert(numBits <= m_bitsLeft);
+  assert(numBits <= 32);
+  // truncated or damaged file
+  if (numBits > m_bitsLeft)
+    throw "unexpected end of file";
 
-  // move 8 bits from stream to buffer
-  while (m_bitBufferSize < numBits)
-  {
-    // get one byte from stream and add to internal buffer
-    unsigned int byte = getBufferedByte();
-    m_bitBuffer       |= byte << m_bitBufferSize;
-    m_bitBufferSize   += 8;
-  }
+  // move up to 8 bytes from stream to buffer
+  if (m_bitBufferSize < numBits)
+    refill();
 
   // return desired bits
-  unsigned int bitMask = (1 << numBits) - 1;
-  return m_bitBuffer & bitMask;
+  unsigned long long bitMask = (1ULL << numBits) - 1;
+  return (unsigned int)(m_bitBuffer & bitMask);
 }
 
 
@@ -105,12 +127,53 @@ bool BinaryInputBuffer::getBool()
 }
 
 
+/// copy the next bytes, current position must be at a byte boundary
+void BinaryInputBuffer::getBytes(unsigned char* data, unsigned int numBytes)
+{
+  assert(m_bitsLeft % 8 == 0);
+  if (8 * numBytes > m_bitsLeft)
+    throw "unexpected end of file";
+
+  // bytes which are already in the bit buffer
+  while (numBytes > 0 && m_bitBufferSize > 0)
+  {
+    *data++ = getByte();
+    numBytes--;
+  }
+
+  // copy directly from cache
+  while (numBytes > 0)
+  {
+    if (m_cacheOffset >= m_cacheSize)
+    {
+      if (m_unreadBytes == 0)
+        return;
+      fillCache();
+    }
+
+    unsigned int chunk = m_cacheSize - m_cacheOffset;
+    if (chunk > numBytes)
+      chunk = numBytes;
+
+    memcpy(data, m_cacheData + m_cacheOffset, chunk);
+    data          += chunk;
+    numBytes      -= chunk;
+    m_cacheOffset += chunk;
+    m_bitsLeft    -= 8 * chunk;
+  }
+}
+
+
 /// increment buffer pointers/offsets
 void BinaryInputBuffer::removeBits(unsigned char numBits)
 {
   // if more bits needs to be removed than are actually available in the buffer
   if (m_bitBufferSize < numBits)
-    peekBits(numBits);
+  {
+    if (numBits > m_bitsLeft)
+      throw "unexpected end of file";
+    refill();
+  }
 
   // adjust buffers and counters
   m_bitBuffer    >>= numBits;
@@ -119,24 +182,57 @@ void BinaryInputBuffer::removeBits(unsigned char numBits)
 }
 
 
-/// simple I/O buffering, faster than C lib's built-in functions
-unsigned char BinaryInputBuffer::getBufferedByte()
+/// move as many bytes as possible to m_bitBuffer
+void BinaryInputBuffer::refill()
 {
-  // (re-)fill buffer
-  if (m_cacheOffset >= m_cacheSize)
+  // number of bytes which completely fit into the bit buffer
+  unsigned int numBytes = (64 - m_bitBufferSize) / 8;
+
+  // fast path: load 8 bytes at once (little endian) and keep only as many as needed
+  if (m_cacheOffset + 8 <= m_cacheSize)
   {
-    // read as much as possible (it has to fit into the buffer, though)
-    size_t numRead = (m_bitsLeft + 7) / 8;
-    if (numRead > m_cacheSize)
-      numRead = m_cacheSize;
+    const unsigned char* next = m_cacheData + m_cacheOffset;
+    unsigned long long word = 0;
+    for (unsigned int i = 0; i < 8; i++)
+      word |= (unsigned long long)next[i] << (8 * i);
+    if (numBytes < 8)
+      word &= (1ULL << (8 * numBytes)) - 1;
+
+    m_bitBuffer     |= word << m_bitBufferSize;
+    m_bitBufferSize += 8 * numBytes;
+    m_cacheOffset   += numBytes;
+    return;
+  }
 
-    m_stream.read((char*)m_cache, numRead);
-    m_cacheOffset = 0;
+  // slow path: close to the end of the cache or the end of the file
+  while (numBytes-- > 0)
+  {
+    // (re-)fill buffer
+    if (m_cacheOffset >= m_cacheSize)
+    {
+      if (m_unreadBytes == 0)
+        return;
+      fillCache();
+    }
+
+    unsigned long long byte = m_cacheData[m_cacheOffset++];
+    m_bitBuffer     |= byte << m_bitBufferSize;
+    m_bitBufferSize += 8;
   }
+}
 
-  // count number of read bytes
-  m_read++;
 
-  // single byte
-  return m_cache[m_cacheOffset++];
+/// load next segment of the file into m_cache
+void BinaryInputBuffer::fillCache()
+{
+  // read as much as possible (it has to fit into the buffer, though)
+  unsigned int numRead = m_unreadBytes;
+  if (numRead > m_cache.size())
+    numRead = (unsigned int)m_cache.size();
+
+  if (numRead > 0)
+    m_stream.read((char*)&m_cache[0], numRead);
+  m_unreadBytes -= numRead;
+  m_cacheOffset  = 0;
+  m_cacheSize    = numRead;
 }
@@ -12,15 +12,21 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
 
 /// read a file bit-wise
 class BinaryInputBuffer
 {
 public:
-  /// read from file
-  explicit BinaryInputBuffer(const std::string& filename);
+  /// default size of the read cache (in bytes)
+  enum { DefaultCacheSize = 64*1024 };
 
-  /// get number of bytes read so far
+  /// read from file, up to cacheSize bytes are loaded at once
+  explicit BinaryInputBuffer(const std::string& filename, unsigned int cacheSize = DefaultCacheSize);
+  /// read from memory, data must remain valid as long as this object exists
+  BinaryInputBuffer(const unsigned char* data, unsigned int size);
+
+  /// get number of bytes read so far (a partially read byte counts as read)
   unsigned int   getNumBytesRead() const;
   /// get number of bits  still available
   unsigned int   getNumBitsLeft()  const;
@@ -28,36 +34,41 @@ public:
   bool           empty()           const;
 
   /// take a look at the next bits without advancing the file pointer
-  unsigned int   peekBits  (unsigned char numBits); // at most 16 bits
+  unsigned int   peekBits  (unsigned char numBits); // at most 32 bits
   /// increment buffer pointers/offsets
-  void           removeBits(unsigned char numBits); // at most 16 bits
+  void           removeBits(unsigned char numBits); // at most 32 bits
   /// get the next bits and increment buffer pointers/offsets
-  unsigned int   getBits   (unsigned char numBits); // at most 16 bits
+  unsigned int   getBits   (unsigned char numBits); // at most 32 bits
   /// get 8 bits
   unsigned char  getByte();
   /// get a single bit
   bool           getBool();
+  /// copy the next bytes, current position must be at a byte boundary
+  void           getBytes  (unsigned char* data, unsigned int numBytes);
 
 private:
-  /// simple I/O buffering, faster than C lib's built-in functions
-  unsigned char  getBufferedByte();
+  /// move as many bytes as possible to m_bitBuffer
+  void           refill();
+  /// load next segment of the file into m_cache
+  void           fillCache();
 
   /// bit/byte file stream
   std::ifstream m_stream;
-  /// total number of bytes read so far
-  unsigned int  m_read;
+  /// file size in bytes
+  unsigned int  m_size;
   /// total bits left (initially, it's 8*m_size)
   unsigned int  m_bitsLeft;
+  /// bytes which are neither in m_cache nor in m_bitBuffer yet
+  unsigned int  m_unreadBytes;
   /// store bits until next byte boundary
-  unsigned int  m_bitBuffer;
-  /// number of valid bits in _bitBuffer
+  unsigned long long m_bitBuffer;
+  /// number of valid bits in m_bitBuffer
   unsigned char m_bitBufferSize;
 
-  /// default buffer size
-  enum { CacheSize = 1024 };
-
-  /// buffer
-  unsigned char m_cache[CacheSize];
+  /// buffer (only used when reading from a file)
+  std::vector<unsigned char> m_cache;
+  /// first byte of either m_cache or the memory block
+  const unsigned char* m_cacheData;
   /// position of next byte
   unsigned int  m_cacheOffset;
   /// position beyond last valid byte
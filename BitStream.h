@@ -0,0 +1,162 @@
+// //////////////////////////////////////////////////////////
+// BitStream.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+using std::size_t;
+
+
+/// append-only sequence of bits (lowest bit first, same as GIF and .Z), packed into 64 bit words
+class BitStream
+{
+public:
+  /// raw bytes
+  typedef std::vector<unsigned char> Bytes;
+
+  BitStream()
+  : m_words(), m_numBits(0)
+  {}
+
+  /// number of bits
+  size_t size() const
+  {
+    return m_numBits;
+  }
+
+  /// true if no bits at all
+  bool empty() const
+  {
+    return m_numBits == 0;
+  }
+
+  /// number of bytes, the last one may be incomplete
+  size_t getNumBytes() const
+  {
+    return (m_numBits + 7) / 8;
+  }
+
+  /// avoid reallocations until more than numBits bits are stored
+  void reserve(size_t numBits)
+  {
+    m_words.reserve((numBits + WordBits - 1) / WordBits);
+  }
+
+  /// exchange contents
+  void swap(BitStream& other)
+  {
+    m_words.swap(other.m_words);
+    std::swap(m_numBits, other.m_numBits);
+  }
+
+  /// append the lowest numBits bits of value (at most 32 bits)
+  void add(unsigned int value, unsigned char numBits)
+  {
+    if (numBits == 0)
+      return;
+
+    Word bits = value & ((Word(1) << numBits) - 1);
+    unsigned int used = (unsigned int)(m_numBits % WordBits);
+    if (used == 0)
+      m_words.push_back(bits);
+    else
+    {
+      m_words.back() |= bits << used;
+      // split across two words
+      if (used + numBits > WordBits)
+        m_words.push_back(bits >> (WordBits - used));
+    }
+
+    m_numBits += numBits;
+  }
+
+  /// append numBits zeros
+  void addZeros(size_t numBits)
+  {
+    // all unused bits of the last word are always zero
+    m_numBits += numBits;
+    m_words.resize((m_numBits + WordBits - 1) / WordBits, 0);
+  }
+
+  /// append zeros until the number of bits is a multiple of 8
+  void fillByte()
+  {
+    addZeros((8 - m_numBits % 8) % 8);
+  }
+
+  /// append another stream
+  void append(const BitStream& other)
+  {
+    if (other.empty())
+      return;
+
+    unsigned int used = (unsigned int)(m_numBits % WordBits);
+    if (used == 0)
+      m_words.insert(m_words.end(), other.m_words.begin(), other.m_words.end());
+    else
+    {
+      m_words.reserve((m_numBits + other.m_numBits + WordBits - 1) / WordBits + 1);
+      for (size_t i = 0; i < other.m_words.size(); i++)
+      {
+        Word word = other.m_words[i];
+        m_words.back() |= word << used;
+        m_words.push_back(word >> (WordBits - used));
+      }
+    }
+
+    m_numBits += other.m_numBits;
+    // remove a superfluous word (contains only zeros)
+    m_words.resize((m_numBits + WordBits - 1) / WordBits);
+  }
+
+  /// get a single bit
+  bool operator[](size_t index) const
+  {
+    return ((m_words[index / WordBits] >> (index % WordBits)) & 1) != 0;
+  }
+
+  /// get bits 8*index ... 8*index+7, missing bits of the last byte are zero
+  unsigned char getByte(size_t index) const
+  {
+    return (unsigned char)(m_words[index / 8] >> (8 * (index % 8)));
+  }
+
+  /// copy numBytes bytes, starting with byte number first, to destination (the whole range must be part of the stream)
+  void copyBytes(size_t first, size_t numBytes, unsigned char* destination) const
+  {
+    if (numBytes == 0)
+      return;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // words are stored lowest byte first, too
+    memcpy(destination, (const unsigned char*)m_words.data() + first, numBytes);
+#else
+    for (size_t i = 0; i < numBytes; i++)
+      destination[i] = getByte(first + i);
+#endif
+  }
+
+  /// convert to bytes, missing bits of the last byte are zero
+  Bytes toBytes() const
+  {
+    Bytes result(getNumBytes());
+    copyBytes(0, result.size(), result.data());
+    return result;
+  }
+
+private:
+  /// storage unit
+  typedef unsigned long long Word;
+  /// bits per storage unit
+  enum { WordBits = 64 };
+
+  /// all bits, unused bits of the last word are zero
+  std::vector<Word> m_words;
+  /// number of valid bits
+  size_t            m_numBits;
+};
@@ -21,105 +21,94 @@
 #include <iomanip>
 #endif
 
-// statics
-bool Compress::verbose = false;
-
 /// load file
-Compress::Compress(const std::string& filename, bool loadAsUncompressedIfWrongMagicBytes)
+Compress::Compress(const std::string& filename, bool loadAsUncompressedIfWrongMagicBytes, bool verbose)
 : m_settings(0),
-  m_input(filename),
+  m_source(filename),
+  m_input(m_source.getData(), (unsigned int)m_source.getSize()),
   m_data()
 {
-  try
+  parse(loadAsUncompressedIfWrongMagicBytes, verbose, NULL);
+}
+
+
+/// load from memory, data must remain valid as long as this object exists, the decoder's tables are optional (NULL => temporary tables)
+Compress::Compress(const unsigned char* data, size_t size, bool loadAsUncompressedIfWrongMagicBytes, bool verbose,
+                   LzwDecoder::Tables* tables)
+: m_settings(0),
+  m_source(data, size),
+  m_input(m_source.getData(), (unsigned int)m_source.getSize()),
+  m_data()
+{
+  parse(loadAsUncompressedIfWrongMagicBytes, verbose, tables);
+}
+
+
+/// parse the whole file
+void Compress::parse(bool loadAsUncompressedIfWrongMagicBytes, bool verbose, LzwDecoder::Tables* tables)
+{
+  if (m_input.empty())
+    throw "file not found or empty";
+
+  // check magic bytes
+  bool isZ = (m_input.getByte() == MagicByte1);
+  isZ     |= (m_input.getByte() == MagicByte2);
+
+  // has proper magic bytes ?
+  if (isZ)
   {
-    if (m_input.empty())
-      throw "file not found or empty";
-
-    // check magic bytes
-    bool isZ = (m_input.getByte() == MagicByte1);
-    isZ     |= (m_input.getByte() == MagicByte2);
-
-    // has proper magic bytes ?
-    if (isZ)
-    {
-      // compression settings
-      m_settings = m_input.getByte();
-      // default format is "block mode", where the highest bit is set
-      if ((m_settings & 0x80) == 0)
-        throw "only .Z block mode supported";
-      // unused bits, must be zero
-      if ((m_settings & 0x60) != 0)
-        throw "unknown .Z format flag found";
-
-      // maximum bits per LZW code, almost always 16
-      unsigned char maxBits = m_settings & 0x1F;
-
-      // get filesize
-      std::fstream in(filename.c_str(), std::ios::in | std::ios::binary);
-      in.seekg(0, in.end);
-      unsigned int filesize = (unsigned int)in.tellg();
-      unsigned int expected = 3 * filesize; // crude heuristic for size of uncompressed data
-      in.close();
-
-      // and decompress !
-      LzwDecoder::verbose = Compress::verbose;
-      LzwDecoder lzw(m_input, false, 8, maxBits, expected);
-      m_data = lzw.getBytes();
-    }
-    else
-    {
-      // should it have a .Z file ?
-      if (!loadAsUncompressedIfWrongMagicBytes)
-        throw "file is not a .Z compressed file (magic bytes don't match)";
-
-      // just read from disk
-      std::fstream in(filename.c_str(), std::ios::in | std::ios::binary);
-      // get filesize
-      in.seekg(0, in.end);
-      size_t numBytes = (size_t)in.tellg();
-      // allocate memory and read everything at once
-      m_data.resize(numBytes);
-      in.seekg(0, in.beg);
-      in.read((char*)&m_data[0], numBytes);
-    }
+    // compression settings
+    m_settings = m_input.getByte();
+    // default format is "block mode", where the highest bit is set
+    if ((m_settings & 0x80) == 0)
+      throw "only .Z block mode supported";
+    // unused bits, must be zero
+    if ((m_settings & 0x60) != 0)
+      throw "unknown .Z format flag found";
+
+    // maximum bits per LZW code, almost always 16
+    unsigned char maxBits = m_settings & 0x1F;
+
+    // crude heuristic for size of uncompressed data
+    unsigned int expected = 3 * (unsigned int)m_source.getSize();
+
+    // and decompress !
+    LzwDecoder lzw(m_input, false, 8, maxBits, expected, verbose, tables);
+    lzw.moveBytes(m_data);
   }
-  catch (const char* e)
+  else
   {
-#ifdef ALLOW_VERBOSE
-    std::cout << "ERROR: " << (e ? e : "(unknown exception)") << std::endl;
-#endif
+    // should it have a .Z file ?
+    if (!loadAsUncompressedIfWrongMagicBytes)
+      throw "file is not a .Z compressed file (magic bytes don't match)";
+
+    // just copy everything
+    m_data.assign(m_source.getData(), m_source.getData() + m_source.getSize());
+    // header of the output: block mode, up to 16 bits per code (same as the encoder)
+    m_settings = 0x80 | 16;
   }
 }
 
 
-/// replace LZW data with optimized data and write to disk
-unsigned int Compress::writeOptimized(const std::string& filename, const std::vector<bool>& bits)
+/// replace LZW data with optimized data and append to output, return number of bytes
+unsigned int Compress::writeOptimized(Bytes& output, const BitStream& bits) const
 {
-  std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
-  // write magic bytes
-  file.put((char)MagicByte1);
-  file.put((char)MagicByte2);
+  // allocate memory only once: three header bytes followed by LZW data
+  size_t numBytes = 3 + bits.getNumBytes();
+  size_t before   = output.size();
+  output.resize(before + numBytes);
+  unsigned char* write = output.data() + before;
+
+  // magic bytes
+  write[0] = MagicByte1;
+  write[1] = MagicByte2;
   // and settings
-  file.put((char)m_settings);
+  write[2] = m_settings;
 
-  unsigned int pos = 0;
-  // merge single bits, write to disk
-  while (pos < bits.size())
-  {
-    // create one byte
-    unsigned char oneByte = 0;
-    for (unsigned char bit = 0; bit < 8; bit++, pos++)
-      if (pos < bits.size() && bits[pos])
-        oneByte |= 1 << bit;
-
-    // and write to disk
-    file << oneByte;
-  }
+  // copy straight from the bitstream
+  bits.copyBytes(0, bits.getNumBytes(), write + 3);
 
-  // and we're done
-  unsigned int filesize = (unsigned int)file.tellp();
-  file.close();
-  return filesize;
+  return (unsigned int)numBytes;
 }
 
 
@@ -130,6 +119,13 @@ const Compress::Bytes& Compress::getData() const
 }
 
 
+/// maximum bits per LZW code (stored in the header)
+unsigned char Compress::getMaxCodeSize() const
+{
+  return m_settings & 0x1F;
+}
+
+
 /// for debugging only: save uncompressed data
 bool Compress::dump(const std::string& filename) const
 {
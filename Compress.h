@@ -6,6 +6,9 @@
 #pragma once
 
 #include "BinaryInputBuffer.h"
+#include "InputSource.h"
+#include "BitStream.h"
+#include "LzwDecoder.h"
 
 #include <vector>
 #include <string>
@@ -21,20 +24,22 @@ public:
 
   // -------------------- methods --------------------
   /// load file
-  explicit Compress(const std::string& filename, bool loadAsUncompressedIfWrongMagicBytes = false);
+  explicit Compress(const std::string& filename, bool loadAsUncompressedIfWrongMagicBytes = false, bool verbose = false);
+  /// load from memory, data must remain valid as long as this object exists, the decoder's tables are optional (NULL => temporary tables)
+  Compress(const unsigned char* data, size_t size, bool loadAsUncompressedIfWrongMagicBytes = false, bool verbose = false,
+           LzwDecoder::Tables* tables = NULL);
 
-  /// replace LZW data with optimized data and write to disk
-  unsigned int writeOptimized(const std::string& filename, const std::vector<bool>& bits);
+  /// replace LZW data with optimized data and append to output, return number of bytes
+  unsigned int writeOptimized(Bytes& output, const BitStream& bits) const;
 
   /// get uncompressed contents
   const Bytes& getData() const;
+  /// maximum bits per LZW code (stored in the header)
+  unsigned char getMaxCodeSize() const;
 
   /// for debugging only: save uncompressed data
   bool dump(const std::string& filename) const;
 
-  /// show debug output
-  static bool verbose;
-
 private:
   /// first two bytes of every .Z file
   enum
@@ -43,10 +48,15 @@ private:
     MagicByte2 = 0x9D
   };
 
+  /// parse the whole file
+  void parse(bool loadAsUncompressedIfWrongMagicBytes, bool verbose, LzwDecoder::Tables* tables);
+
   /// settings of the original file (third byte of that file)
   unsigned char     m_settings;
 
-  /// simple wrapper to read file bit-wise
+  /// memory-mapped file or caller's memory block
+  InputSource       m_source;
+  /// simple wrapper to read m_source bit-wise
   BinaryInputBuffer m_input;
   /// uncompressed bytes
   Bytes             m_data;
@@ -9,6 +9,8 @@
 #include "LzwDecoder.h"
 
 #include <fstream>
+#include <algorithm>
+#include <cstring>
 
 #define ALLOW_VERBOSE
 #ifdef  ALLOW_VERBOSE
@@ -16,12 +18,35 @@
 #include <iomanip>
 #endif
 
-// statics
-bool GifImage::verbose = false;
+
+// local stuff
+namespace
+{
+  /// position of the Graphic Control Extension's packed byte in a frame header, 0 if there is none
+  /** layout: 0x21 0xF9 0x04 packed delay(2 bytes) transparentIndex 0x00 **/
+  size_t findGraphicControl(const unsigned char* header, size_t size)
+  {
+    size_t pos = 0;
+    while (pos + 2 < size && header[pos] == 0x21)
+    {
+      if (header[pos + 1] == GifImage::GraphicControl && header[pos + 2] == 4 && pos + 7 < size)
+        return pos + 3;
+
+      // skip extension: marker, identifier and all its parts
+      pos += 2;
+      while (pos < size && header[pos] != 0)
+        pos += header[pos] + 1;
+      pos++;
+    }
+    return 0;
+  }
+}
+
 
 /// load file
-GifImage::GifImage(const std::string& filename)
+GifImage::GifImage(const std::string& filename, bool verbose, bool decodeFrames)
 : m_rawHeader(),
+  m_header(),
   m_rawTrailer(),
   m_version(),
   m_width(0),
@@ -32,96 +57,141 @@ GifImage::GifImage(const std::string& filename)
   m_backgroundColor(0),
   m_aspectRatio(0),
   m_isAnimated(false),
+  m_verbose(verbose),
   m_globalColorMap(),
-  m_input(filename),
-  m_frames()
+  m_source(filename),
+  m_input(m_source.getData(), (unsigned int)m_source.getSize()),
+  m_frames(),
+  m_decoderTables()
 {
-  try
-  {
-    if (m_input.empty())
-      throw "file not found or empty";
+  parse(filename, decodeFrames);
+}
+
+
+/// load from memory, data must remain valid as long as this object exists
+GifImage::GifImage(const unsigned char* data, size_t size, bool verbose, bool decodeFrames)
+: m_rawHeader(),
+  m_header(),
+  m_rawTrailer(),
+  m_version(),
+  m_width(0),
+  m_height(0),
+  m_colorDepth(0),
+  m_isSorted(false),
+  m_sizeGlobalColorMap(0),
+  m_backgroundColor(0),
+  m_aspectRatio(0),
+  m_isAnimated(false),
+  m_verbose(verbose),
+  m_globalColorMap(),
+  m_source(data, size),
+  m_input(m_source.getData(), (unsigned int)m_source.getSize()),
+  m_frames(),
+  m_decoderTables()
+{
+  parse("", decodeFrames);
+}
 
-    // parse header
-    parseSignature();
-    parseGlobalDescriptor();
+
+/// parse the whole image, name is only used for debug output (may be empty)
+void GifImage::parse(const std::string& name, bool decodeFrames)
+{
+  if (m_input.empty())
+    throw "file not found or empty";
+
+  // parse header
+  parseSignature();
+  parseGlobalDescriptor();
 
 #ifdef ALLOW_VERBOSE
-    if (verbose)
-      std::cout << "'" << filename << "' image size " << m_width << "x" << m_height << ", " << (1 << m_colorDepth) << " colors" << std::endl;
+  if (m_verbose)
+    std::cout << (name.empty() ? "" : "'" + name + "' ") << "image size " << m_width << "x" << m_height << ", " << (1 << m_colorDepth) << " colors" << std::endl;
 #endif
 
-    // copy global header
-    size_t numBytesHeader = m_input.getNumBytesRead();
-    std::ifstream rawFile(filename.c_str(), std::ios::in | std::ios::binary);
-    m_rawHeader.resize(numBytesHeader);
-    rawFile.read((char*)&m_rawHeader[0], numBytesHeader);
+  // global header
+  size_t numBytesHeader = m_input.getNumBytesRead();
+  m_rawHeader = m_source.getView(0, numBytesHeader);
 
-    unsigned int totalLzwBits = 0;
+  unsigned int totalLzwBits = 0;
 
-    // decompress LZW
-    while (true)
-    {
-      unsigned int bytesReadSoFar = m_input.getNumBytesRead();
+  // decompress LZW
+  while (true)
+  {
+    unsigned int bytesReadSoFar = m_input.getNumBytesRead();
 
-      // technically it's impossible to encounter the end-of-file marker before the first frame
-      unsigned char marker = m_input.peekBits(8);
-      if (marker == 0x3B)
-        break;
+    // technically it's impossible to encounter the end-of-file marker before the first frame
+    unsigned char marker = m_input.peekBits(8);
+    if (marker == 0x3B)
+      break;
 
 #ifdef ALLOW_VERBOSE
-      if (verbose)
-        std::cout << "decompress frame " << (m_frames.size() + 1) << ": ";
+    if (m_verbose)
+      std::cout << "decompress frame " << (m_frames.size() + 1) << ": ";
 #endif
 
-      Frame frame;
-
-      // parse frame header
-      parseExtensions     (frame);
-      parseLocalDescriptor(frame);
-
-      // and copy frame header
-      unsigned int frameHeaderSize = m_input.getNumBytesRead() - bytesReadSoFar;
-      frame.rawHeader.resize(frameHeaderSize);
-      rawFile.seekg(bytesReadSoFar);
-      rawFile.read((char*)&frame.rawHeader[0], frameHeaderSize);
-
-      // decode LZW stream
-      unsigned char minCodeSize = m_input.getByte();
-      unsigned char maxCodeSize = 12; // constant value according to spec
-      LzwDecoder::verbose = GifImage::verbose;
-      LzwDecoder lzw(m_input, true, minCodeSize, maxCodeSize, m_width * m_height);
-      frame.pixels     = lzw.getBytes();
-      frame.codeSize   = lzw.getCodeSize();
-      totalLzwBits    += lzw.getNumCompressedBits();
-      frame.numLzwBits = lzw.getNumCompressedBits();
-
-      // yeah, finished another frame ...
-      m_frames.push_back(frame);
-    }
+    Frame frame;
+
+    // parse frame header
+    parseExtensions     (frame);
+    parseLocalDescriptor(frame);
+
+    // and frame header
+    unsigned int frameHeaderSize = m_input.getNumBytesRead() - bytesReadSoFar;
+    frame.rawHeader      = m_source.getView(bytesReadSoFar, frameHeaderSize);
+    // parseLocalDescriptor() found the file position of the interlaced flag
+    frame.posInterlaced -= bytesReadSoFar;
+
+    // skip LZW stream, decodeFrame() will look at it later
+    frame.codeSize    = m_input.getByte();
+    frame.rawCodeSize = frame.codeSize;
+    frame.isDecoded   = false;
+    frame.isModified  = false;
+    frame.isRemapped  = false;
+    frame.numLzwBits  = 0;
+    unsigned int lzwStart = m_input.getNumBytesRead();
+    while (true)
+    {
+      unsigned char length = m_input.getByte();
+      // last block ?
+      if (length == 0)
+        break;
 
-    // read/copy the last bytes of the file, too
-    m_rawTrailer = { (unsigned char)m_input.peekBits(8) };
-    parseTerminator();
+      unsigned char block[255];
+      m_input.getBytes(block, length);
+    }
+    frame.rawLzw = m_source.getView(lzwStart, m_input.getNumBytesRead() - lzwStart);
 
-    if (!m_input.empty() != 0)
-      throw "there is still some data left ...";
+    // yeah, finished another frame ...
+    m_frames.push_back(frame);
 
-#ifdef ALLOW_VERBOSE
-    if (verbose)
+    if (decodeFrames)
     {
-      const char* frames = (m_frames.size() == 1) ? "frame" : "frames";
-      std::cout << m_frames.size() << " " << frames << ", " << totalLzwBits << " bits, " << m_frames.front().pixels.size() << " pixels plus " << numBytesHeader << " header bytes" << std::endl;
+      decodeFrame((unsigned int)m_frames.size() - 1, &m_decoderTables);
+      totalLzwBits += m_frames.back().numLzwBits;
     }
+#ifdef ALLOW_VERBOSE
+    else if (m_verbose)
+      std::cout << ", " << (int)frame.codeSize << " bits" << std::endl;
 #endif
   }
-  catch (const char* e)
-  {
+
+  // the last bytes of the file, too
+  m_rawTrailer = m_source.getView(m_input.getNumBytesRead(), 1);
+  parseTerminator();
+
+  if (!m_input.empty() != 0)
+    throw "there is still some data left ...";
+
 #ifdef ALLOW_VERBOSE
-    std::cout << "ERROR: " << (e ? e : "(unknown exception)") << std::endl;
-#else
-    throw;
-#endif
+  if (m_verbose)
+  {
+    const char* frames = (m_frames.size() == 1) ? "frame" : "frames";
+    std::cout << m_frames.size() << " " << frames << ", ";
+    if (decodeFrames)
+      std::cout << totalLzwBits << " bits, ";
+    std::cout << m_frames.front().width * m_frames.front().height << " pixels plus " << numBytesHeader << " header bytes" << std::endl;
   }
+#endif
 }
 
 
@@ -142,6 +212,105 @@ const GifImage::Frame& GifImage::getFrame(unsigned int frame) const
 }
 
 
+/// decode a frame (if it isn't decoded yet), different frames can be decoded by different threads at the same time
+void GifImage::decodeFrame(unsigned int frame, LzwDecoder::Tables* tables)
+{
+  if (frame >= m_frames.size())
+    throw "invalid frame number";
+
+  Frame& current = m_frames[frame];
+  if (current.isDecoded)
+    return;
+
+  // decode LZW stream
+  BinaryInputBuffer input(current.rawLzw.data, (unsigned int)current.rawLzw.size);
+  unsigned char maxCodeSize = 12; // constant value according to spec
+  LzwDecoder lzw(input, true, current.rawCodeSize, maxCodeSize, current.width * current.height, m_verbose, tables);
+  lzw.moveBytes(current.pixels);
+  current.numLzwBits = lzw.getNumCompressedBits();
+  current.isDecoded  = true;
+
+  // remapColors() was called before
+  if (!current.remap.empty())
+    for (size_t i = 0; i < current.pixels.size(); i++)
+      current.pixels[i] = current.remap[current.pixels[i]];
+
+  // setInterlacing() was called before
+  if (current.isInterlaced != current.wasInterlaced)
+    reorderLines(current.pixels, current.width, current.height, current.isInterlaced);
+}
+
+
+/// free memory of a decoded frame, decodeFrame() can restore it
+void GifImage::releaseFrame(unsigned int frame)
+{
+  if (frame >= m_frames.size())
+    throw "invalid frame number";
+
+  // cropped frames can't be restored from their LZW data
+  Frame& current = m_frames[frame];
+  if (current.isModified)
+    return;
+
+  Bytes().swap(current.pixels);
+  current.isDecoded = false;
+}
+
+
+/// decode frames one after another, only the current frame's pixels are kept in memory
+GifImage::FrameIterator::FrameIterator(GifImage& image)
+: m_image(image),
+  m_current(0),
+  m_isValid(false)
+{
+}
+
+
+/// release the current frame
+GifImage::FrameIterator::~FrameIterator()
+{
+  if (m_isValid)
+    m_image.releaseFrame(m_current);
+}
+
+
+/// release the current frame and decode the next frame, return false if there are no more frames
+bool GifImage::FrameIterator::next()
+{
+  if (m_isValid)
+  {
+    m_image.releaseFrame(m_current);
+    m_current++;
+  }
+
+  m_isValid = (m_current < m_image.getNumFrames());
+  if (m_isValid)
+    m_image.decodeFrame(m_current, &m_image.m_decoderTables);
+  return m_isValid;
+}
+
+
+/// current frame (only valid after next() returned true)
+const GifImage::Frame& GifImage::FrameIterator::operator*() const
+{
+  return m_image.getFrame(m_current);
+}
+
+
+/// current frame (only valid after next() returned true)
+const GifImage::Frame* GifImage::FrameIterator::operator->() const
+{
+  return &m_image.getFrame(m_current);
+}
+
+
+/// index of the current frame
+unsigned int GifImage::FrameIterator::getIndex() const
+{
+  return m_current;
+}
+
+
 /// color depth (bits per pixel)
 unsigned char GifImage::getColorDepth() const
 {
@@ -149,12 +318,37 @@ unsigned char GifImage::getColorDepth() const
 }
 
 
-/// replace LZW data with optimized data and write to disk (bitDepth = 0 means "take value from m_colorDepth")
-unsigned int GifImage::writeOptimized(const std::string& filename, const std::vector<std::vector<bool> >& bits, unsigned char bitDepth)
+/// replace LZW data with optimized data and append to output, return number of bytes (bitDepth = 0 means "take value from m_colorDepth"),
+/// frames with an empty bitstream keep their original LZW data
+unsigned int GifImage::writeOptimized(Bytes& output, const std::vector<BitStream>& bits, unsigned char bitDepth) const
 {
-  std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
-  // write original header
-  file.write((char*)&m_rawHeader[0], m_rawHeader.size());
+  // each block contains at most 255 bytes
+  const size_t MaxBytesPerBlock = 255;
+
+  // determine final size: header, all frames and trailer
+  const unsigned char* header     = m_header.empty() ? m_rawHeader.data : m_header.data();
+  const size_t         headerSize = m_header.empty() ? m_rawHeader.size : m_header.size();
+  size_t numBytes = headerSize + m_rawTrailer.size;
+  for (unsigned int frame = 0; frame < bits.size(); frame++)
+  {
+    // frame header, minCodeSize, LZW data split into blocks with length prefix, empty block
+    const Frame& current = m_frames[frame];
+    size_t lzwBytes = bits[frame].getNumBytes();
+    if (bits[frame].empty())
+      numBytes += current.rawHeader.size + 1 + current.rawLzw.size;
+    else
+      numBytes += (current.header.empty() ? current.rawHeader.size : current.header.size()) + 1 +
+                  lzwBytes + (lzwBytes + MaxBytesPerBlock - 1) / MaxBytesPerBlock + 1;
+  }
+
+  // allocate memory only once
+  size_t before = output.size();
+  output.resize(before + numBytes);
+  unsigned char* write = output.data() + before;
+
+  // original header (or with a smaller global color map)
+  memcpy(write, header, headerSize);
+  write += headerSize;
 
   // bits per pixel/code
   if (bitDepth == 0)
@@ -162,52 +356,61 @@ unsigned int GifImage::writeOptimized(const std::string& filename, const std::ve
 
   for (unsigned int frame = 0; frame < bits.size(); frame++)
   {
-    // frame header
-    file.write((char*)&m_frames[frame].rawHeader[0], m_frames[frame].rawHeader.size());
+    // frame header, setInterlacing() may have changed the interlaced flag
+    // (the original LZW data belongs to the original header, new LZW data to the cropped frame)
+    const Frame& current = m_frames[frame];
+    const BitStream& lzw = bits[frame];
+    size_t frameHeaderSize = current.rawHeader.size;
+    if (lzw.empty() || current.header.empty())
+      memcpy(write, current.rawHeader.data, frameHeaderSize);
+    else
+    {
+      frameHeaderSize = current.header.size();
+      memcpy(write, current.header.data(), frameHeaderSize);
+    }
+    const unsigned char mask = 0x40;
+    if (current.isInterlaced)
+      write[current.posInterlaced] |=  mask;
+    else
+      write[current.posInterlaced] &= ~mask;
+    write += frameHeaderSize;
 
     // minCodeSize
-    file << m_frames[frame].codeSize;
+    *write++ = lzw.empty() ? current.rawCodeSize : current.codeSize;
 
-    // iterate over bits
-    const std::vector<bool>& current = bits[frame];
-    unsigned int pos = 0;
-    while (pos < current.size())
+    // keep original LZW data (including block lengths and the empty block)
+    if (lzw.empty())
     {
-      // each block contains at most 255 bytes (=255*8 bits)
-      unsigned int bitsCurrentBlock = (unsigned int)current.size() - pos;
-      const unsigned int MaxBitsPerBlock = 255*8;
-      if (bitsCurrentBlock > MaxBitsPerBlock)
-        bitsCurrentBlock = MaxBitsPerBlock;
-
-      // size in bytes, round up
-      unsigned char blockSize = (bitsCurrentBlock + 7) / 8;
-      file << blockSize;
-
-      // merge single bits, write to disk
-      for (unsigned int i = 0; i < blockSize; i++)
-      {
-        // create one byte
-        unsigned char oneByte = 0;
-        for (unsigned char bit = 0; bit < 8 && pos < current.size(); bit++, pos++)
-          if (current[pos])
-            oneByte |= 1 << bit;
-
-        // and write to disk
-        file << oneByte;
-      }
+      memcpy(write, current.rawLzw.data, current.rawLzw.size);
+      write += current.rawLzw.size;
+      continue;
+    }
+
+    // copy straight from the bitstream
+    size_t lzwBytes = lzw.getNumBytes();
+    size_t pos = 0;
+    while (pos < lzwBytes)
+    {
+      size_t bytesCurrentBlock = lzwBytes - pos;
+      if (bytesCurrentBlock > MaxBytesPerBlock)
+        bytesCurrentBlock = MaxBytesPerBlock;
+
+      // block size and its bytes
+      *write++ = (unsigned char)bytesCurrentBlock;
+      lzw.copyBytes(pos, bytesCurrentBlock, write);
+      write += bytesCurrentBlock;
+      pos   += bytesCurrentBlock;
     }
 
     // add an empty block after each image
-    file << (unsigned char) 0;
+    *write++ = 0;
   }
 
-  // write terminator
-  file.write((char*)&m_rawTrailer[0], m_rawTrailer.size());
+  // terminator
+  memcpy(write, m_rawTrailer.data, m_rawTrailer.size);
 
   // and we're done
-  unsigned int filesize = (unsigned int)file.tellp();
-  file.close();
-  return filesize;
+  return (unsigned int)numBytes;
 }
 
 
@@ -265,109 +468,485 @@ bool GifImage::dumpIndices(const std::string& filename, unsigned int frame) cons
 /// convert from non-interlaced to interlaced (and vice versa)
 void GifImage::setInterlacing(bool makeInterlaced)
 {
-  if (m_frames.size() != 1)
-    throw "code doesn't work yet for animated GIFs";
-
-  unsigned int posInterlaced = m_frames.front().posInterlaced;
-  if (posInterlaced == 0)
-    throw "interlaced bit not found";
+  for (unsigned int frame = 0; frame < m_frames.size(); frame++)
+    if (m_frames[frame].posInterlaced == 0)
+      throw "interlaced bit not found";
 
-  if (m_isAnimated)
-    throw "interlacing in animation not supported yet";
+  for (unsigned int frame = 0; frame < m_frames.size(); frame++)
+  {
+    Frame& current = m_frames[frame];
+    // keep current interlacing mode ?
+    if (current.isInterlaced == makeInterlaced)
+      continue;
+
+    // flag will be written by writeOptimized, frames which aren't decoded yet will be re-ordered by decodeFrame()
+    current.isInterlaced = makeInterlaced;
+    if (current.isDecoded)
+      reorderLines(current.pixels, current.width, current.height, makeInterlaced);
+  }
+}
 
-  // interlacing doesn't matter for a single line
-  if (m_height <= 1)
-    return;
 
-  const unsigned char mask = 0x40;
-  bool isInterlaced = (m_rawHeader[posInterlaced] & mask) != 0;
-  // keep current interlacing mode ?
-  if (isInterlaced == makeInterlaced)
-    return;
+/// animations: crop frames to the pixels which differ from the previous frame and replace unchanged pixels by the transparent index,
+/// the rendered animation remains pixel-identical, return number of modified frames (their pixels stay decoded)
+unsigned int GifImage::cropFrames()
+{
+  if (m_frames.size() <= 1)
+    return 0;
 
-  // line order:
-  // A) every 8th row, beginning with 0th row
-  // B) every 8th row, beginning with 4th row
-  // C) every 4th row, beginning with 2nd row
-  // D) every 2nd row, beginning with 1st row
+  // RGB colors of the canvas, the initial canvas and "restore to background" are viewer-dependent
+  // => they get a special value which never appears in a palette (and is never considered unchanged)
+  const int Background = -1;
+  std::vector<int> canvas(m_width * m_height, Background);
+  // canvas before the current frame, only needed for "restore to previous"
+  std::vector<int> previous;
 
+  unsigned int numModified = 0;
   for (unsigned int frame = 0; frame < m_frames.size(); frame++)
   {
-    Bytes& current = m_frames[frame].pixels;
+    Frame& current = m_frames[frame];
+    bool wasDecoded = current.isDecoded;
+    decodeFrame(frame, &m_decoderTables);
+
+    // disposal method and transparency are stored in the Graphic Control Extension
+    Bytes header = current.header;
+    if (header.empty())
+      header.assign(current.rawHeader.data, current.rawHeader.data + current.rawHeader.size);
+    size_t posControl = findGraphicControl(header.data(), header.size());
+    unsigned char packed    = (posControl > 0) ? header[posControl] : 0;
+    unsigned int  disposal  = (packed >> 2) & 7;
+    bool hasTransparency    = (packed & 1) != 0;
+    unsigned int  transparent = hasTransparency ? header[posControl + 3] : 0;
+
+    // undefined disposal methods: can't predict what viewers do with the next frames
+    if (disposal > 3)
+    {
+      if (!wasDecoded)
+        releaseFrame(frame);
+      break;
+    }
 
-    if (makeInterlaced)
+    // pixels in display order
+    const unsigned int width  = current.width;
+    const unsigned int height = current.height;
+    Bytes interlaced;
+    const Bytes* pixels = &current.pixels;
+    if (current.isInterlaced && current.pixels.size() == width * height)
     {
-      // non-interlaced => interlaced
-
-      // set flag
-      m_rawHeader[posInterlaced] |= mask;
-
-      // re-order lines
-      Bytes interlaced;
-      interlaced.reserve(current.size());
-      for (unsigned int y = 0; y < m_height; y += 8)
-        interlaced.insert(interlaced.end(), current.begin() + y * m_width, current.begin() + y * m_width + m_width);
-      for (unsigned int y = 4; y < m_height; y += 8)
-        interlaced.insert(interlaced.end(), current.begin() + y * m_width, current.begin() + y * m_width + m_width);
-      for (unsigned int y = 2; y < m_height; y += 4)
-        interlaced.insert(interlaced.end(), current.begin() + y * m_width, current.begin() + y * m_width + m_width);
-      for (unsigned int y = 1; y < m_height; y += 2)
-        interlaced.insert(interlaced.end(), current.begin() + y * m_width, current.begin() + y * m_width + m_width);
-      current = interlaced;
+      interlaced = current.pixels;
+      reorderLines(interlaced, width, height, false);
+      pixels = &interlaced;
     }
-    else
+
+    // indices to RGB
+    const std::vector<Color>& colorMap = current.localColorMap.empty() ? m_globalColorMap : current.localColorMap;
+    int colors[256];
+    for (unsigned int i = 0; i < 256; i++)
+      if (i < colorMap.size())
+        colors[i] = (colorMap[i].red << 16) | (colorMap[i].green << 8) | colorMap[i].blue;
+      else
+        colors[i] = (1 << 24) + i; // invalid index, rendering is viewer-dependent but consistent
+
+    // only the visible part of the frame is drawn
+    unsigned int visibleWidth  = 0;
+    unsigned int visibleHeight = 0;
+    if (current.offsetLeft < m_width && current.offsetTop < m_height)
+    {
+      visibleWidth  = std::min(width,  m_width  - current.offsetLeft);
+      visibleHeight = std::min(height, m_height - current.offsetTop);
+    }
+    if (pixels->size() < width * height && width > 0)
+      visibleHeight = std::min(visibleHeight, (unsigned int)(pixels->size() / width));
+
+    // "restore to background" clears the whole frame area, a cropped frame would clear less
+    bool canCrop = disposal != 2 && !current.isInterlaced &&
+                   current.codeSize <= 8 && visibleWidth == width && visibleHeight == height && pixels->size() == width * height &&
+                   current.posInterlaced >= 9 && header[current.posInterlaced - 9] == 0x2C;
+
+    // bounding box of all pixels which aren't identical to the current canvas
+    unsigned int minX = width, maxX = 0;
+    unsigned int minY = height, maxY = 0;
+    bool used[256] = { false };
+    for (unsigned int y = 0; y < visibleHeight; y++)
+    {
+      const unsigned char* line = pixels->data() + y * width;
+      const int*           old  = canvas.data() + (current.offsetTop + y) * m_width + current.offsetLeft;
+      for (unsigned int x = 0; x < visibleWidth; x++)
+      {
+        unsigned char index = line[x];
+        if ((hasTransparency && index == transparent) || colors[index] == old[x])
+          continue;
+
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        used[index] = true;
+      }
+    }
+
+    // nothing changed at all ? a single pixel remains (a frame must have at least one pixel)
+    if (minX > maxX)
     {
-      // interlaced => non-interlaced
-
-      // unset flag
-      m_rawHeader[posInterlaced] &= ~mask;
-
-      // re-order lines
-      Bytes interlaced = current;
-      current.clear();
-
-      // offsets of the first line of each line
-      unsigned int pass0 = 0;
-      unsigned int pass1 = (m_height + 8 - 1) / 8;
-      // same as
-      //pass1 = pass0;
-      //for (unsigned int y = 0; y < m_height; y += 8)
-      //  pass1++;
-
-      unsigned int pass2 = pass1 + (m_height + 8 - 5) / 8;
-      //pass2 = pass1;
-      //for (unsigned int y = 4; y < m_height; y += 8)
-      //  pass2++;
-
-      unsigned int pass3 = pass2 + (m_height + 4 - 1) / 4;
-      //pass3 = pass2;
-      //for (unsigned int y = 2; y < m_height; y += 4)
-        //pass3++;
-
-      for (unsigned int y = 0; y < m_height; y++)
-        switch (y % 8)
+      minX = maxX = 0;
+      minY = maxY = 0;
+    }
+    unsigned int cropWidth  = maxX - minX + 1;
+    unsigned int cropHeight = maxY - minY + 1;
+
+    // unchanged pixels become transparent: if the frame has no transparent index yet then pick an unused index
+    bool addTransparency = false;
+    if (canCrop && !hasTransparency && posControl > 0)
+      for (unsigned int i = 0; i < (1U << current.codeSize); i++)
+        if (!used[i])
         {
-        case 0:
-          current.insert(current.end(), interlaced.begin() + pass0 * m_width, interlaced.begin() + (pass0 + 1) * m_width);
-          pass0++;
+          transparent     = i;
+          addTransparency = true;
           break;
+        }
+    bool useTransparency = hasTransparency || addTransparency;
 
-        case 4:
-          current.insert(current.end(), interlaced.begin() + pass1 * m_width, interlaced.begin() + (pass1 + 1) * m_width);
-          pass1++;
-          break;
+    // new pixels
+    Bytes cropped;
+    bool  isModified = false;
+    if (canCrop)
+    {
+      cropped.reserve(cropWidth * cropHeight);
+      for (unsigned int y = minY; y <= maxY; y++)
+      {
+        const unsigned char* line = pixels->data() + y * width;
+        const int*           old  = canvas.data() + (current.offsetTop + y) * m_width + current.offsetLeft;
+        for (unsigned int x = minX; x <= maxX; x++)
+        {
+          unsigned char index = line[x];
+          if (useTransparency && index != transparent && colors[index] == old[x])
+          {
+            index      = (unsigned char)transparent;
+            isModified = true;
+          }
+          cropped.push_back(index);
+        }
+      }
 
-        case 2: case 6:
-          current.insert(current.end(), interlaced.begin() + pass2 * m_width, interlaced.begin() + (pass2 + 1) * m_width);
-          pass2++;
-          break;
+      if (cropWidth != width || cropHeight != height)
+        isModified = true;
+    }
 
-        case 1: case 3: case 5: case 7:
-          current.insert(current.end(), interlaced.begin() + pass3 * m_width, interlaced.begin() + (pass3 + 1) * m_width);
-          pass3++;
-          break;
+    // draw original frame
+    if (disposal == 3)
+      previous = canvas;
+    for (unsigned int y = 0; y < visibleHeight; y++)
+    {
+      const unsigned char* line = pixels->data() + y * width;
+      int*                 draw = canvas.data() + (current.offsetTop + y) * m_width + current.offsetLeft;
+      for (unsigned int x = 0; x < visibleWidth; x++)
+        if (!hasTransparency || line[x] != transparent)
+          draw[x] = colors[line[x]];
+    }
+
+    // prepare canvas for the next frame
+    if (disposal == 2)
+      for (unsigned int y = 0; y < visibleHeight; y++)
+        std::fill_n(canvas.begin() + (current.offsetTop + y) * m_width + current.offsetLeft, visibleWidth, Background);
+    if (disposal == 3)
+      canvas.swap(previous);
+
+    if (!isModified)
+    {
+      if (!wasDecoded)
+        releaseFrame(frame);
+      continue;
+    }
+
+    // new frame header: update local descriptor and Graphic Control Extension
+    current.offsetLeft += minX;
+    current.offsetTop  += minY;
+    current.width       = cropWidth;
+    current.height      = cropHeight;
+    current.pixels.swap(cropped);
+
+    unsigned char* descriptor = &header[current.posInterlaced - 9];
+    const unsigned int values[4] = { current.offsetLeft, current.offsetTop, current.width, current.height };
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      descriptor[1 + 2*i] = values[i] & 0xFF;
+      descriptor[2 + 2*i] = values[i] >> 8;
+    }
+    if (addTransparency)
+    {
+      header[posControl]    |= 1;
+      header[posControl + 3] = (unsigned char)transparent;
+    }
+    current.header.swap(header);
+
+    current.isModified = true;
+    numModified++;
+  }
+
+#ifdef ALLOW_VERBOSE
+  if (m_verbose)
+    std::cout << "cropped " << numModified << " of " << m_frames.size() << " frames" << std::endl;
+#endif
+
+  return numModified;
+}
+
+
+/// remove unused colors from the global/local color maps, remap indices accordingly and lower each frame's LZW code size,
+/// the rendered image remains pixel-identical, return number of frames with new indices or code size
+unsigned int GifImage::remapColors()
+{
+  static const unsigned int NumIndices = 256;
+  static const unsigned int NotUsed    = NumIndices;
+
+  // find all indices used by each frame
+  unsigned int numFrames = (unsigned int)m_frames.size();
+  std::vector<std::vector<bool> > used(numFrames, std::vector<bool>(NumIndices, false));
+  std::vector<bool> usedGlobal(NumIndices, false);
+  bool canRemapGlobal = m_sizeGlobalColorMap > 0;
+  for (unsigned int frame = 0; frame < numFrames; frame++)
+  {
+    Frame& current = m_frames[frame];
+    bool wasDecoded = current.isDecoded;
+    decodeFrame(frame, &m_decoderTables);
+    for (size_t i = 0; i < current.pixels.size(); i++)
+      used[frame][current.pixels[i]] = true;
+    if (!wasDecoded)
+      releaseFrame(frame);
+
+    if (current.localColorMap.empty())
+      for (unsigned int i = 0; i < NumIndices; i++)
+        if (used[frame][i])
+        {
+          usedGlobal[i] = true;
+          // undefined colors might be rendered in any way, leave them alone
+          if (i >= m_sizeGlobalColorMap)
+            canRemapGlobal = false;
         }
+  }
+  // the background color belongs to the global color map, too
+  if (canRemapGlobal && m_backgroundColor < m_sizeGlobalColorMap)
+    usedGlobal[m_backgroundColor] = true;
+
+  // assign new indices in ascending order (keeps sorted color maps sorted), return number of colors
+  auto getMapping = [](const std::vector<bool>& isUsed, std::vector<unsigned int>& mapping)
+  {
+    mapping.assign(NumIndices, NotUsed);
+    unsigned int numColors = 0;
+    for (unsigned int i = 0; i < NumIndices; i++)
+      if (isUsed[i])
+        mapping[i] = numColors++;
+    return numColors;
+  };
+  // bits per index of a color map with at least two entries
+  auto getNumBits = [](unsigned int numColors)
+  {
+    unsigned int bits = 1;
+    while ((1U << bits) < numColors)
+      bits++;
+    return bits;
+  };
+  // color map with 2^bits entries, unused colors are black
+  auto getColorMap = [](const std::vector<Color>& colorMap, const std::vector<unsigned int>& mapping, unsigned int bits)
+  {
+    Color black = { 0, 0, 0 };
+    std::vector<Color> result(1U << bits, black);
+    for (unsigned int i = 0; i < colorMap.size(); i++)
+      if (mapping[i] != NotUsed)
+        result[mapping[i]] = colorMap[i];
+    return result;
+  };
+  auto appendColorMap = [](Bytes& header, const std::vector<Color>& colorMap)
+  {
+    for (size_t i = 0; i < colorMap.size(); i++)
+    {
+      header.push_back(colorMap[i].red);
+      header.push_back(colorMap[i].green);
+      header.push_back(colorMap[i].blue);
+    }
+  };
+
+  // shrink global color map
+  std::vector<unsigned int> globalMapping;
+  unsigned int numGlobalColors = getMapping(usedGlobal, globalMapping);
+  if (!canRemapGlobal)
+    for (unsigned int i = 0; i < NumIndices; i++)
+      globalMapping[i] = i;
+  else
+  {
+    unsigned int bits = getNumBits(numGlobalColors);
+    if ((1U << bits) < m_sizeGlobalColorMap)
+    {
+      m_globalColorMap     = getColorMap(m_globalColorMap, globalMapping, bits);
+      m_sizeGlobalColorMap = 1 << bits;
+      m_colorDepth         = (unsigned char)bits;
+      m_backgroundColor    = (unsigned char)(globalMapping[m_backgroundColor] != NotUsed ? globalMapping[m_backgroundColor] : 0);
+
+      // signature, logical screen descriptor (size of global color map is stored in the lowest three bits), new global color map
+      const unsigned int PosPacked     = 10;
+      const unsigned int PosBackground = 11;
+      const unsigned int PosColorMap   = 13;
+      m_header.assign(m_rawHeader.data, m_rawHeader.data + PosColorMap);
+      m_header[PosPacked]     = (m_header[PosPacked] & ~7) | (bits - 1);
+      m_header[PosBackground] = m_backgroundColor;
+      appendColorMap(m_header, m_globalColorMap);
+    }
+    else
+      // same size, same order
+      for (unsigned int i = 0; i < NumIndices; i++)
+        globalMapping[i] = i;
+  }
+
+  unsigned int numRemapped = 0;
+  for (unsigned int frame = 0; frame < numFrames; frame++)
+  {
+    Frame& current = m_frames[frame];
+    const std::vector<bool>& isUsed = used[frame];
+    bool hasLocalColorMap = !current.localColorMap.empty();
+
+    // frames with a local color map have their own mapping
+    std::vector<unsigned int> localMapping;
+    unsigned int numColors = 0;
+    bool canRemap = true;
+    if (hasLocalColorMap)
+    {
+      numColors = getMapping(isUsed, localMapping);
+      for (unsigned int i = (unsigned int)current.localColorMap.size(); i < NumIndices; i++)
+        if (isUsed[i])
+          canRemap = false;
+      if (!canRemap || (1U << getNumBits(numColors)) == current.localColorMap.size())
+        for (unsigned int i = 0; i < NumIndices; i++)
+          localMapping[i] = i;
+    }
+    const std::vector<unsigned int>& mapping = hasLocalColorMap ? localMapping : globalMapping;
+
+    // LZW code size: at least 2 bits (according to the spec), enough for the largest index
+    unsigned int largest  = 0;
+    bool         identity = true;
+    for (unsigned int i = 0; i < NumIndices; i++)
+      if (isUsed[i])
+      {
+        largest  = std::max(largest, mapping[i]);
+        identity = identity && mapping[i] == i;
+      }
+    unsigned char codeSize = (unsigned char)std::max(2U, getNumBits(largest + 1));
+    if (identity && codeSize >= current.codeSize)
+      continue;
+
+    Bytes header = current.header;
+    if (header.empty())
+      header.assign(current.rawHeader.data, current.rawHeader.data + current.rawHeader.size);
+
+    // transparent index: if it isn't used by a pixel then it must not collide with a new index either
+    size_t posControl = findGraphicControl(header.data(), header.size());
+    if (posControl > 0 && (header[posControl] & 1) != 0)
+    {
+      unsigned int transparent = header[posControl + 3];
+      std::vector<bool> isTaken(NumIndices, false);
+      for (unsigned int i = 0; i < NumIndices; i++)
+        if (isUsed[i])
+          isTaken[mapping[i]] = true;
+
+      if (isUsed[transparent])
+        transparent = mapping[transparent];
+      else if (isTaken[transparent])
+      {
+        // at most 255 indices are taken
+        transparent = 0;
+        while (isTaken[transparent])
+          transparent++;
+      }
+      header[posControl + 3] = (unsigned char)transparent;
+    }
+
+    // replace local color map
+    if (!identity && hasLocalColorMap)
+    {
+      unsigned int bits = getNumBits(numColors);
+      current.localColorMap = getColorMap(current.localColorMap, mapping, bits);
+
+      header.resize(current.posInterlaced + 1);
+      header[current.posInterlaced] = (header[current.posInterlaced] & ~7) | (bits - 1);
+      appendColorMap(header, current.localColorMap);
+    }
+    current.header.swap(header);
+
+    // new indices (decodeFrame() will remap frames which aren't decoded yet)
+    if (!identity)
+    {
+      current.remap.assign(NumIndices, 0);
+      for (unsigned int i = 0; i < NumIndices; i++)
+        if (mapping[i] != NotUsed)
+          current.remap[i] = (unsigned char)mapping[i];
+
+      if (current.isDecoded)
+        for (size_t i = 0; i < current.pixels.size(); i++)
+          current.pixels[i] = current.remap[current.pixels[i]];
+    }
+
+    current.codeSize   = codeSize;
+    current.isRemapped = true;
+    numRemapped++;
+  }
+
+#ifdef ALLOW_VERBOSE
+  if (m_verbose)
+    std::cout << "remapped " << numRemapped << " of " << m_frames.size() << " frames, " << m_sizeGlobalColorMap << " global colors" << std::endl;
+#endif
+
+  return numRemapped;
+}
+
+
+/// re-order lines: non-interlaced to interlaced (and vice versa)
+void GifImage::reorderLines(Bytes& current, unsigned int width, unsigned int height, bool makeInterlaced)
+{
+  // interlacing doesn't matter for a single line (and truncated frames are left alone)
+  if (height <= 1 || current.size() < (size_t)width * height)
+    return;
+
+  // line order:
+  // A) every 8th row, beginning with 0th row
+  // B) every 8th row, beginning with 4th row
+  // C) every 4th row, beginning with 2nd row
+  // D) every 2nd row, beginning with 1st row
+  std::vector<unsigned int> interlaced;
+  interlaced.reserve(height);
+  for (unsigned int y = 0; y < height; y += 8)
+    interlaced.push_back(y);
+  for (unsigned int y = 4; y < height; y += 8)
+    interlaced.push_back(y);
+  for (unsigned int y = 2; y < height; y += 4)
+    interlaced.push_back(y);
+  for (unsigned int y = 1; y < height; y += 2)
+    interlaced.push_back(y);
+
+  // the i-th line of the result is copied from line source[i]
+  std::vector<unsigned int> source(height);
+  for (unsigned int i = 0; i < height; i++)
+    if (makeInterlaced)
+      source[i] = interlaced[i]; // non-interlaced => interlaced
+    else
+      source[interlaced[i]] = i; // interlaced => non-interlaced
+
+  // follow each cycle of the permutation, only one line is buffered
+  Bytes line(width);
+  std::vector<bool> done(height, false);
+  for (unsigned int start = 0; start < height; start++)
+  {
+    if (done[start] || source[start] == start)
+      continue;
+
+    memcpy(line.data(), &current[start * width], width);
+    unsigned int y = start;
+    while (source[y] != start)
+    {
+      memcpy(&current[y * width], &current[source[y] * width], width);
+      done[y] = true;
+      y = source[y];
     }
+    memcpy(&current[y * width], line.data(), width);
+    done[y] = true;
   }
 }
 
@@ -483,7 +1062,7 @@ void GifImage::parseLocalDescriptor(Frame& frame)
   frame.width      = getWord();
   frame.height     = getWord();
 
-  // HACK: doesn't work for animations
+  // file position of the interlaced flag, converted to a position inside the frame header by the caller
   frame.posInterlaced = m_input.getNumBytesRead();
 
   // color map related stuff
@@ -491,12 +1070,13 @@ void GifImage::parseLocalDescriptor(Frame& frame)
   m_input.removeBits(2);
   frame.isSorted        = m_input.getBool();
   frame.isInterlaced    = m_input.getBool();
+  frame.wasInterlaced   = frame.isInterlaced;
   bool hasLocalColorMap = m_input.getBool();
   if (!hasLocalColorMap)
     sizeLocalColorMap = 0;
 
 #ifdef ALLOW_VERBOSE
-  if (verbose)
+  if (m_verbose)
   {
     std::cout << frame.width << "x" << frame.height << " located at " << frame.offsetLeft << "x" << frame.offsetTop;
     if (frame.isInterlaced)
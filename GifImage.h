@@ -6,6 +6,9 @@
 #pragma once
 
 #include "BinaryInputBuffer.h"
+#include "InputSource.h"
+#include "BitStream.h"
+#include "LzwDecoder.h"
 
 #include <vector>
 #include <string>
@@ -40,16 +43,30 @@ public:
   /// a single frame
   struct Frame
   {
-    /// simple copy of frame's header
-    Bytes         rawHeader;
+    /// frame's header (view into GifImage's input)
+    ByteView      rawHeader;
+    /// modified copy of rawHeader if cropFrames()/remapColors() changed the frame, else empty
+    Bytes         header;
 
     /// extensions
     std::vector<std::pair<ExtensionType, Bytes> > extensions;
 
     /// each frame's bits per token
     unsigned char codeSize;
-    /// pixels / indices
+    /// bits per token of rawLzw (differs from codeSize after remapColors)
+    unsigned char rawCodeSize;
+    /// LZW data including GIF's block lengths (view into GifImage's input)
+    ByteView      rawLzw;
+    /// pixels / indices, empty if not decoded yet (see decodeFrame)
     Bytes         pixels;
+    /// true if pixels are valid
+    bool          isDecoded;
+    /// true if pixels can't be restored from rawLzw anymore (see cropFrames), releaseFrame() keeps them
+    bool          isModified;
+    /// maps decoded indices to new indices (256 entries, see remapColors), empty if unchanged
+    Bytes         remap;
+    /// true if remapColors() changed the indices or the code size => the original LZW data can't be kept
+    bool          isRemapped;
 
     /// frame's upper left corner (relative to the global image)
     unsigned int  offsetLeft;
@@ -62,42 +79,89 @@ public:
     bool          isSorted;
     /// true if interlaced
     bool          isInterlaced;
-    /// file position of interlaced flag (TODO: my code's broken for animated GIFs)
+    /// true if the original frame was interlaced (pixels are re-ordered if it differs from isInterlaced)
+    bool          wasInterlaced;
+    /// position of interlaced flag in rawHeader, writeOptimized() sets it according to isInterlaced
     unsigned int  posInterlaced;
     /// local color map, stored
     std::vector<Color> localColorMap;
 
-    /// original LZW size (in bits)
+    /// original LZW size (in bits), zero if not decoded yet
     unsigned int  numLzwBits;
   };
 
+  /// decode frames one after another, only the current frame's pixels are kept in memory
+  class FrameIterator
+  {
+  public:
+    /// no frame is decoded before next() is called
+    explicit FrameIterator(GifImage& image);
+    /// release the current frame
+    ~FrameIterator();
+
+    /// release the current frame and decode the next frame, return false if there are no more frames
+    bool next();
+    /// current frame (only valid after next() returned true)
+    const Frame& operator*()  const;
+    const Frame* operator->() const;
+    /// index of the current frame
+    unsigned int getIndex() const;
+
+  private:
+    /// disable copying
+    FrameIterator(const FrameIterator&);
+    FrameIterator& operator=(const FrameIterator&);
+
+    GifImage&    m_image;
+    /// index of the current frame
+    unsigned int m_current;
+    /// false before next() was called for the first time and after the last frame
+    bool         m_isValid;
+  };
+
   // -------------------- methods --------------------
-  /// load file
-  explicit GifImage(const std::string& filename);
+  /// load file, if decodeFrames is false then the frames' pixels remain empty until decodeFrame() is called
+  explicit GifImage(const std::string& filename, bool verbose = false, bool decodeFrames = true);
+  /// load from memory, data must remain valid as long as this object exists
+  GifImage(const unsigned char* data, size_t size, bool verbose = false, bool decodeFrames = true);
 
   /// number of frames (or 1 if not animated)
   unsigned int  getNumFrames() const;
   /// return decompressed data (indices for local/global color map)
   const GifImage::Frame& getFrame(unsigned int frame = 0) const;
 
+  /// decode a frame (if it isn't decoded yet), different frames can be decoded by different threads at the same time,
+  /// each thread should provide its own tables (NULL => temporary tables)
+  void          decodeFrame (unsigned int frame, LzwDecoder::Tables* tables = NULL);
+  /// free memory of a decoded frame, decodeFrame() can restore it
+  void          releaseFrame(unsigned int frame);
+
   /// color depth (bits per pixel)
   unsigned char getColorDepth() const;
 
-  /// replace LZW data with optimized data and write to disk (bitDepth = 0 means "take value from m_colorDepth")
-  unsigned int  writeOptimized(const std::string& filename, const std::vector<std::vector<bool> >& bits, unsigned char bitDepth = 0);
+  /// replace LZW data with optimized data and append to output, return number of bytes (bitDepth = 0 means "take value from m_colorDepth"),
+  /// frames with an empty bitstream keep their original LZW data
+  unsigned int  writeOptimized(Bytes& output, const std::vector<BitStream>& bits, unsigned char bitDepth = 0) const;
 
   /// convert from non-interlaced to interlaced (and vice versa)
   void setInterlacing(bool makeInterlaced);
+  /// animations: crop frames to the pixels which differ from the previous frame and replace unchanged pixels by the transparent index,
+  /// the rendered animation remains pixel-identical, return number of modified frames (their pixels stay decoded)
+  unsigned int cropFrames();
+  /// remove unused colors from the global/local color maps, remap indices accordingly and lower each frame's LZW code size,
+  /// the rendered image remains pixel-identical, return number of frames with new indices or code size
+  unsigned int remapColors();
 
   /// for debugging only: store image data in PPM format
   bool dumpPpm(const std::string& filename, unsigned int frame = 0) const;
   /// for debugging only: store indices
   bool dumpIndices(const std::string& filename, unsigned int frame = 0) const;
 
-  /// show debug output
-  static bool verbose;
-
 private:
+  /// parse the whole image, name is only used for debug output (may be empty)
+  void parse(const std::string& name, bool decodeFrames);
+  /// re-order lines: non-interlaced to interlaced (and vice versa)
+  static void reorderLines(Bytes& pixels, unsigned int width, unsigned int height, bool makeInterlaced);
   /// read signature GIF 87a/89a
   void parseSignature();
   /// global image parameters (constant for all frame)
@@ -112,10 +176,12 @@ private:
   /// read 16 bits from m_input, little endian
   unsigned short getWord();
 
-  /// the header will remain untouched
-  Bytes         m_rawHeader;
+  /// the header will remain untouched (view into m_source)
+  ByteView      m_rawHeader;
+  /// modified copy of m_rawHeader if remapColors() changed the global color map, else empty
+  Bytes         m_header;
   /// the last byte will remain untouched, too
-  Bytes         m_rawTrailer; // contains just one byte, it's always 0x3B
+  ByteView      m_rawTrailer; // contains just one byte, it's always 0x3B
 
   /// file version ("GIF87a" or "GIF89a")
   std::string   m_version;
@@ -136,13 +202,19 @@ private:
 
   /// true, if animated
   bool          m_isAnimated;
+  /// show debug output
+  bool          m_verbose;
 
   /// global color map
   std::vector<Color> m_globalColorMap;
 
-  /// simple wrapper to read file bit-wise
+  /// memory-mapped file or caller's memory block
+  InputSource        m_source;
+  /// simple wrapper to read m_source bit-wise
   BinaryInputBuffer  m_input;
 
   /// decompressed frames (indices for local/global color map)
   std::vector<Frame> m_frames;
+  /// decoder tables of frames decoded one after another by GifImage itself (parse, crop, remap and FrameIterator)
+  LzwDecoder::Tables m_decoderTables;
 };
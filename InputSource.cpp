@@ -0,0 +1,116 @@
+// //////////////////////////////////////////////////////////
+// InputSource.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "InputSource.h"
+
+#include <fstream>
+
+#ifndef _WIN32
+#define ALLOW_MMAP
+#endif
+
+#ifdef ALLOW_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/// memory-map a file (or load it completely if memory mapping isn't available), a missing file is the same as an empty file
+InputSource::InputSource(const std::string& filename)
+: m_data(NULL),
+  m_size(0),
+  m_isMapped(false),
+  m_copy()
+{
+#ifdef ALLOW_MMAP
+  int handle = open(filename.c_str(), O_RDONLY);
+  if (handle < 0)
+    return;
+
+  struct stat info;
+  if (fstat(handle, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+  {
+    void* mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+    if (mapped != MAP_FAILED)
+    {
+      m_data     = (const unsigned char*)mapped;
+      m_size     = (size_t)info.st_size;
+      m_isMapped = true;
+    }
+  }
+  close(handle);
+
+  if (m_isMapped)
+    return;
+#endif
+
+  // fallback: read everything at once
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+  if (!file)
+    return;
+
+  file.seekg(0, std::ios_base::end);
+  size_t numBytes = (size_t)file.tellg();
+  file.seekg(0, std::ios_base::beg);
+  if (numBytes == 0)
+    return;
+
+  m_copy.resize(numBytes);
+  file.read((char*)&m_copy[0], numBytes);
+  m_data = &m_copy[0];
+  m_size = numBytes;
+}
+
+
+/// use an existing memory block, it must remain valid as long as this object exists
+InputSource::InputSource(const unsigned char* data, size_t size)
+: m_data(data),
+  m_size(size),
+  m_isMapped(false),
+  m_copy()
+{
+}
+
+
+/// unmap file
+InputSource::~InputSource()
+{
+#ifdef ALLOW_MMAP
+  if (m_isMapped)
+    munmap((void*)m_data, m_size);
+#endif
+}
+
+
+/// first byte
+const unsigned char* InputSource::getData() const
+{
+  return m_data;
+}
+
+
+/// number of bytes
+size_t InputSource::getSize() const
+{
+  return m_size;
+}
+
+
+/// true if no bytes at all
+bool InputSource::empty() const
+{
+  return m_size == 0;
+}
+
+
+/// bytes [offset, offset+size)
+ByteView InputSource::getView(size_t offset, size_t size) const
+{
+  if (offset > m_size || size > m_size - offset)
+    throw "view exceeds input";
+  return ByteView(m_data + offset, size);
+}
@@ -0,0 +1,66 @@
+// //////////////////////////////////////////////////////////
+// InputSource.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+using std::size_t;
+
+
+/// read-only view of a few bytes which belong to an InputSource
+struct ByteView
+{
+  /// first byte
+  const unsigned char* data;
+  /// number of bytes
+  size_t               size;
+
+  ByteView()
+  : data(NULL), size(0)
+  {}
+  ByteView(const unsigned char* data_, size_t size_)
+  : data(data_), size(size_)
+  {}
+};
+
+
+/// contiguous read-only bytes of an input: a memory-mapped file or a memory block owned by the caller
+/** errors throw an exception (const char*) **/
+class InputSource
+{
+public:
+  /// memory-map a file (or load it completely if memory mapping isn't available), a missing file is the same as an empty file
+  explicit InputSource(const std::string& filename);
+  /// use an existing memory block, it must remain valid as long as this object exists
+  InputSource(const unsigned char* data, size_t size);
+  /// unmap file
+  ~InputSource();
+
+  /// no copies (ByteViews would point to the wrong object)
+  InputSource(const InputSource&) = delete;
+  InputSource& operator=(const InputSource&) = delete;
+
+  /// first byte
+  const unsigned char* getData() const;
+  /// number of bytes
+  size_t               getSize() const;
+  /// true if no bytes at all
+  bool                 empty()   const;
+  /// bytes [offset, offset+size)
+  ByteView             getView(size_t offset, size_t size) const;
+
+private:
+  /// first byte
+  const unsigned char* m_data;
+  /// number of bytes
+  size_t               m_size;
+  /// true if m_data was returned by mmap
+  bool                 m_isMapped;
+  /// file contents if memory mapping isn't available
+  std::vector<unsigned char> m_copy;
+};
@@ -6,6 +6,10 @@
 #include "LzwDecoder.h"
 
 #include <fstream>
+#include <cstring>
+
+// walk each code's chain of parents (the old decoder) and compare it to the fast decoder's output
+//#define VALIDATE_DECODER
 
 #define ALLOW_VERBOSE
 #ifdef  ALLOW_VERBOSE
@@ -16,27 +20,32 @@
 namespace
 {
   /// placeholder for "no parent code"
-  const int          NoPrevious    = -1;
+  const unsigned int NoPrevious    = 0xFFFFFFFF;
   /// GIFs have a valid end-of-stream token but not compress' LZW variant
   const unsigned int NoEndOfStream = 0xFFFFFFFF;
 }
 
-// statics
-bool LzwDecoder::verbose = false;
-
-
 /// parse LZW bitstream
 LzwDecoder::LzwDecoder(BinaryInputBuffer& input, bool isGif,
                        unsigned char minCodeSize, unsigned char maxCodeSize,
-                       unsigned int expectedNumberOfBytes)
+                       unsigned int expectedNumberOfBytes, bool verbose, Tables* tables)
 : m_input(input),
   m_bytes(),
   m_isGif(isGif),
+  m_verbose(verbose),
   m_codeSize(0),
-  m_bitsLeftInCurrentBlock(0),
+  m_ownTables(),
+  m_tables(tables != NULL ? *tables : m_ownTables),
+  m_compressedOffset(0),
+  m_bitsLeft(0),
+  m_bitBuffer(0),
+  m_bitBufferSize(0),
   m_numBitsOriginalLZW(0)
 {
-  decompress(expectedNumberOfBytes, minCodeSize, maxCodeSize);
+  if (m_isGif)
+    decompress<true >(expectedNumberOfBytes, minCodeSize, maxCodeSize);
+  else
+    decompress<false>(expectedNumberOfBytes, minCodeSize, maxCodeSize);
 }
 
 
@@ -54,6 +63,14 @@ const LzwDecoder::Bytes& LzwDecoder::getBytes() const
 }
 
 
+/// move decompressed data to destination (avoids a copy), getBytes() is empty afterwards
+void LzwDecoder::moveBytes(Bytes& destination)
+{
+  destination.swap(m_bytes);
+  m_bytes.clear();
+}
+
+
 /// for statistics only: true number of compressed bits
 unsigned int LzwDecoder::getNumCompressedBits() const
 {
@@ -62,62 +79,88 @@ unsigned int LzwDecoder::getNumCompressedBits() const
 
 
 /// convert code to bytes and store in buffer
-void LzwDecoder::decode(Bytes& buffer, unsigned int code, const std::vector<BackReference>& lut) const
+void LzwDecoder::decode(Bytes& buffer, unsigned int code) const
 {
   // single byte: exists in lookup table only
-  if (lut[code].length == 1)
+  unsigned int length = m_tables.length[code];
+  if (length == 1)
   {
-    buffer.push_back(lut[code].last);
+    buffer.push_back(m_tables.last[code]);
     return;
   }
 
-  // old iterative decoder
-  int length = lut[code].length;
-  // resize buffer
-  buffer.resize(buffer.size() + length);
-  unsigned char* pos = &buffer[buffer.size() - 1];
-  // copy bytes while walking backwards
+  // each code was already decoded before: just copy its first occurrence
+  size_t from = m_tables.pos[code];
+  size_t to   = buffer.size();
+  // resize buffer (source and destination never overlap)
+  buffer.resize(to + length);
+  memcpy(&buffer[to], &buffer[from], length);
+
+#ifdef VALIDATE_DECODER
+  // old iterative decoder: copy bytes while walking backwards
+  const unsigned char* pos = &buffer[buffer.size() - 1];
   while (length-- > 0)
   {
-    *pos-- = lut[code].last;
-    code   = lut[code].previous;
+    if (*pos-- != m_tables.last[code])
+      throw "decoder validation failed";
+    code = m_tables.previous[code];
   }
+#endif
 }
 
 
 /// decompress data, first parameter is a hint to avoid memory reallocations, GIFs are limited to code size 12, .Z => 16
+template <bool IsGif>
 void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char minCodeSize, unsigned char maxCodeSize)
 {
   // initial bits per token
   m_codeSize = minCodeSize;
 
 #ifdef ALLOW_VERBOSE
-  if (verbose && m_isGif)
+  if (m_verbose && IsGif)
     std::cout << ", " << (int)minCodeSize << " bits" << std::endl;
-  const char* pixel = m_isGif ? "pixel" : "byte";
+  const char* pixel = IsGif ? "pixel" : "byte";
 #endif
 
+  // lengths are stored in 16 bits
+  if (maxCodeSize > 16)
+    throw "LZW code size too large";
+
   // special codes
   const unsigned int clear       = 1 << minCodeSize;
-  const unsigned int endOfStream = m_isGif ? clear + 1 : NoEndOfStream;
+  const unsigned int endOfStream = IsGif ? clear + 1 : NoEndOfStream;
   const unsigned int maxColor    = clear - 1;
   const unsigned int MaxToken    = 1 << maxCodeSize;
+  // first code with 2+ bytes (compress' LZW variant has no end-of-stream code)
+  const unsigned int firstCode   = IsGif ? clear + 2 : clear + 1;
 
-  /// temporary look-up table for decompression
-  std::vector<BackReference> lut(m_isGif ? clear + 2 : clear + 1);
-  lut.reserve(MaxToken);
+  // look-up table for decompression, allocated only once if the tables are shared
+  Tables& lut = m_tables;
+  if (lut.length.size() < MaxToken)
+  {
+    lut.length.resize(MaxToken);
+    lut.pos   .resize(MaxToken);
+    lut.last  .resize(MaxToken);
+#ifdef VALIDATE_DECODER
+    lut.previous.resize(MaxToken);
+#endif
+  }
   // set initial contents
   for (unsigned int i = 0; i <= maxColor; i++)
   {
-    lut[i].previous = NoPrevious;
-    lut[i].last     = (unsigned char)i;
-    lut[i].length   = 1;
-    lut[i].pos      = NoPrevious;
+    lut.length[i] = 1;
+    lut.last  [i] = (unsigned char)i;
+#ifdef VALIDATE_DECODER
+    lut.previous[i] = (unsigned short)NoPrevious;
+#endif
   }
+  // number of valid codes
+  unsigned int numCodes = firstCode;
 
   unsigned char codeSize = minCodeSize + 1;
 
-  m_bitsLeftInCurrentBlock = 0;
+  // copy all LZW data at once, the main loop doesn't have to care about GIF's block structure
+  unsigned int lastBlockSize = gatherBlocks();
 
   // delete old data
   m_bytes.clear();
@@ -129,10 +172,10 @@ void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char mi
   while (token == clear)
     token = getLzwBits(codeSize);
 
-  if (token >= lut.size())
+  if (token >= numCodes)
   {
 #ifdef ALLOW_VERBOSE
-    std::cerr << "found initial token " << token << " but only " << lut.size() << " dictionary entries" << std::endl;
+    std::cerr << "found initial token " << token << " but only " << numCodes << " dictionary entries" << std::endl;
 #endif
     throw "invalid token";
   }
@@ -151,21 +194,21 @@ void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char mi
   {
     // one more bit per code ?
     unsigned int powerOfTwo = 1 << codeSize;
-    if (lut.size() == powerOfTwo && codeSize < maxCodeSize)
+    if (numCodes == powerOfTwo && codeSize < maxCodeSize)
       codeSize++;
 
     // quick hack: compress' LZW algorithm doesn't have an end-of-file code
-    if (!m_isGif && codeSize > m_input.getNumBitsLeft())
+    if (!IsGif && codeSize > m_bitsLeft)
       break; // abort if not enough bits left
 
     // next token
     prevToken = token;
     token = getLzwBits(codeSize);
-    if (token > lut.size())
+    if (token > numCodes)
     {
 #ifdef ALLOW_VERBOSE
       std::cerr << "found token " << token << " (" << (int)codeSize << " bits, "
-                << pixel << " " << m_bytes.size() << ") but only " << lut.size() << " dictionary entries" << std::endl;
+                << pixel << " " << m_bytes.size() << ") but only " << numCodes << " dictionary entries" << std::endl;
 #endif
       throw "invalid token";
     }
@@ -181,45 +224,44 @@ void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char mi
     while (token == clear)
     {
 #ifdef ALLOW_VERBOSE
-      if (verbose)
+      if (m_verbose)
       {
         std::cout << "restart @ "  << std::setw(7) << m_bytes.size()
                   << "    \tbits=" << std::setw(8) << numBitsTotal << " +" << numBitsBlock
                   << std::setprecision(3) << std::fixed
                   << "   \tbits/"  << pixel << "=" << numBitsBlock / float(m_bytes.size() - uptoLastBlock)
                   << "   \ttokens=+" << numTokensBlock << "/" << numTokensTotal
-                  << "   \tdict="  << std::setw(4) << lut.size() << std::endl;
+                  << "   \tdict="  << std::setw(4) << numCodes << std::endl;
       }
 #endif
 
       // delete all codes with 2+ bytes
-      if (m_isGif)
-      {
-        lut.resize(clear + 2);
-      }
-      else
+      numCodes = firstCode;
+      if (!IsGif)
       {
-        // one entry less => no end-of-file token
-        lut.resize(clear + 1);
-
-        // bits leftover in the current byte must be ignored
-        if (m_numBitsOriginalLZW % 8 != 0)
-        {
-          unsigned int skipBits = 8 - (m_numBitsOriginalLZW % 8);
-          getLzwBits(skipBits);
-        }
-
-        // continue with next byte, remove "garbage" bytes, too
-        // a block's number of token has to be a multiple of 8
+        // a block's number of token has to be a multiple of 8: skip "garbage" codes until the current group of 8 codes is complete
+        // (each code size starts a new group and all groups of smaller code sizes are complete, so numTokensBlock & 7 is sufficient)
         unsigned int mod8 = numTokensBlock & 7;
         unsigned int gap  = mod8 == 0 ? 0 : 8 - mod8;
         // the following does the same computation in one line (I like that weird bit magic ...)
         //unsigned int gap = (-(int)numTokensBlock) & 7; // from https://www.ioccc.org/2015/mills2/hint.html 
+        unsigned int skipBits = gap * codeSize;
 
-        while (gap-- > 0)
-          m_input.getBits(codeSize); // remember, a token takes 16 bits when approaching the LZW restart
+        // a group of 8 codes is byte-aligned: bits leftover in the current byte are part of the gap
+        unsigned int fillBits = (8 - (m_numBitsOriginalLZW % 8)) % 8;
+        if (fillBits > skipBits)
+          throw "clear code isn't properly padded";
+        getLzwBits(fillBits);
+        skipBits -= fillBits;
 
-        // by the way: the GZIP sources have this formula (it doesn't compute the offset directly, though, and accounts for cases where <=16 bits/token):
+        while (skipBits > 0)
+        {
+          unsigned char numBits = skipBits < 16 ? (unsigned char)skipBits : 16;
+          getBits(numBits);
+          skipBits -= numBits;
+        }
+
+        // by the way: the GZIP sources have this formula (it doesn't compute the offset directly, though):
         //posbits = ((posbits-1) + ((n_bits<<3)-(posbits-1+(n_bits<<3))%(n_bits<<3)));
       }
 
@@ -252,56 +294,64 @@ void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char mi
     if (token == endOfStream)
       break;
 
-    // new LZW code
-    BackReference add;
-    add.previous = prevToken;
-    add.length   = lut[prevToken].length + 1;
-    add.pos      = (unsigned int)m_bytes.size();
+    // new LZW code, it starts where the previous token was written to and ends with the first byte of the current token
+    unsigned int numBytes = (unsigned int)m_bytes.size();
 
     // look up token in dictionary
-    if (token >= lut.size())
+    if (token == numCodes)
     {
       // broken stream ?
-      if (token != lut.size())
-        throw "unknown token found";
-      if (lut.size() >= MaxToken)
+      if (numCodes >= MaxToken)
         throw "dictionary too large";
 
       // unknown token:
       // output LAST + LAST[0]
       // add    LAST + LAST[0]
-      decode(m_bytes, prevToken, lut);
-      add.last = m_bytes[add.pos];
-      m_bytes.push_back(add.last);
+      decode(m_bytes, prevToken);
+      m_bytes.push_back(m_bytes[numBytes]);
     }
     else
     {
       // known token:
       // output TOKEN
       // add    LAST + TOKEN[0]
-      // add new chunk to table (but no more than 2^12)
-      decode(m_bytes, token, lut);
-      add.last = m_bytes[add.pos];
+      decode(m_bytes, token);
     }
 
     // add LZW code to the dictionary:
     // the if-condition is required in case the dictionary is full and there hasn't been a clear-token
-    if (lut.size() < MaxToken)
-      lut.push_back(add);
+    if (numCodes < MaxToken)
+    {
+      unsigned int length = lut.length[prevToken];
+      lut.length[numCodes] = (unsigned short)(length + 1);
+      lut.pos   [numCodes] = numBytes - length;
+      lut.last  [numCodes] = m_bytes[numBytes];
+#ifdef VALIDATE_DECODER
+      lut.previous[numCodes] = (unsigned short)prevToken;
+#endif
+      numCodes++;
+    }
   }
 
 #ifdef ALLOW_VERBOSE
-  if (verbose)
+  if (m_verbose)
     std::cout << "finish  @ "  << std::setw(7) << m_bytes.size()
               << "    \tbits=" << std::setw(8) << numBitsTotal << " +" << numBitsBlock
               << std::setprecision(3) << std::fixed
               << "   \tbits/"  << pixel << "=" << std::setw(4) << numBitsBlock / float(m_bytes.size() - uptoLastBlock)
               << "   \ttokens=+" << numTokensBlock << "/" << numTokensTotal
-              << "   \tdict="  << std::setw(4) << lut.size() << std::endl;
+              << "   \tdict="  << std::setw(4) << numCodes << std::endl;
 #endif
 
   // skip remaining bits
-  unsigned int unusedBits = m_bitsLeftInCurrentBlock;
+  unsigned int unusedBits = 0;
+  if (IsGif)
+  {
+    // more blocks after the end-of-stream token (the last one is always the terminating zero-sized block) ?
+    if (m_bitsLeft > 8 * lastBlockSize)
+      throw "LZW data is not properly terminated";
+    unusedBits = (unsigned int)m_bitsLeft;
+  }
   // process files where a few bytes are wasted
   if (unusedBits >= 8)
   {
@@ -315,23 +365,62 @@ void LzwDecoder::decompress(unsigned int expectedNumberOfBytes, unsigned char mi
     }
   }
   // ... and now actually skip the unused bits
-  token = getLzwBits(unusedBits); // TODO: isn't it always 0 for non-GIFs ?
+  token = getLzwBits(unusedBits);
+
+  // don't include the "garbage" bits in the final count
+  m_numBitsOriginalLZW -= unusedBits;
+
+  // okay, we're done !
+}
+
+
+/// copy LZW data to m_tables.compressed, GIF's block lengths are removed, return size of the last block (GIF only)
+unsigned int LzwDecoder::gatherBlocks()
+{
+  m_tables.compressed.clear();
+  unsigned int lastBlockSize = 0;
 
-  // GIF only: a zero-sized block must follow
   if (m_isGif)
   {
-    if (m_input.getByte() != 0)
-      throw "LZW data is not properly terminated";
+    // GIF encapsulates the data in blocks of at most 255, each block is preceded by a length byte,
+    // a zero-sized block terminates the LZW data
+    while (true)
+    {
+      if (m_input.getNumBitsLeft() < 8)
+        throw "LZW data is not properly terminated";
+      unsigned char length = m_input.getByte();
+      if (length == 0)
+        break;
+
+      if (m_input.getNumBitsLeft() < 8 * (unsigned int)length)
+        throw "too few bits available in unlzw";
+      size_t pos = m_tables.compressed.size();
+      m_tables.compressed.resize(pos + length);
+      m_input.getBytes(&m_tables.compressed[pos], length);
+      lastBlockSize = length;
+    }
+  }
+  else
+  {
+    // compress has a simple LZW format, everything up to the end of file
+    unsigned int numBytes = m_input.getNumBitsLeft() / 8;
+    m_tables.compressed.resize(numBytes);
+    if (numBytes > 0)
+      m_input.getBytes(&m_tables.compressed[0], numBytes);
   }
 
-  // don't include the "garbage" bits in the final count
-  m_numBitsOriginalLZW -= unusedBits;
+  m_bitsLeft         = 8 * m_tables.compressed.size();
+  m_compressedOffset = 0;
+  m_bitBuffer        = 0;
+  m_bitBufferSize    = 0;
+  // padding for fast 64 bit reads
+  m_tables.compressed.resize(m_tables.compressed.size() + 8, 0);
 
-  // okay, we're done !
+  return lastBlockSize;
 }
 
 
-/// read bits from current LZW block, start with next block if needed
+/// read bits of an LZW code, counted in m_numBitsOriginalLZW
 unsigned int LzwDecoder::getLzwBits(unsigned char numBits)
 {
   // degenerated case
@@ -339,39 +428,36 @@ unsigned int LzwDecoder::getLzwBits(unsigned char numBits)
     return 0;
 
   m_numBitsOriginalLZW += numBits;
+  return getBits(numBits);
+}
 
-  // compress has a simple LZW format, just read the bits ...
-  if (!m_isGif)
-    return m_input.getBits(numBits);
-
-  // ... but GIF encapsulates the data in blocks of at most 255, each block is preceded by a length byte
 
-  // enough bits available in the current block ?
-  if (numBits <= m_bitsLeftInCurrentBlock)
-  {
-    m_bitsLeftInCurrentBlock -= numBits;
-    return m_input.getBits(numBits);
-  }
+/// read bits from m_tables.compressed (at most 32 bits)
+unsigned int LzwDecoder::getBits(unsigned char numBits)
+{
+  if (numBits > m_bitsLeft)
+    throw "too few bits available in unlzw";
 
-  // cross block border
-  unsigned int  low   = 0;
-  unsigned char shift = 0;
-  // fetch all bits from current block ("low" bits of the token)
-  if (m_bitsLeftInCurrentBlock > 0)
+  // load 8 bytes at once (little endian) and keep only as many as fit into the bit buffer
+  if (m_bitBufferSize < numBits)
   {
-    low      = m_input.getBits(m_bitsLeftInCurrentBlock);
-    shift    = m_bitsLeftInCurrentBlock;
-    numBits -= m_bitsLeftInCurrentBlock;
+    const unsigned char* next = &m_tables.compressed[m_compressedOffset];
+    unsigned long long word = 0;
+    for (unsigned int i = 0; i < 8; i++)
+      word |= (unsigned long long)next[i] << (8 * i);
+
+    unsigned int numBytes = (64 - m_bitBufferSize) / 8;
+    if (numBytes < 8)
+      word &= (1ULL << (8 * numBytes)) - 1;
+
+    m_bitBuffer        |= word << m_bitBufferSize;
+    m_bitBufferSize    += 8 * numBytes;
+    m_compressedOffset += numBytes;
   }
 
-  // read size of new block
-  m_bitsLeftInCurrentBlock = 8 * m_input.getByte();
-  if (m_bitsLeftInCurrentBlock < numBits)
-    throw "too few bits available in unlzw";
-
-  // and get remaining bits ("high" bits)
-  unsigned int high = m_input.getBits(numBits) << shift;
-  m_bitsLeftInCurrentBlock -= numBits;
-
-  return low | high;
+  unsigned int result = (unsigned int)(m_bitBuffer & ((1ULL << numBits) - 1));
+  m_bitBuffer    >>= numBits;
+  m_bitBufferSize -= numBits;
+  m_bitsLeft      -= numBits;
+  return result;
 }
@@ -19,38 +19,50 @@ public:
   /// a continuous block of bytes
   typedef std::vector<unsigned char> Bytes;
 
-  /// parse LZW bitstream
-  explicit LzwDecoder(BinaryInputBuffer& input, bool isGif = true, unsigned char minCodeSize = 8, unsigned char maxCodeSize = 12, unsigned int expectedNumberOfBytes = 16*1024);
+  /// dictionary and input buffer of the decoder, can be shared by many LzwDecoder objects (one after another, not at the same time) to avoid memory allocations
+  /** structure of arrays: the hot loop touches only length, pos and last (7 bytes per code, GIF's 4096 codes fit into L1 cache) **/
+  struct Tables
+  {
+    /// number of bytes of each code
+    std::vector<unsigned short> length;
+    /// position of each code's first occurrence in the output (decode() copies from there)
+    std::vector<unsigned int>   pos;
+    /// last byte of each code
+    std::vector<unsigned char>  last;
+    /// code of parent (contains everything except for the last byte), only used if VALIDATE_DECODER is defined
+    std::vector<unsigned short> previous;
+    /// LZW data without GIF's block lengths, followed by 8 zeros (allows reading 64 bits at once)
+    Bytes compressed;
+  };
+
+  /// parse LZW bitstream, tables are optional (NULL => allocate temporary tables)
+  explicit LzwDecoder(BinaryInputBuffer& input, bool isGif = true, unsigned char minCodeSize = 8, unsigned char maxCodeSize = 12, unsigned int expectedNumberOfBytes = 16*1024,
+                      bool verbose = false, Tables* tables = NULL);
 
   /// return minimum LZW code size
   unsigned char getCodeSize() const;
   /// return decompressed data
   const Bytes&  getBytes()    const;
+  /// move decompressed data to destination (avoids a copy), getBytes() is empty afterwards
+  void          moveBytes(Bytes& destination);
 
   /// for statistics only: true number of compressed bits
   unsigned int  getNumCompressedBits() const;
 
-  /// show debug output
-  static bool verbose;
-
 private:
   /// decompress data, first parameter is a hint to avoid memory reallocations, GIFs are limited to code size 12, .Z => 16
+  template <bool IsGif>
   void  decompress(unsigned int expectedNumberOfBytes, unsigned char minCodeSize, unsigned char maxCodeSize);
 
-  /// read bits from current LZW block, start with next block if needed
+  /// copy LZW data to m_tables.compressed, GIF's block lengths are removed, return size of the last block (GIF only)
+  unsigned int gatherBlocks();
+  /// read bits of an LZW code, counted in m_numBitsOriginalLZW
   unsigned int getLzwBits(unsigned char numBits);
+  /// read bits from m_tables.compressed (at most 32 bits)
+  unsigned int getBits   (unsigned char numBits);
 
-  /// tree node for an LZW code: its parent code and its last byte
-  struct BackReference
-  {
-    int  length;   // match length
-    int  previous; // code of parent (contains everything except for the last byte), if negative then there is no parent
-    unsigned char last; // last byte of the match
-
-    int   pos;      // position of a match in the output stream (often there are several candidates)
-  };
   /// convert code to bytes and store in buffer
-  void decode(Bytes& buffer, unsigned int code, const std::vector<BackReference>& lut) const;
+  void decode(Bytes& buffer, unsigned int code) const;
 
   /// read file bit-by-bit
   BinaryInputBuffer& m_input;
@@ -59,10 +71,22 @@ private:
 
   /// if true, then GIF's LZW data is grouped in blocks of 255 bytes each
   bool          m_isGif;
+  /// show debug output
+  bool          m_verbose;
   /// minimum bits per LZW code
   unsigned char m_codeSize;
-  /// LZW data is split in blocks, keep track of the remaining bits in the current block
-  unsigned int  m_bitsLeftInCurrentBlock;
+  /// dictionary and LZW data, unused if the tables were provided by the caller
+  Tables        m_ownTables;
+  /// either m_ownTables or the caller's tables
+  Tables&       m_tables;
+  /// position of the first byte of m_tables.compressed which wasn't moved to m_bitBuffer yet
+  size_t        m_compressedOffset;
+  /// number of bits of m_tables.compressed which weren't read yet
+  size_t        m_bitsLeft;
+  /// store bits until next byte boundary
+  unsigned long long m_bitBuffer;
+  /// number of valid bits in m_bitBuffer
+  unsigned char m_bitBufferSize;
   /// total number of bits of original LZW compressed image (without block lengths)
   unsigned int  m_numBitsOriginalLZW;
 };
@@ -0,0 +1,172 @@
+// //////////////////////////////////////////////////////////
+// LzwDictionary.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <vector>
+
+// both dictionaries have the same interface and produce exactly the same results,
+// but their memory layout differs significantly:
+// - ArrayDictionary stores for each code the codes of all its children (which is the same as its parent plus one byte)
+// - HashDictionary  is an open-addressing hash table keyed by parent code and next byte
+// each LzwEncoder::optimizePartial() resets the dictionary, which is much cheaper for HashDictionary
+
+
+/// for each LZW code store the LZW codes of its children (-1 => undefined/no child)
+class ArrayDictionary
+{
+public:
+  /// indicates an invalid entry in the dictionary
+  enum { Unknown = -1 };
+
+  ArrayDictionary()
+  : m_children(), m_alphabetSize(0)
+  {}
+
+  /// remove all codes, each code can have up to alphabetSize children (at most 256)
+  void reset(unsigned int maxCodes, unsigned int alphabetSize)
+  {
+    m_alphabetSize = alphabetSize;
+    m_children.assign(maxCodes * alphabetSize, Unknown);
+  }
+
+  /// return code of parent plus next byte (or Unknown)
+  int find(int code, unsigned char next) const
+  {
+    return m_children[code * m_alphabetSize + next];
+  }
+
+  /// maximum number of children per code
+  unsigned int getAlphabetSize() const
+  {
+    return m_alphabetSize;
+  }
+
+  /// set code of parent plus next byte, but don't overwrite an existing code
+  void insert(int code, unsigned char next, int child)
+  {
+    int& slot = m_children[code * m_alphabetSize + next];
+    if (slot == Unknown)
+      slot = child;
+  }
+
+private:
+  /// m_alphabetSize entries per code
+  std::vector<int> m_children;
+  /// number of children per code
+  unsigned int     m_alphabetSize;
+};
+
+
+/// open-addressing hash table, entries of the previous reset() are identified by an outdated generation
+class HashDictionary
+{
+public:
+  /// indicates an invalid entry in the dictionary
+  enum { Unknown = -1 };
+
+  HashDictionary()
+  : m_slots(), m_mask(0), m_shift(0), m_generation(0), m_alphabetSize(0)
+  {}
+
+  /// remove all codes, alphabetSize is only needed for getAlphabetSize()
+  void reset(unsigned int maxCodes, unsigned int alphabetSize)
+  {
+    m_alphabetSize = alphabetSize;
+
+    // keep load factor below 50%
+    unsigned int numSlots = 1;
+    unsigned int numBits  = 0;
+    while (numSlots < 2 * maxCodes)
+    {
+      numSlots <<= 1;
+      numBits++;
+    }
+
+    // start a new generation, need to wipe memory only if the generation counter overflows (every 255 resets)
+    m_generation = (m_generation + 1) & GenerationMask;
+    if (numSlots != m_slots.size() || m_generation == 0)
+    {
+      m_slots.assign(numSlots, Slot());
+      m_mask       = numSlots - 1;
+      m_shift      = 32 - numBits;
+      m_generation = 1;
+    }
+  }
+
+  /// return code of parent plus next byte (or Unknown)
+  int find(int code, unsigned char next) const
+  {
+    unsigned int key = makeKey(code, next);
+    for (unsigned int index = hash(key); ; index = (index + 1) & m_mask)
+    {
+      const Slot& slot = m_slots[index];
+      if (slot.key == key)
+        return slot.code;
+      // empty slot ?
+      if ((slot.key >> GenerationShift) != m_generation)
+        return Unknown;
+    }
+  }
+
+  /// maximum number of children per code
+  unsigned int getAlphabetSize() const
+  {
+    return m_alphabetSize;
+  }
+
+  /// set code of parent plus next byte, but don't overwrite an existing code
+  void insert(int code, unsigned char next, int child)
+  {
+    unsigned int key = makeKey(code, next);
+    for (unsigned int index = hash(key); ; index = (index + 1) & m_mask)
+    {
+      Slot& slot = m_slots[index];
+      if (slot.key == key)
+        return;
+      // empty slot ?
+      if ((slot.key >> GenerationShift) != m_generation)
+      {
+        slot.key  = key;
+        slot.code = child;
+        return;
+      }
+    }
+  }
+
+private:
+  /// upper 8 bits of a key are the generation, then 16 bits for the parent code and 8 bits for the next byte
+  enum { GenerationShift = 24, GenerationMask = 0xFF, KeyMask = 0xFFFFFF };
+
+  /// combine generation, code and next byte
+  unsigned int makeKey(int code, unsigned char next) const
+  {
+    return (m_generation << GenerationShift) | ((unsigned int)code << 8) | next;
+  }
+  /// Fibonacci hashing (ignoring the generation)
+  unsigned int hash(unsigned int key) const
+  {
+    return ((key & KeyMask) * 2654435761U) >> m_shift;
+  }
+
+  /// a single entry, key = 0 if unused (generation 0 is never valid)
+  struct Slot
+  {
+    unsigned int key;
+    int          code;
+
+    Slot() : key(0), code(Unknown) {}
+  };
+  /// the whole hash table
+  std::vector<Slot> m_slots;
+  /// number of slots minus 1
+  unsigned int      m_mask;
+  /// 32 minus log2(number of slots)
+  unsigned int      m_shift;
+  /// current generation (1..255)
+  unsigned int      m_generation;
+  /// number of distinct bytes
+  unsigned int      m_alphabetSize;
+};
@@ -8,6 +8,11 @@
 // (albeit much slower and without non-greedy parsing)
 
 #include "LzwEncoder.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 
 #define ALLOW_VERBOSE
 #ifdef  ALLOW_VERBOSE
@@ -20,46 +25,141 @@ namespace
 {
   /// indicates an invalid entry in the dictionary
   const int Unknown = -1;
+  /// automatically switch to HashDictionary if minCodeSize exceeds this value
+  const unsigned char SmallAlphabetBits = 6;
+  /// incremental estimation: rebuild dictionary if current and reference dictionary differ in too many strings
+  const size_t MaxDifferences = 256;
+  /// incremental estimation: log2 of the number of hash buckets of Scratch::firstDifference
+  const unsigned int DifferenceBuckets = 12;
 }
 
-/// set uncompressed data
+/// no data yet, call reset() before optimizing anything
+LzwEncoder::LzwEncoder()
+: m_data(NULL),
+  m_size(0),
+  m_best(),
+  m_scratch(1),
+  m_statistics(),
+  m_maxDictionary(4095),
+  m_maxCodeLength(12),
+  m_isGif(true),
+  m_isFinal(true)
+{
+}
+
+
+/// set uncompressed data, it isn't copied and must remain valid until reset() is called or the encoder is destroyed
 LzwEncoder::LzwEncoder(const RawData& data, bool isGif)
-: m_data(data),
-  m_dictionary(),
-  m_dictSize(0),
+: m_data(data.data()),
+  m_size((unsigned int)data.size()),
+  m_best(),
+  m_scratch(1),
+  m_statistics(),
   m_maxDictionary(), // see a few lines below
   m_maxCodeLength(isGif ? 12 : 16),
-  m_isGif(isGif)
+  m_isGif(isGif),
+  m_isFinal(true)
 {
   m_maxDictionary = (1 << m_maxCodeLength) - 1;
 }
 
 
-/// add string at m_data[from...from+length] to the dictionary and return its code
-int LzwEncoder::addCode(unsigned int from, unsigned int length)
+/// replace uncompressed data (same lifetime rules as above) and discard all results, but keep allocated memory (m_best, dictionaries) for the next image
+void LzwEncoder::reset(const RawData& data, bool isGif)
 {
-  // first literal
-  int code = m_data[from++];
+  reset(data.data(), (unsigned int)data.size(), isGif, true);
+}
+
 
-  // walk through dictionary in order to find the code for the matching without the last byte
-  for (unsigned int i = 1; i < length; i++)
+/// same as above for a part of a larger buffer, if isFinal is false then more data follows (.Z only) and the last block must end with a clear code
+void LzwEncoder::reset(const unsigned char* data, unsigned int size, bool isGif, bool isFinal)
+{
+  m_data = data;
+  m_size = size;
+  // keeps its capacity, will be resized by estimate() or optimizePartial()
+  m_best.clear();
+
+  m_isGif         = isGif;
+  m_isFinal       = isFinal || isGif;
+  m_maxCodeLength = isGif ? 12 : 16;
+  m_maxDictionary = (1 << m_maxCodeLength) - 1;
+
+  // invalidate incremental estimation
+  for (size_t i = 0; i < m_scratch.size(); i++)
   {
-    unsigned char oneByte = m_data[from++];
-    code = m_dictionary[code][oneByte];
+    m_scratch[i].hasReference = false;
+    m_scratch[i].statistics   = Statistics();
+  }
+  m_statistics = Statistics();
+}
+
+
+/// all zero
+LzwEncoder::Statistics::Statistics()
+: numBlocks(0), numRestarts(0), numSearches(0), searchDepth(0),
+  numNonGreedyProbes(0), numNonGreedyAccepted(0), numBestUpdates(0),
+  numParsedTokens(0), numReusedTokens(0), numCacheHits(0), numCacheMisses(0)
+{
+}
+
+
+/// add all counters
+LzwEncoder::Statistics& LzwEncoder::Statistics::operator+=(const Statistics& other)
+{
+  numBlocks            += other.numBlocks;
+  numRestarts          += other.numRestarts;
+  numSearches          += other.numSearches;
+  searchDepth          += other.searchDepth;
+  numNonGreedyProbes   += other.numNonGreedyProbes;
+  numNonGreedyAccepted += other.numNonGreedyAccepted;
+  numBestUpdates       += other.numBestUpdates;
+  numParsedTokens      += other.numParsedTokens;
+  numReusedTokens      += other.numReusedTokens;
+  numCacheHits         += other.numCacheHits;
+  numCacheMisses       += other.numCacheMisses;
+  return *this;
+}
+
+
+/// sum of all threads' counters since the most recent reset()
+LzwEncoder::Statistics LzwEncoder::getStatistics() const
+{
+  Statistics result = m_statistics;
+  for (size_t i = 0; i < m_scratch.size(); i++)
+    result += m_scratch[i].statistics;
+  return result;
+}
+
+
+/// add string at m_data[from...from+length] to the dictionary and return its code
+template <typename Dictionary>
+int LzwEncoder::addCode(Dictionary& dictionary, unsigned int& dictSize, unsigned int from, unsigned int length, int code) const
+{
+  if (code == Unknown)
+  {
+    // first literal
+    code = m_data[from];
+
+    // walk through dictionary in order to find the code for the matching without the last byte
+    for (unsigned int i = 1; i < length; i++)
+    {
+      unsigned char oneByte = m_data[from + i];
+      code = dictionary.find(code, oneByte);
+    }
   }
+  from += length;
 
   // the new string is a known code plus a new byte (the last one)
-  if (from < m_data.size())
+  if (from < m_size)
   {
     unsigned char lastByte = m_data[from];
     // insert at the end of the dictionary
-    if (m_dictSize < m_maxDictionary)
+    if (dictSize < m_maxDictionary)
     {
       // don't overwrite (needed for non-greedy algorithm where a code isn't unique)
-      if (m_dictionary[code][lastByte] == Unknown)
-        m_dictionary[code][lastByte] = m_dictSize;
+      dictionary.insert(code, lastByte, dictSize);
 
-      m_dictSize++;
+      dictSize++;
     }
   }
 
@@ -68,7 +168,8 @@ int LzwEncoder::addCode(unsigned int from, unsigned int length)
 
 
 /// return length of longest match, beginning at m_data[from], limited to maxLength
-unsigned int LzwEncoder::findMatch(unsigned int from, unsigned int maxLength)
+template <typename Dictionary>
+unsigned int LzwEncoder::findMatch(const Dictionary& dictionary, unsigned int from, unsigned int maxLength, unsigned int numCodes, int* matchCode) const
 {
   // there is always a LZW code for the first byte
   int code = m_data[from++];
@@ -77,24 +178,64 @@ unsigned int LzwEncoder::findMatch(unsigned int from, unsigned int maxLength)
   for (unsigned int length = 1; length < maxLength; length++)
   {
     unsigned char oneByte = m_data[from++];
-    code = m_dictionary[code][oneByte];
-    // no continuation => return number of matching byte
-    if (code == Unknown)
+    int next = dictionary.find(code, oneByte);
+    // no continuation => return number of matching byte (note: Unknown becomes a huge number when unsigned)
+    if ((unsigned int)next >= numCodes)
+    {
+      if (matchCode != NULL)
+        *matchCode = code;
       return length;
+    }
+    code = next;
   }
 
   // matched all the way (quite unlikely, yet possible)
+  if (matchCode != NULL)
+    *matchCode = code;
   return maxLength;
 }
 
 
+/// same as findMatch() but look up scratch.matchCache first (if enabled)
+template <typename Dictionary>
+unsigned int LzwEncoder::findCachedMatch(Scratch& scratch, const Dictionary& dictionary, unsigned int from, unsigned int maxLength) const
+{
+  if (scratch.matchCache.empty())
+  {
+    unsigned int length = findMatch(dictionary, from, maxLength);
+    scratch.statistics.numSearches++;
+    scratch.statistics.searchDepth += length;
+    return length;
+  }
+
+  // note: maxLength is always the number of bytes left in the current block, which only depends on from
+  //       and the dictionary only changes in ways tracked by scratch.lastAdded as long as the cache is enabled
+  CachedMatch& cached = scratch.matchCache[from & (scratch.matchCache.size() - 1)];
+  if (cached.pos == from && cached.generation >= scratch.blockGeneration &&
+      (cached.length >= scratch.lastAdded.size() || scratch.lastAdded[cached.length] <= cached.generation))
+  {
+    scratch.statistics.numCacheHits++;
+    return cached.length;
+  }
+
+  scratch.statistics.numCacheMisses++;
+  cached.pos        = from;
+  cached.length     = findMatch(dictionary, from, maxLength);
+  cached.generation = scratch.generation;
+  scratch.statistics.numSearches++;
+  scratch.statistics.searchDepth += cached.length;
+  return cached.length;
+}
+
+
 // for debugging only, not used in release compilation
-LzwEncoder::RawData LzwEncoder::debugDecode(int code) const
+template <typename Dictionary>
+LzwEncoder::RawData LzwEncoder::debugDecode(const Dictionary& dictionary, int code) const
 {
   RawData result;
   if (code == Unknown)
     return result;
-  if (code >= (int)m_dictionary.size())
+  if (code >= (int)m_maxDictionary)
     return result; // actually an error ...
 
   // brute-force search ...
@@ -108,8 +249,8 @@ LzwEncoder::RawData LzwEncoder::debugDecode(int code) const
     if (search < 0)
       break;
 
-    for (unsigned int next = 0; next <= 255; next++)
-      if (m_dictionary[search][next] == code)
+    for (unsigned int next = 0; next < dictionary.getAlphabetSize(); next++)
+      if (dictionary.find(search, (unsigned char)next) == code)
       {
         result.insert(result.begin(), char(next));
         code = search;
@@ -122,7 +263,8 @@ LzwEncoder::RawData LzwEncoder::debugDecode(int code) const
 }
 
 // for debugging only, not used in release compilation
-int LzwEncoder::findCode(unsigned int from, unsigned int maxLength) const
+template <typename Dictionary>
+int LzwEncoder::findCode(const Dictionary& dictionary, unsigned int from, unsigned int maxLength) const
 {
   // there is always a LZW code for the first byte
   int code = m_data[from++];
@@ -132,7 +274,7 @@ int LzwEncoder::findCode(unsigned int from, unsigned int maxLength) const
   {
     unsigned char oneByte = m_data[from++];
     int prevCode = code;
-    code = m_dictionary[code][oneByte];
+    code = dictionary.find(code, oneByte);
     // no continuation => return number of matching byte
     if (code == Unknown)
       return prevCode;
@@ -144,14 +286,159 @@ int LzwEncoder::findCode(unsigned int from, unsigned int maxLength) const
 
 
 /// optimize a single block and update results in m_best
-LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal, OptimizationSettings optimize)
+BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal, OptimizationSettings optimize)
 {
   // allocate memory
   if (m_best.empty())
-    m_best.resize(m_data.size() / optimize.alignment + 1 + 1);
+    m_best.resize(m_size / optimize.alignment + 1 + 1);
+
+  return optimizeBlock(m_scratch.front(), from, maxLength, emitBitStream, isFinal, optimize, NULL);
+}
+
+
+/// same condition as the first lines in optimizeBlock(): true if greedy search can be skipped because non-greedy search didn't find anything
+bool LzwEncoder::skipGreedyAgain(unsigned int from, const OptimizationSettings& optimize) const
+{
+  unsigned int fromAligned = from / optimize.alignment;
+  return optimize.greedy                    &&
+         optimize.avoidNonGreedyAgain       &&
+         (m_best.flags[fromAligned] & BestBlocks::HasNonGreedy) == 0 &&
+         m_best.length[fromAligned] > 0;
+}
+
+
+/// incremental estimation: hash of the first two bytes (if length = 2) or the first three bytes (if length > 2) of m_data[pos...pos+length)
+unsigned int LzwEncoder::getBucket(unsigned int pos, unsigned int length) const
+{
+  unsigned int key = (m_data[pos] << 8) | m_data[pos + 1];
+  if (length > 2)
+    key = ((key << 8) | m_data[pos + 2]) + (1 << 24);
+  // Fibonacci hashing
+  return (key * 2654435761U) >> (32 - DifferenceBuckets);
+}
+
+
+/// incremental estimation: remove all entries of scratch.differences
+void LzwEncoder::clearDifferences(Scratch& scratch) const
+{
+  if (scratch.firstDifference.empty())
+    scratch.firstDifference.resize(1 << DifferenceBuckets, -1);
+
+  for (size_t i = 0; i < scratch.differences.size(); i++)
+  {
+    const Difference& difference = scratch.differences[i];
+    if (difference.length > 0)
+      scratch.firstDifference[getBucket(difference.pos, difference.length)] = -1;
+  }
+  scratch.differences.clear();
+  scratch.unusedDifferences.clear();
+}
+
+
+/// incremental estimation: string m_data[pos...pos+length) was added to one dictionary, update scratch.differences
+void LzwEncoder::toggleDifference(Scratch& scratch, unsigned int pos, unsigned int length, bool onlyCurrent) const
+{
+  // a dictionary never receives a string it already contains (greedy search only) => if that string is a known difference
+  // then it was stored in the other dictionary and now both contain it
+  int& first = scratch.firstDifference[getBucket(pos, length)];
+  int* link  = &first;
+  while (*link >= 0)
+  {
+    Difference& difference = scratch.differences[*link];
+    if (difference.length == length && std::equal(m_data + pos, m_data + pos + length, m_data + difference.pos))
+    {
+      // remove
+      scratch.unusedDifferences.push_back(*link);
+      difference.length = 0;
+      *link = difference.next;
+      return;
+    }
+    link = &difference.next;
+  }
+
+  // add
+  Difference difference;
+  difference.pos         = pos;
+  difference.length      = length;
+  difference.onlyCurrent = onlyCurrent;
+  difference.next        = first;
+  if (scratch.unusedDifferences.empty())
+  {
+    first = (int)scratch.differences.size();
+    scratch.differences.push_back(difference);
+  }
+  else
+  {
+    first = scratch.unusedDifferences.back();
+    scratch.unusedDifferences.pop_back();
+    scratch.differences[first] = difference;
+  }
+}
+
+
+/// incremental estimation: longest match at m_data[pos] if the reference dictionary's longest match has referenceLength bytes
+unsigned int LzwEncoder::mirrorMatch(const Scratch& scratch, unsigned int pos, unsigned int referenceLength) const
+{
+  // all differences are at least two bytes long
+  unsigned int remaining = m_size - pos;
+  if (remaining < 2)
+    return referenceLength;
+
+  // both dictionaries contain all prefixes of their strings:
+  // - if a prefix with up to referenceLength bytes is missing in the current dictionary, then the current match ends before it
+  // - else all matching strings longer than referenceLength bytes are found in the current dictionary only, pick the longest
+  unsigned int shortestMissing = 0;
+  unsigned int longest         = referenceLength;
+  // strings with two bytes are stored in different buckets than longer strings
+  for (unsigned int minLength = 2; minLength <= 3 && minLength <= remaining; minLength++)
+    for (int i = scratch.firstDifference[getBucket(pos, minLength)]; i >= 0; i = scratch.differences[i].next)
+    {
+      const Difference& difference = scratch.differences[i];
+      if (difference.length > remaining || (minLength == 2) != (difference.length == 2))
+        continue;
+      if (!std::equal(m_data + difference.pos, m_data + difference.pos + difference.length, m_data + pos))
+        continue;
+
+      if (difference.onlyCurrent)
+      {
+        if (longest < difference.length)
+          longest = difference.length;
+      }
+      else
+      {
+        if (difference.length <= referenceLength && (shortestMissing == 0 || shortestMissing > difference.length))
+          shortestMissing = difference.length;
+      }
+    }
+
+  return shortestMissing > 0 ? shortestMissing - 1 : longest;
+}
+
+
+/// optimize a single block, either update m_best or (if candidates isn't NULL) return all possible block ends without touching m_best
+BitStream LzwEncoder::optimizeBlock(Scratch& scratch, unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal,
+                                                OptimizationSettings optimize, std::vector<Candidate>* candidates)
+{
+  // resetting a small ArrayDictionary is cheap and its lookups are faster than HashDictionary's
+  bool useHash = (optimize.dictionaryLayout == OptimizationSettings::LayoutHash);
+  if (optimize.dictionaryLayout == OptimizationSettings::LayoutAuto)
+    useHash = optimize.minCodeSize > SmallAlphabetBits;
+
+  if (useHash)
+    return optimizeBlock(scratch, scratch.hashDictionary,  from, maxLength, emitBitStream, isFinal, optimize, candidates);
+  else
+    return optimizeBlock(scratch, scratch.arrayDictionary, from, maxLength, emitBitStream, isFinal, optimize, candidates);
+}
+
+
+/// same as before, but Dictionary is either ArrayDictionary or HashDictionary
+template <typename Dictionary>
+BitStream LzwEncoder::optimizeBlock(Scratch& scratch, Dictionary& dictionary, unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal,
+                                                OptimizationSettings optimize, std::vector<Candidate>* candidates)
+{
 
   // length of current block
-  unsigned int length = (unsigned int)m_data.size() - from;
+  unsigned int length = m_size - from;
   if (length > maxLength && maxLength != 0)
     length = maxLength;
 
@@ -172,28 +459,68 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
   }
 #endif
   // no recomputation in second pass of --prettygood mode if previous non-greedy search was unsuccessful
-  if (optimize.greedy                    &&
-      optimize.avoidNonGreedyAgain       &&
-     !emitBitStream                      &&
-      m_best[fromAligned].nongreedy == 0 &&
-      m_best[fromAligned].length    >  0)
+  // (multi-threaded estimation has to check that later in applyCandidates() because m_best isn't ready yet)
+  if (!emitBitStream && candidates == NULL && skipGreedyAgain(from, optimize))
     return result;
 
   // special codes
   const unsigned int clear       = 1 << optimize.minCodeSize;
   const unsigned int endOfStream = clear + 1;
 
+  const unsigned int firstCode    = m_isGif ? clear + 2 : clear + 1; // .Z format: no endOfStream
+  const unsigned int alphabetSize = clear < 256 ? clear : 256;       // GIF: all literals are smaller than the clear code
+  unsigned int& dictSize = scratch.dictSize;
+  dictSize = firstCode;
+  scratch.numNonGreedy = 0;
+  Statistics& statistics = scratch.statistics;
+  statistics.numBlocks++;
+
+  // incremental estimation: the reference estimation (usually starting a few bytes later) already filled the dictionary,
+  // all codes below referenceCodes were known to it when it reached the current position
+  // => greedy search mostly produces the same tokens and both dictionaries differ only in a few strings (see mirrorMatch)
+  bool recordTokens = optimize.incremental && !emitBitStream && maxLength == 0;
+  bool isVirtual    = recordTokens && optimize.greedy && scratch.hasReference && scratch.referenceFrom > from &&
+                      scratch.referenceSettings.minCodeSize      == optimize.minCodeSize   &&
+                      scratch.referenceSettings.maxDictionary    == optimize.maxDictionary &&
+                      scratch.referenceSettings.maxTokens        == optimize.maxTokens     &&
+                      scratch.referenceSettings.dictionaryLayout == optimize.dictionaryLayout;
+  // next token of the reference estimation
+  size_t       referenceIndex = 0;
+  // number of valid codes in the reference dictionary
+  unsigned int referenceCodes = firstCode;
+  scratch.current.clear();
+
+  // non-greedy search probes most positions several times: memoize greedy matches
+  bool useCache = !optimize.greedy && optimize.matchCache > 0;
+  if (useCache)
+  {
+    // largest power of two not exceeding the limit, but no need to exceed the input size
+    size_t cacheSize = 1;
+    while (cacheSize * 2 <= optimize.matchCache && cacheSize < m_size)
+      cacheSize *= 2;
+    if (scratch.matchCache.size() != cacheSize)
+    {
+      CachedMatch unused = { ~0U, 0, 0 };
+      scratch.matchCache.assign(cacheSize, unused);
+    }
+  }
+  else if (optimize.matchCache == 0)
+    std::vector<CachedMatch>().swap(scratch.matchCache);
+  // invalidate all old matches
+  scratch.blockGeneration = ++scratch.generation;
+
   // initialize dictionary
-  std::array<int, 256> children;
-  children.fill(Unknown);
-  m_dictionary.resize(m_maxDictionary);
-  for (unsigned int i = 0; i < m_maxDictionary; i++)
-    m_dictionary[i] = children;
-
-  if (m_isGif)
-    m_dictSize = clear + 2;
+  if (isVirtual)
+    clearDifferences(scratch);
   else
-    m_dictSize = clear + 1; // .Z format: no endOfStream
+  {
+    dictionary.reset(m_maxDictionary, alphabetSize);
+    scratch.hasReference = false;
+  }
+
+  // estimation doesn't need to look at each byte separately
+  bool fastEstimate = !emitBitStream && !optimize.readOnlyBest;
+  bool isAligned    = (optimize.alignment == 1);
 
   // initialize counters
   unsigned int  numBits   = 0;
@@ -202,8 +529,15 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 
   // total length of the current match, initially no match
   unsigned int  matchLength = 0;
+  // non-greedy search: the lookahead already found the greedy match at position lookaheadPos
+  unsigned int  lookaheadPos    = 0;
+  unsigned int  lookaheadLength = 0;
+  // length of the previous match
+  unsigned int  previousLength  = 0;
+  // length of the longest string in the dictionary, no match can be longer
+  unsigned int  longestString   = 1;
   // bits per code
-  unsigned char codeSize = getMinBits(m_dictSize);
+  unsigned char codeSize = getMinBits(dictSize);
 
   // process input
   unsigned int lastPos = from + length - 1;
@@ -218,7 +552,7 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
     if (matchLength == 0)
     {
       // if blocks become too large then it's quite unlikely to find a better compression
-      if (optimize.maxDictionary > 0 && m_dictSize >= optimize.maxDictionary)
+      if (optimize.maxDictionary > 0 && dictSize >= optimize.maxDictionary)
         break; // some broken decoders can't handle a full dictionary, too
       if (optimize.maxTokens     > 0 && numTokens  >= optimize.maxTokens)
         break;
@@ -227,58 +561,121 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 
       // total number of bytes left in the current block
       unsigned int remaining = length + from - i;
+
+      // incremental estimation: all reference tokens before the current position added their strings to the reference dictionary
+      const std::vector<Token>& reference = scratch.reference;
+      if (isVirtual)
+      {
+        while (referenceIndex < reference.size() && reference[referenceIndex].pos < i)
+        {
+          const Token& token = reference[referenceIndex++];
+          if (token.pos + token.length < m_size && referenceCodes < m_maxDictionary)
+          {
+            toggleDifference(scratch, token.pos, token.length + 1, false);
+            referenceCodes++;
+          }
+        }
+
+        // both estimations diverged too much: rebuild dictionary and continue the regular way
+        if (scratch.differences.size() - scratch.unusedDifferences.size() > MaxDifferences)
+        {
+          isVirtual = false;
+          dictionary.reset(m_maxDictionary, alphabetSize);
+          scratch.hasReference = false;
+
+          unsigned int replaySize = firstCode;
+          for (size_t replay = 0; replay < scratch.current.size(); replay++)
+          {
+            addCode(dictionary, replaySize, scratch.current[replay].pos, scratch.current[replay].length);
+            if (longestString <= scratch.current[replay].length)
+              longestString = scratch.current[replay].length + 1;
+          }
+#ifdef ALLOW_VERBOSE
+          if (replaySize != dictSize)
+            throw "incremental estimation failed to rebuild the dictionary";
+#endif
+        }
+      }
+
       // find longest match (greedy), must not exceed number of available bytes
-      matchLength = findMatch(i, remaining);
+      bool isShared = false;
+      // code of the match, if already known
+      int matchCode = Unknown;
+      if (isVirtual)
+      {
+        // longest match of the reference dictionary: either it's the next reference token or search for it
+        bool isSynchronized = (referenceIndex < reference.size() && reference[referenceIndex].pos == i);
+        unsigned int referenceLength = isSynchronized ? reference[referenceIndex].length : 0;
+        if (!isSynchronized)
+        {
+          referenceLength = findMatch(dictionary, i, remaining, referenceCodes);
+          statistics.numSearches++;
+          statistics.searchDepth += referenceLength;
+        }
+        matchLength = mirrorMatch(scratch, i, referenceLength);
+        // both dictionaries will add the same string
+        isShared = isSynchronized && matchLength == referenceLength;
+      }
+      else if (lookaheadPos == i && i > from && lookaheadLength != previousLength)
+        // the lookahead's result is still valid: the string added by the previous match can only extend a match
+        // which ended exactly after previousLength bytes
+        matchLength = lookaheadLength;
+      else if (useCache)
+        matchLength = findCachedMatch(scratch, dictionary, i, remaining);
+      else
+      {
+        matchLength = findMatch(dictionary, i, remaining, ~0U, &matchCode);
+        statistics.numSearches++;
+        statistics.searchDepth += matchLength;
+      }
 
       // non-greedy lookahead
       bool tryNonGreedy = !optimize.greedy;
       if (matchLength == 1 || matchLength < optimize.minNonGreedyMatch)
         tryNonGreedy = false;
       // non-greedy search doesn't make sense when we're very close to the end
-      if (i + matchLength + 4 >= m_data.size()) // the number 4 was chosen randomly ...
+      if (i + matchLength + 4 >= m_size) // the number 4 was chosen randomly ...
         tryNonGreedy = false;
 
       // flexible parsing
       if (tryNonGreedy)
       {
-        // don't split long runs of the same pixels
-        if (!optimize.splitRuns)// && matchLength >= 2)
-        {
-          // cheap check of first and last byte
-          unsigned int lastMatchByte = matchLength - 1;
-          bool allTheSame = (m_data[i] == m_data[i + lastMatchByte]);
-
-          // and the rest of them until a mismatch is found
-          for (unsigned int scan = 1; scan + 1 < lastMatchByte && allTheSame; scan++)
-            allTheSame = (m_data[i] == m_data[i + scan]);
-          // all pixels are identical ?
-          if (allTheSame)
-            tryNonGreedy = false;
-        }
+        // note: long runs of the same pixels used to be detected here (option -r), but the result was never used,
+        //       therefore runs are split like any other match
 
         // greedy matching after the current match
-        unsigned int second  = findMatch(i + matchLength, remaining - matchLength);
+        unsigned int second  = findCachedMatch(scratch, dictionary, i + matchLength, remaining - matchLength);
         // sum of these two greedy matches
         unsigned int best    = matchLength + second;
         // look for an improvement
         unsigned int atLeast = best + optimize.minImprovement;
+        if (atLeast <= best)
+          atLeast = best + 1;
 
         // store length of currently best greedy/non-greedy match
         unsigned int choice = matchLength;
-        // try all non-greedy lengths
-        for (unsigned int shorter = matchLength - 1; shorter > 0; shorter--)
+        unsigned int choiceNext = second;
+        // try all non-greedy lengths, stop if not even the longest string of the dictionary can beat the current best
+        for (unsigned int shorter = matchLength - 1; shorter > 0 && shorter + longestString >= atLeast && remaining >= atLeast; shorter--)
         {
           // greedy match of everything that follows
-          unsigned int next = findMatch(i + shorter, remaining - shorter);
+          unsigned int next = findCachedMatch(scratch, dictionary, i + shorter, remaining - shorter);
           unsigned int sum  = shorter + next;
+          statistics.numNonGreedyProbes++;
           // longer ?
-          if (sum >= atLeast && sum > best)
+          if (sum >= atLeast)
           {
-            best   = shorter + next;
-            choice = shorter;
+            best    = shorter + next;
+            atLeast = best + 1;
+            choice  = shorter;
+            choiceNext = next;
           }
         }
 
+        // the greedy match following the chosen match is already known
+        lookaheadPos    = i + choice;
+        lookaheadLength = choiceNext;
+
         // found a better sequence than greedy match ?
         if (choice < matchLength)
         {
@@ -291,16 +688,18 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
           */
 #endif
           matchLength = choice;
+          matchCode   = Unknown;
           numNonGreedyMatches++;
+          statistics.numNonGreedyAccepted++;
         }
       } // end of flexible parsing
 
       // ----- LZW code generation -----
 
       // need one more bit per code ?
-      if (m_dictSize < m_maxDictionary)
+      if (dictSize < m_maxDictionary)
       {
-        unsigned int threshold = m_dictSize - 1;
+        unsigned int threshold = dictSize - 1;
         // detect powerOfTwo (see https://bits.stephan-brumme.com/isPowerOfTwo.html )
         if ((threshold & (threshold - 1)) == 0 && codeSize < m_maxCodeLength) // but never use more than 12 (or 16) bits
         {
@@ -312,14 +711,83 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
       }
 
       // update dictionary
-      unsigned int code = addCode(i, matchLength);
+      unsigned int code = 0;
+      if (isVirtual)
+      {
+        // just count the current dictionary's entries and keep track of strings missing in the reference dictionary
+        // (greedy search never adds a string which already exists, neither in the current nor in the reference dictionary)
+        if (i + matchLength < m_size && dictSize < m_maxDictionary)
+        {
+          dictSize++;
+          if (isShared && referenceCodes < m_maxDictionary)
+          {
+            // same string added to both dictionaries
+            referenceIndex++;
+            referenceCodes++;
+          }
+          else
+            toggleDifference(scratch, i, matchLength + 1, true);
+        }
+
+        if (isShared)
+          statistics.numReusedTokens++;
+        else
+          statistics.numParsedTokens++;
+      }
+      else
+      {
+        unsigned int before = dictSize;
+        code = addCode(dictionary, dictSize, i, matchLength, matchCode);
+        if (dictSize > before)
+        {
+          if (longestString <= matchLength)
+            longestString = matchLength + 1;
+
+          // memoized matches of matchLength bytes might be too short now
+          if (useCache)
+          {
+            if (scratch.lastAdded.size() <= matchLength)
+              scratch.lastAdded.resize(matchLength + 1, 0);
+            scratch.lastAdded[matchLength] = ++scratch.generation;
+          }
+        }
+        if (recordTokens)
+          statistics.numParsedTokens++;
+      }
+
+      if (recordTokens)
+      {
+        Token token;
+        token.pos    = i;
+        token.length = matchLength;
+        scratch.current.push_back(token);
+      }
+
       // append code to LZW stream
       if (emitBitStream)
-        add(result, code, codeSize);
+        result.add(code, codeSize);
 
       // counters
       numBits += codeSize;
       numTokens++;
+      previousLength = matchLength;
+
+      // estimation: all bytes of the current match share the same state, evaluate them at once
+      if (fastEstimate)
+      {
+        MatchState state = { from, i, matchLength, numBits, numTokens, numNonGreedyMatches, dictSize, codeSize };
+        if (m_isGif)
+          isAligned ? estimateMatch<true,  true >(state, optimize.alignment, candidates)
+                    : estimateMatch<true,  false>(state, optimize.alignment, candidates);
+        else
+          isAligned ? estimateMatch<false, true >(state, optimize.alignment, candidates)
+                    : estimateMatch<false, false>(state, optimize.alignment, candidates);
+
+        // skip the rest of the match
+        i += matchLength - 1;
+        matchLength = 0;
+        continue;
+      }
     }
 
     // "eat" next byte of the current match (until it's 0 and we look for the next match)
@@ -332,13 +800,13 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
       continue;
 
     // don't update m_best if no block optimization started at the current slot
-    bool isLastByte   = (i + 1 == m_data.size());
+    bool isLastByte   = (i + 1 == m_size);
     // look at compression result of the remaining bytes
     unsigned int next =  i + 1;
     unsigned int nextAligned = next;
     if (optimize.alignment > 1)
       nextAligned = (next + optimize.alignment - 1) / optimize.alignment; // find current m_best index
-    if (!isLastByte && m_best[nextAligned].totalBits == 0)
+    if (!isLastByte && candidates == NULL && m_best.totalBits[nextAligned] == 0)
       continue;
 
     // save cost information only on aligned addresses (except for the last bytes)
@@ -352,33 +820,31 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 
     // assuming the block would end here, a few extra bits are needed
     unsigned int add = codeSize; // clear / end-of-stream
-    // increase code size just for the clear / end-of-stream code ?
-    size_t threshold = m_dictSize - 1;
+    // increase code size just for the clear / end-of-stream code ? (end-of-stream: see emitBitStream below)
+    size_t threshold = (m_isGif && isLastByte) ? dictSize : dictSize - 1;
     if ((threshold & (threshold - 1)) == 0 && codeSize < m_maxCodeLength)
       add++;
 
     if (!m_isGif)
     {
-      // TODO: only allow restart if clear code can be encoded in 16 bits
-      if (!isLastByte && codeSize < 16)
-        continue;
-
-      // no endOfStream token in .Z file format
-      if (isLastByte)
-        add = 0;
-
-      // fill last byte
-      if (numBits % 8 != 0)
-        add += 8 - (numBits % 8);
+      // the last block of a segment is followed by a clear code, too
+      bool needsClear = !isLastByte || !m_isFinal;
 
-      // dictionary resets are followed by a bunch of zeros
-      if (!isLastByte)
+      if (needsClear)
       {
+        // compress' LZW must be aligned to 8 tokens: a dictionary reset is followed by zeros until the group of 8 codes is complete
+        // (each code size begins with a fresh group and all groups are byte-aligned, so no extra bits are needed to fill the last byte)
         unsigned int tokensPlusClear = numTokens + 1;
-        // compress' LZW must be aligned to 8 tokens
         unsigned int mod8 = tokensPlusClear & 7;
         unsigned int gap  = mod8 == 0 ? 0 : 8 - mod8;
-        add += codeSize * gap;
+        add += add * gap;
+      }
+      else
+      {
+        // no endOfStream token in .Z file format, just fill the last byte
+        add = 0;
+        if (numBits % 8 != 0)
+          add += 8 - (numBits % 8);
       }
     }
 
@@ -387,18 +853,25 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 
     // compute final cost
     unsigned int       trueBits  = numBits  + add;
-    unsigned long long totalBits = trueBits + m_best[nextAligned].totalBits;
+
+    // multi-threaded: m_best[nextAligned] might be unknown yet, let applyCandidates() do the rest
+    if (candidates != NULL)
+    {
+      Candidate candidate;
+      candidate.length    = numBytes;
+      candidate.bits      = trueBits;
+      candidate.nongreedy = numNonGreedyMatches;
+      candidate.partial   = isPartial;
+      candidates->push_back(candidate);
+      continue;
+    }
+
+    unsigned long long totalBits = trueBits + m_best.totalBits[nextAligned];
 
     // better path ? (or no path found at all so far)
-    BestBlock& best = m_best[fromAligned];
-    if (best.totalBits == 0 || best.totalBits >= totalBits)
+    if (m_best.update(fromAligned, totalBits, numBytes, numNonGreedyMatches > 0, isPartial))
     {
-      best.bits      = trueBits;
-      best.totalBits = totalBits;
-      best.length    = numBytes;
-      best.tokens    = numTokens;
-      best.partial   = isPartial;
-      best.nongreedy = numNonGreedyMatches;
+      m_statistics.numBestUpdates++;
 
       // note: if there are multiple paths with the same cost, then longer blocks are preferred
       //       to change this, replace "best.totalBits >  totalBits"
@@ -411,47 +884,32 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
   if (emitBitStream)
   {
     // end of block: emit either clear or endOfStream code
-    codeSize = getMinBits(m_dictSize - 1);
+    // (the last token of the input doesn't add a code to our dictionary, but the decoder always adds one)
+    codeSize = getMinBits(isFinal && m_isGif ? dictSize : dictSize - 1);
+    if (codeSize > m_maxCodeLength)
+      codeSize = m_maxCodeLength;
     if (m_isGif)
     {
-      add(result, isFinal ? endOfStream : clear, codeSize);
+      result.add(isFinal ? endOfStream : clear, codeSize);
     }
     else
     {
       // only clear code, no endOfStream
       if (!isFinal)
       {
-        add(result, clear, codeSize);
+        result.add(clear, codeSize);
         numTokens++;
       }
 
       // fill current byte
-      while (result.size() % 8 != 0)
-      {
-        result.push_back(0);
-        numBits++;
-      }
+      numBits += (unsigned int)((8 - result.size() % 8) % 8);
+      result.fillByte();
 
       // a block's number of token has to be a multiple of 8
       if (!isFinal)
       {
-        if (codeSize != 16)
-        {
-#ifdef ALLOW_VERBOSE
-          std::cerr << "LZW code size is " << (int)codeSize << std::endl;
-          throw "flexiGIF currently only supports restarts with code size = 16";
-#endif
-          //throw "experimental code: currently only 16 bit clear codes supported";
-          // some experimental values for numZeros if codeSize < 16:
-          // 20/9 => 3
-          // 21/9 => 2
-          // 22/9 => 1
-          // 30/9 => 2
-          // 31/9 => 1
-          // 50/9 => 3
-        }
-
-        // same formulas as in LzwDecoder
+        // same formulas as in LzwDecoder: pad gap codes, fillByte() already wrote the first (codeSize * gap) % 8 bits
+        // (all codes of smaller sizes form complete groups, therefore numTokens & 7 refers to the clear code's group)
         unsigned int mod8 = numTokens & 7;
         unsigned int gap  = mod8 == 0 ? 0 : 8 - mod8;
         // add zeros
@@ -460,14 +918,28 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 #ifdef ALLOW_VERBOSE
         //std::cout << "pad " << numZeros << " zeros" << std::endl;
 #endif
-        for (unsigned int bit = 0; bit < 8*numZeros; bit++)
-          result.push_back(0);
+        result.addZeros(8 * numZeros);
       }
     }
   }
 
+  scratch.numNonGreedy = numNonGreedyMatches;
+
+  // incremental estimation: next time start with a fresh reference if this one was already quite different
+  if (isVirtual && scratch.differences.size() - scratch.unusedDifferences.size() > MaxDifferences / 4)
+    scratch.hasReference = false;
+
+  // incremental estimation: a real greedy estimation becomes the new reference (even non-greedy search may produce greedy tokens only)
+  if (recordTokens && !isVirtual && numNonGreedyMatches == 0)
+  {
+    scratch.reference.swap(scratch.current);
+    scratch.hasReference      = true;
+    scratch.referenceFrom     = from;
+    scratch.referenceSettings = optimize;
+  }
+
   // error checking
-  if (m_best[fromAligned].length == 0)
+  if (candidates == NULL && m_best.length[fromAligned] == 0)
   {
 #ifdef ALLOW_VERBOSE
     //std::cerr <<  << std::endl;
@@ -479,16 +951,250 @@ LzwEncoder::BitStream LzwEncoder::optimizePartial(unsigned int from, unsigned in
 }
 
 
+/// estimation only: same as the second half of optimizeBlock()'s main loop for all bytes of a single match
+template <bool IsGif, bool IsAligned>
+void LzwEncoder::estimateMatch(const MatchState& state, unsigned int alignment, std::vector<Candidate>* candidates)
+{
+  if (IsAligned)
+    alignment = 1;
+  const unsigned int size = m_size;
+
+  // assuming the block would end here, a few extra bits are needed: clear / end-of-stream
+  unsigned int add = state.codeSize;
+  // increase code size just for the clear / end-of-stream code ?
+  unsigned int threshold = state.dictSize - 1;
+  if ((threshold & (threshold - 1)) == 0 && state.codeSize < m_maxCodeLength)
+    add++;
+  // end-of-stream: the last token of the input doesn't add a code to our dictionary, but the decoder always adds one
+  unsigned int addLast = state.codeSize;
+  if ((state.dictSize & (state.dictSize - 1)) == 0 && state.codeSize < m_maxCodeLength)
+    addLast++;
+
+  if (!IsGif)
+  {
+    // no endOfStream token in .Z file format, just fill the last byte
+    addLast = (state.numBits % 8 != 0) ? 8 - (state.numBits % 8) : 0;
+
+    // compress' LZW must be aligned to 8 tokens, dictionary resets are followed by zeros until the group is complete
+    // (groups are byte-aligned, see optimizePartial)
+    unsigned int tokensPlusClear = state.numTokens + 1;
+    unsigned int mod8 = tokensPlusClear & 7;
+    unsigned int gap  = mod8 == 0 ? 0 : 8 - mod8;
+    add += add * gap;
+  }
+
+  unsigned int trueBits    = state.numBits + add;
+  unsigned int fromAligned = state.from / alignment;
+  bool hasNonGreedy        = state.numNonGreedy > 0;
+
+  // all aligned block ends inside the match, except for the end of input
+  unsigned int last = state.pos + state.length;
+  unsigned int next = state.pos + 1;
+  if (!IsAligned)
+    next = (next + alignment - 1) / alignment * alignment;
+  for (; next <= last && next < size; next += alignment)
+  {
+    // true if the we are currently "inside" a match
+    bool isPartial = (next < last);
+
+    // multi-threaded: m_best[nextAligned] might be unknown yet, let applyCandidates() do the rest
+    if (candidates != NULL)
+    {
+      Candidate candidate;
+      candidate.length    = next - state.from;
+      candidate.bits      = trueBits;
+      candidate.nongreedy = state.numNonGreedy;
+      candidate.partial   = isPartial;
+      candidates->push_back(candidate);
+      continue;
+    }
+
+    // don't update m_best if no block optimization started at the next slot
+    unsigned long long following = m_best.totalBits[next / alignment];
+    if (following == 0)
+      continue;
+
+    // better path ? (or no path found at all so far)
+    if (m_best.update(fromAligned, trueBits + following, next - state.from, hasNonGreedy, isPartial))
+      m_statistics.numBestUpdates++;
+  }
+
+  // end of input
+  if (last != size)
+    return;
+
+  // the last block of a segment is followed by a clear code, too
+  trueBits = state.numBits + (m_isFinal ? addLast : add);
+  if (candidates != NULL)
+  {
+    Candidate candidate;
+    candidate.length    = size - state.from;
+    candidate.bits      = trueBits;
+    candidate.nongreedy = state.numNonGreedy;
+    candidate.partial   = false;
+    candidates->push_back(candidate);
+    return;
+  }
+
+  unsigned long long totalBits = trueBits + m_best.totalBits[(size + alignment - 1) / alignment];
+  if (m_best.update(fromAligned, totalBits, size - state.from, hasNonGreedy, false))
+    m_statistics.numBestUpdates++;
+}
+
+
+/// update m_best based on candidates found by optimizeBlock()
+void LzwEncoder::applyCandidates(unsigned int from, const std::vector<Candidate>& candidates, OptimizationSettings optimize)
+{
+  // same code as the second half of optimizeBlock()'s main loop
+  unsigned int fromAligned = from / optimize.alignment;
+  for (size_t i = 0; i < candidates.size(); i++)
+  {
+    const Candidate& candidate = candidates[i];
+
+    // look at compression result of the remaining bytes
+    unsigned int next = from + candidate.length;
+    bool isLastByte   = (next == m_size);
+    unsigned int nextAligned = next;
+    if (optimize.alignment > 1)
+      nextAligned = (next + optimize.alignment - 1) / optimize.alignment;
+    if (!isLastByte && m_best.totalBits[nextAligned] == 0)
+      continue;
+
+    // better path ? (or no path found at all so far)
+    unsigned long long totalBits = candidate.bits + m_best.totalBits[nextAligned];
+    if (m_best.update(fromAligned, totalBits, candidate.length, candidate.nongreedy > 0, candidate.partial))
+      m_statistics.numBestUpdates++;
+  }
+}
+
+
+/// same as calling optimizePartial(x, 0, false, true, optimize) for all aligned x in [from, to) in descending order
+void LzwEncoder::estimate(unsigned int from, unsigned int to, OptimizationSettings optimize, bool smartGreedy, ThreadPool& pool, unsigned int maxThreads)
+{
+  if (optimize.alignment == 0)
+    optimize.alignment = 1;
+  // allocate memory
+  if (m_best.empty())
+    m_best.resize(m_size / optimize.alignment + 1 + 1);
+
+  // a second pass is only needed in --prettygood mode
+  bool twoPasses = smartGreedy && !optimize.greedy;
+  OptimizationSettings greedy = optimize;
+  greedy.greedy = true;
+
+  // all aligned block starts in descending order
+  std::vector<unsigned int> starts;
+  if (to > m_size)
+    to = m_size;
+  for (unsigned int i = to; i-- > from; )
+    if (i % optimize.alignment == 0)
+      starts.push_back(i);
+
+  // single-threaded
+  if (maxThreads <= 1 || starts.size() <= 1)
+  {
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+      optimizePartial(starts[i], 0, false, true, optimize);
+      if (twoPasses)
+        optimizePartial(starts[i], 0, false, true, greedy);
+    }
+    return;
+  }
+
+  // multi-threaded: each thread estimates the cost of all possible blocks starting at a certain position,
+  // which doesn't depend on m_best at all, only picking the best block needs m_best of all following positions
+  // => that last step is done in descending order, always as soon as all previous block starts are finished
+  struct Job
+  {
+    /// candidates of the first pass and (optionally) of the second pass
+    std::vector<Candidate> candidates[2];
+    /// true if the (greedy) second pass is identical to the first pass
+    bool reuseFirstPass;
+    /// true if candidates can be applied to m_best
+    bool ready;
+  };
+  std::vector<Job> jobs(starts.size());
+  for (size_t i = 0; i < jobs.size(); i++)
+    jobs[i].ready = false;
+
+  if (maxThreads > starts.size())
+    maxThreads = (unsigned int)starts.size();
+  if (m_scratch.size() < maxThreads)
+    m_scratch.resize(maxThreads);
+
+  // each thread processes adjacent block starts because incremental estimation works best if its reference estimation started just a few bytes later
+  unsigned int groupSize = optimize.incremental ? ((unsigned int)jobs.size() + maxThreads - 1) / maxThreads : 1;
+
+  std::atomic<unsigned int> nextGroup(0);
+  std::mutex   bestMutex;
+  unsigned int numApplied = 0;
+
+  pool.run([&](unsigned int slot)
+  {
+    Scratch& scratch = m_scratch[slot];
+    unsigned int current = 0;
+    unsigned int last    = 0;
+    while (true)
+    {
+      if (current == last)
+      {
+        current = nextGroup++ * groupSize;
+        last    = current + groupSize;
+        if (last > jobs.size())
+          last = (unsigned int)jobs.size();
+      }
+      if (current >= jobs.size())
+        break;
+
+      Job& job = jobs[current];
+      optimizeBlock(scratch, starts[current], 0, false, true, optimize, &job.candidates[0]);
+      // greedy search yields the same result if non-greedy search never found a better match
+      job.reuseFirstPass = (scratch.numNonGreedy == 0);
+      if (twoPasses && !job.reuseFirstPass)
+        optimizeBlock(scratch, starts[current], 0, false, true, greedy, &job.candidates[1]);
+
+      // update m_best in descending order
+      std::lock_guard<std::mutex> lock(bestMutex);
+      job.ready = true;
+      while (numApplied < jobs.size() && jobs[numApplied].ready)
+      {
+        Job& apply = jobs[numApplied];
+        unsigned int start = starts[numApplied];
+        applyCandidates(start, apply.candidates[0], optimize);
+        if (twoPasses && !skipGreedyAgain(start, greedy))
+          applyCandidates(start, apply.candidates[apply.reuseFirstPass ? 0 : 1], greedy);
+
+        // free memory
+        std::vector<Candidate>().swap(apply.candidates[0]);
+        std::vector<Candidate>().swap(apply.candidates[1]);
+        numApplied++;
+      }
+
+      current++;
+    }
+  }, maxThreads);
+}
+
+
 /// determine best block boundaries based on results of optimizePartial() and call merge()
-LzwEncoder::BitStream LzwEncoder::optimize(OptimizationSettings optimize)
+BitStream LzwEncoder::optimize(OptimizationSettings optimize)
+{
+  // LZW compress along the shortest path
+  return merge(findRestarts(optimize), optimize);
+}
+
+
+/// determine best block boundaries based on results of optimizePartial(), that's the first half of optimize()
+std::vector<unsigned int> LzwEncoder::findRestarts(const OptimizationSettings& optimize) const
 {
   // find shortest path
   unsigned int pos     = 0;
   unsigned int aligned = 0;
   std::vector<unsigned int> restarts;
-  while (pos < m_data.size())
+  while (pos < m_size)
   {
-    unsigned int length = m_best[aligned].length;
+    unsigned int length = m_best.length[aligned];
     // no continuation ?
     if (length == 0)
     {
@@ -504,39 +1210,54 @@ LzwEncoder::BitStream LzwEncoder::optimize(OptimizationSettings optimize)
     restarts.push_back(pos);
   }
 
-  // LZW compress along the shortest path
-  return merge(restarts, optimize);
+  return restarts;
+}
+
+
+/// true if estimate() found a path from the first to the last byte, i.e. findRestarts() won't fail
+bool LzwEncoder::hasPath() const
+{
+  // m_best.totalBits[x] is only known if there is a complete path from x to the end
+  return m_size == 0 || (!m_best.empty() && m_best.totalBits[0] != 0);
+}
+
+
+/// estimated number of bits from an aligned block start to the end of data, zero if unknown yet
+unsigned long long LzwEncoder::getEstimatedBits(unsigned int from, unsigned int alignment) const
+{
+  unsigned int aligned = from / alignment;
+  if (aligned >= m_best.totalBits.size())
+    return 0;
+  return m_best.totalBits[aligned];
 }
 
 
 /// optimize if block boundaries are known
-LzwEncoder::BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, OptimizationSettings optimize)
+BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, OptimizationSettings optimize)
 {
   // final result
   BitStream result;
-  result.reserve(m_data.size() * 3); // basic heuristic to estimate memory consumption
+  result.reserve(m_size * 3); // basic heuristic to estimate memory consumption
 
   // optional: prepend clear code
   if (optimize.startWithClearCode && m_isGif)
   {
     // it's 2^minCodeSize which is a bunch of zeros followed by a one
-    for (unsigned int i = 0; i < optimize.minCodeSize; i++)
-      result.push_back(false);
-    result.push_back(true);
+    result.add(1 << optimize.minCodeSize, optimize.minCodeSize + 1);
   }
 
   // check number of restarts
   if (restarts.empty())
     return result;
-  if (restarts.back() < m_data.size())
-    restarts.push_back((unsigned int)m_data.size());
+  if (restarts.back() < m_size)
+    restarts.push_back(m_size);
 
   // statistics
   std::vector<unsigned int> sizes;
 
   // verbose mode displays garbage if using predefined block sizes
   bool verbose = optimize.verbose;
-  if (m_best.empty() || m_best[0].bits == 0)
+  if (m_best.empty() || m_best.totalBits[0] == 0)
     verbose = false;
 
   unsigned int pos = 0;
@@ -546,13 +1267,14 @@ LzwEncoder::BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, Opti
     if (restarts[i] == 0)
       continue;
 
-    bool isFinal = (i == restarts.size() - 1);
+    bool isLast  = (i == restarts.size() - 1);
+    bool isFinal = isLast && m_isFinal;
     unsigned int length = restarts[i] - pos;
 
     // switch to faster settings
     if (!m_best.empty())
     {
-      optimize.greedy = (m_best[pos / optimize.alignment].nongreedy == 0); // speed-up if non-greedy search was enabled but not successful in this block
+      optimize.greedy = (m_best.flags[pos / optimize.alignment] & BestBlocks::HasNonGreedy) == 0; // speed-up if non-greedy search was enabled but not successful in this block
       if (optimize.greedy)
         optimize.avoidNonGreedyAgain = true;
     }
@@ -566,7 +1288,9 @@ LzwEncoder::BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, Opti
       throw "optimization failed due to an internal error";
     }
     // add to previous stuff
-    result.insert(result.end(), block.begin(), block.end());
+    result.append(block);
+    if (!isFinal)
+      m_statistics.numRestarts++;
 
     unsigned int current = (unsigned int)block.size();
     sizes.push_back(current);
@@ -574,15 +1298,18 @@ LzwEncoder::BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, Opti
 #ifdef ALLOW_VERBOSE
     if (verbose)
     {
-      unsigned int aligned = (pos + optimize.alignment - 1) / optimize.alignment;
-      BestBlock    block   = m_best[aligned];
-      const char*  pixel   = m_isGif ? "pixel" : "byte";
-      std::cout << "cost @ " << pos << " \t=> bits=" << sizes[i] << " \t" << pixel << "s=" << block.length << "\ttokens=" << block.tokens
-                << "\tbits/" << pixel << "=" << float(sizes[i]) / block.length
-                //<< "\testimated_bits=" << block.bits << " "
-                << (block.bits == sizes[i] ? "" : "?")
-                << "\tnon-greedy=" << block.nongreedy
-                << (block.partial       ? ", last match is partial" : "")
+      unsigned int  aligned     = (pos + optimize.alignment - 1) / optimize.alignment;
+      unsigned int  nextAligned = (restarts[i] + optimize.alignment - 1) / optimize.alignment;
+      unsigned int  blockLength = m_best.length[aligned];
+      unsigned char flags       = m_best.flags [aligned];
+      // estimated cost of the current block
+      unsigned long long bits   = m_best.totalBits[aligned] - (isLast ? 0 : m_best.totalBits[nextAligned]);
+      const char*   pixel       = m_isGif ? "pixel" : "byte";
+      std::cout << "cost @ " << pos << " \t=> bits=" << sizes[i] << " \t" << pixel << "s=" << blockLength
+                << "\tbits/" << pixel << "=" << float(sizes[i]) / blockLength
+                << (bits == sizes[i] ? "" : "?")
+                << ((flags & BestBlocks::HasNonGreedy) ? "\tnon-greedy" : "")
+                << ((flags & BestBlocks::IsPartial)    ? ", last match is partial" : "")
                 << std::endl;
     }
 #endif
@@ -599,17 +1326,6 @@ LzwEncoder::BitStream LzwEncoder::merge(std::vector<unsigned int> restarts, Opti
 }
 
 
-/// add bits to BitStream
-void LzwEncoder::add(BitStream& stream, unsigned int token, unsigned char numBits)
-{
-  while (numBits-- > 0)
-  {
-    stream.push_back((token & 1) != 0);
-    token >>= 1;
-  }
-}
-
-
 /// get minimum number of bits to represent token
 unsigned char LzwEncoder::getMinBits(unsigned int token)
 {
@@ -5,22 +5,30 @@
 
 #pragma once
 
+#include "LzwDictionary.h"
+#include "BitStream.h"
+
 #include <vector>
-#include <array>
 
 using std::size_t;
 
+class ThreadPool;
+
 /// compress data with LZW algorithm and a user-defined block-splitting algorithm
 class LzwEncoder
 {
 public:
   /// uncompressed data
   typedef std::vector<unsigned char> RawData;
-  /// encoded/compressed data
-  typedef std::vector<bool> BitStream;
 
-  /// set uncompressed data
+  /// no data yet, call reset() before optimizing anything
+  LzwEncoder();
+  /// set uncompressed data, it isn't copied and must remain valid until reset() is called or the encoder is destroyed
   explicit LzwEncoder(const RawData& data, bool isGif = true);
+  /// replace uncompressed data (same lifetime rules as above) and discard all results, but keep allocated memory (m_best, dictionaries) for the next image
+  void reset(const RawData& data, bool isGif = true);
+  /// same as above for a part of a larger buffer, if isFinal is false then more data follows (.Z only) and the last block must end with a clear code
+  void reset(const unsigned char* data, unsigned int size, bool isGif = true, bool isFinal = true);
 
   /// optimization parameters
   struct OptimizationSettings
@@ -43,8 +51,6 @@ public:
     unsigned int  maxDictionary;
     /// maximum number of tokens per block (huge values severely affect compression speed)
     unsigned int  maxTokens;
-    /// if true then non-greedy matching is allowed to analyze a string of identical bytes
-    bool splitRuns;
 
     /// alignment
     unsigned int alignment;
@@ -53,64 +59,304 @@ public:
     bool readOnlyBest;
     /// don't recompute non-greedy infos when greedy search found no greedy matches
     bool avoidNonGreedyAgain;
+
+    /// memory layout of the dictionary (same results but different speed)
+    enum DictionaryLayout
+    {
+      /// ArrayDictionary for small alphabets, else HashDictionary
+      LayoutAuto,
+      /// always ArrayDictionary
+      LayoutArray,
+      /// always HashDictionary
+      LayoutHash
+    };
+    DictionaryLayout dictionaryLayout;
+
+    /// greedy estimation only: reuse tokens and dictionary of a previous block start (same results, speed depends on the data)
+    bool incremental;
+    /// non-greedy search only: memoize up to matchCache greedy match lengths per thread (same results, 0 => disabled)
+    unsigned int matchCache;
+  };
+
+  /// profiling counters, collected since the most recent reset()
+  struct Statistics
+  {
+    /// number of blocks compressed or estimated (each starts with an empty dictionary)
+    unsigned long long numBlocks;
+    /// number of dictionary resets (clear codes) in the final bitstream
+    unsigned long long numRestarts;
+    /// number of dictionary searches for the longest match
+    unsigned long long numSearches;
+    /// sum of all those matches' lengths (= depth of the dictionary's trie)
+    unsigned long long searchDepth;
+    /// non-greedy search: number of shorter matches tried
+    unsigned long long numNonGreedyProbes;
+    /// non-greedy search: number of shorter matches which were better than the greedy match
+    unsigned long long numNonGreedyAccepted;
+    /// number of times a better block was found (updates of m_best)
+    unsigned long long numBestUpdates;
+    /// incremental estimation: number of tokens found by searching the dictionary
+    unsigned long long numParsedTokens;
+    /// incremental estimation: number of tokens taken from the reference estimation
+    unsigned long long numReusedTokens;
+    /// match cache: number of lookups served by the cache
+    unsigned long long numCacheHits;
+    /// match cache: number of lookups which had to search the dictionary
+    unsigned long long numCacheMisses;
+
+    /// all zero
+    Statistics();
+    /// add all counters
+    Statistics& operator+=(const Statistics& other);
   };
 
   /// optimize a single block and update results in m_best
   BitStream optimizePartial(unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal, OptimizationSettings optimize);
+  /// same as calling optimizePartial(x, 0, false, true, optimize) for all aligned x in [from, to) in descending order,
+  /// if smartGreedy is set then non-greedy search is followed by a greedy search (unless optimize.greedy is set anyway)
+  /** if maxThreads > 1 then several block starts are processed in parallel, but m_best will be exactly the same **/
+  void estimate(unsigned int from, unsigned int to, OptimizationSettings optimize, bool smartGreedy, ThreadPool& pool, unsigned int maxThreads);
+
   /// determine best block boundaries based on results of optimizePartial() and call merge()
   BitStream optimize(OptimizationSettings optimize);
 
+  /// determine best block boundaries based on results of optimizePartial(), that's the first half of optimize()
+  std::vector<unsigned int> findRestarts(const OptimizationSettings& optimize) const;
+  /// true if estimate() found a path from the first to the last byte, i.e. findRestarts() won't fail
+  bool hasPath() const;
+  /// estimated number of bits from an aligned block start to the end of data, zero if unknown yet
+  unsigned long long getEstimatedBits(unsigned int from, unsigned int alignment) const;
+
   /// optimize if block boundaries are known
   BitStream merge(std::vector<unsigned int> restarts, OptimizationSettings optimize);
 
+  /// sum of all threads' counters since the most recent reset()
+  Statistics getStatistics() const;
+
 private:
-  /// add string at m_data[from...from+length] to the dictionary and return its code
-  int          addCode  (unsigned int from, unsigned int length);
-  /// return length of longest match, beginning at m_data[from], limited to maxLength
-  unsigned int findMatch(unsigned int from, unsigned int maxLength);
+  /// cost of a block which ends at a certain position, only needed when estimating several blocks in parallel
+  struct Candidate
+  {
+    /// number of bytes (uncompressed input)
+    unsigned int length;
+    /// number of bits of compressed output
+    unsigned int bits;
+    /// number of non-greedy matches
+    unsigned int nongreedy;
+    /// true if block's last match isn't greedy
+    bool         partial;
+  };
+
+  /// a single LZW token: match at m_data[pos...pos+length)
+  struct Token
+  {
+    /// first byte
+    unsigned int pos;
+    /// number of bytes
+    unsigned int length;
+  };
+
+  /// incremental estimation: string m_data[pos...pos+length) is stored in only one of two dictionaries
+  struct Difference
+  {
+    /// first byte
+    unsigned int pos;
+    /// number of bytes (at least 2)
+    unsigned int length;
+    /// true if only the current dictionary contains that string, false if only the reference dictionary contains it
+    bool         onlyCurrent;
+    /// next difference with the same two initial bytes (index of Scratch::differences, -1 => none)
+    int          next;
+  };
+
+  /// non-greedy search: memoized result of findMatch()
+  struct CachedMatch
+  {
+    /// first byte
+    unsigned int pos;
+    /// length of the longest match
+    unsigned int length;
+    /// value of Scratch::generation when the match was found
+    unsigned long long generation;
+  };
+
+  /// each thread needs its own dictionary
+  struct Scratch
+  {
+    /// only one of these two is used, depending on OptimizationSettings::dictionaryLayout
+    ArrayDictionary arrayDictionary;
+    HashDictionary  hashDictionary;
+    /// number of valid entries in the dictionary
+    unsigned int dictSize;
+    /// number of non-greedy matches found by the most recent call of optimizeBlock()
+    unsigned int numNonGreedy;
+
+    // ----- incremental estimation -----
+    /// tokens of the current estimation
+    std::vector<Token> current;
+    /// tokens of the reference estimation, which is the most recent greedy estimation that actually filled the dictionary
+    std::vector<Token> reference;
+    /// true if reference and dictionary are valid
+    bool               hasReference;
+    /// first byte of the reference estimation
+    unsigned int       referenceFrom;
+    /// settings of the reference estimation
+    OptimizationSettings referenceSettings;
+    /// all strings which are stored in only one of the current and the reference dictionary (unused entries have length = 0)
+    std::vector<Difference> differences;
+    /// first difference for each hash bucket (index of differences, -1 => none), see getBucket()
+    std::vector<int>   firstDifference;
+    /// indices of unused entries of differences
+    std::vector<int>   unusedDifferences;
+
+    // ----- memoized matches -----
+    /// direct-mapped cache, indexed by position (its size is a power of two)
+    std::vector<CachedMatch> matchCache;
+    /// incremented whenever a block starts or a string is added to the dictionary
+    unsigned long long generation;
+    /// generation of the current block's start, older matches are invalid
+    unsigned long long blockGeneration;
+    /// generation when a string of length + 1 bytes was added for the last time
+    /** a match of x bytes can only become longer if a string of x + 1 bytes is added **/
+    std::vector<unsigned long long> lastAdded;
+
+    /// profiling counters of this thread
+    Statistics statistics;
+
+    Scratch()
+    : arrayDictionary(), hashDictionary(), dictSize(0), numNonGreedy(0),
+      current(), reference(), hasReference(false), referenceFrom(0), referenceSettings(),
+      differences(), firstDifference(), unusedDifferences(),
+      matchCache(), generation(0), blockGeneration(0), lastAdded(), statistics()
+    {}
+  };
+
+  /// optimize a single block, either update m_best or (if candidates isn't NULL) return all possible block ends without touching m_best
+  BitStream optimizeBlock(Scratch& scratch, unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal,
+                          OptimizationSettings optimize, std::vector<Candidate>* candidates);
+  /// same as before, but Dictionary is either ArrayDictionary or HashDictionary
+  template <typename Dictionary>
+  BitStream optimizeBlock(Scratch& scratch, Dictionary& dictionary, unsigned int from, unsigned int maxLength, bool emitBitStream, bool isFinal,
+                          OptimizationSettings optimize, std::vector<Candidate>* candidates);
+  /// estimation only: state of a block right after a new match was found
+  struct MatchState
+  {
+    /// first byte of the block
+    unsigned int  from;
+    /// first byte of the match
+    unsigned int  pos;
+    /// number of bytes of the match
+    unsigned int  length;
+    /// number of bits of all codes so far (including the match)
+    unsigned int  numBits;
+    /// number of codes so far (including the match)
+    unsigned int  numTokens;
+    /// number of non-greedy matches so far
+    unsigned int  numNonGreedy;
+    /// number of dictionary entries
+    unsigned int  dictSize;
+    /// bits per code
+    unsigned char codeSize;
+  };
+  /// estimation only: same as the second half of optimizeBlock()'s main loop for all bytes of a single match
+  template <bool IsGif, bool IsAligned>
+  void      estimateMatch(const MatchState& state, unsigned int alignment, std::vector<Candidate>* candidates);
+  /// update m_best based on candidates found by optimizeBlock()
+  void      applyCandidates(unsigned int from, const std::vector<Candidate>& candidates, OptimizationSettings optimize);
+  /// same condition as the first lines in optimizeBlock(): true if greedy search can be skipped because non-greedy search didn't find anything
+  bool      skipGreedyAgain(unsigned int from, const OptimizationSettings& optimize) const;
+
+  /// incremental estimation: hash of the first two bytes (if length = 2) or the first three bytes (if length > 2) of m_data[pos...pos+length)
+  unsigned int getBucket        (unsigned int pos, unsigned int length) const;
+  /// incremental estimation: remove all entries of scratch.differences
+  void         clearDifferences (Scratch& scratch) const;
+  /// incremental estimation: string m_data[pos...pos+length) was added to one dictionary, update scratch.differences
+  void         toggleDifference (Scratch& scratch, unsigned int pos, unsigned int length, bool onlyCurrent) const;
+  /// incremental estimation: longest match at m_data[pos] if the reference dictionary's longest match has referenceLength bytes
+  unsigned int mirrorMatch      (const Scratch& scratch, unsigned int pos, unsigned int referenceLength) const;
+
+  /// add string at m_data[from...from+length] to the dictionary and return its code, the code of m_data[from...from+length) may be already known (-1 => unknown)
+  template <typename Dictionary>
+  int          addCode  (Dictionary& dictionary, unsigned int& dictSize, unsigned int from, unsigned int length, int code = -1) const;
+  /// return length of longest match, beginning at m_data[from], limited to maxLength, ignore all codes >= numCodes, optionally store the match's code
+  template <typename Dictionary>
+  unsigned int findMatch(const Dictionary& dictionary, unsigned int from, unsigned int maxLength, unsigned int numCodes = ~0U, int* matchCode = NULL) const;
+  /// same as findMatch() but look up scratch.matchCache first (if enabled)
+  template <typename Dictionary>
+  unsigned int findCachedMatch(Scratch& scratch, const Dictionary& dictionary, unsigned int from, unsigned int maxLength) const;
 
-  /// add bits to BitStream
-  static void          add(BitStream& stream, unsigned int token, unsigned char numBits);
   /// get minimum number of bits to represent token
   static unsigned char getMinBits(unsigned int token);
 
   // ----- debugging code -----
-  RawData debugDecode(int code) const;
-  int     findCode   (unsigned int from, unsigned int maxLength) const;
+  template <typename Dictionary>
+  RawData debugDecode(const Dictionary& dictionary, int code) const;
+  template <typename Dictionary>
+  int     findCode   (const Dictionary& dictionary, unsigned int from, unsigned int maxLength) const;
 
-  /// uncompressed data
-  RawData m_data;
+  /// uncompressed data (borrowed from the caller)
+  const unsigned char* m_data;
+  /// number of bytes of uncompressed data
+  unsigned int  m_size;
 
   // ----- temporary data structures -----
-  /// gather statistics of a single compressed block of data
-  struct BestBlock
+  /// best block for each aligned block start: m_best.length[x] bytes starting at input byte x (times alignment) are the optimum block regarding all following blocks,
+  /// stored as separate arrays to save memory (13 bytes per block start)
+  struct BestBlocks
   {
-    /// current block: number of bytes (uncompressed input)
-    unsigned int length;
-    /// current block: number of bits of compressed output
-    unsigned int bits;
-    /// this plus all following blocks: total number of bits
-    unsigned long long totalBits;
-    /// current block: number of LZW codes
-    unsigned int tokens;
-    /// number of non-greedy matches
-    unsigned int nongreedy;
-    /// true if block's last match isn't greedy
-    bool         partial;
+    /// bits for flags
+    enum Flags
+    {
+      /// block's last match isn't greedy
+      IsPartial    = 1,
+      /// block contains at least one non-greedy match
+      HasNonGreedy = 2
+    };
 
-    BestBlock()
-    : length(0), bits(0), totalBits(0),
-      tokens(0), nongreedy(0), partial(false)
-    {}
+    /// this plus all following blocks: total number of bits, zero if unknown
+    std::vector<unsigned long long> totalBits;
+    /// number of bytes (uncompressed input)
+    std::vector<unsigned int>       length;
+    /// combination of Flags
+    std::vector<unsigned char>      flags;
+
+    /// true if not allocated yet
+    bool empty() const
+    {
+      return totalBits.empty();
+    }
+    /// discard all entries, but keep the memory
+    void clear()
+    {
+      totalBits.clear();
+      length   .clear();
+      flags    .clear();
+    }
+    /// allocate entries, all unknown
+    void resize(size_t size)
+    {
+      totalBits.resize(size, 0);
+      length   .resize(size, 0);
+      flags    .resize(size, 0);
+    }
+    /// replace entry if it's unknown or not better than a new block (longer blocks are preferred if the cost is the same), return true if replaced
+    bool update(size_t index, unsigned long long newTotalBits, unsigned int newLength, bool hasNonGreedy, bool isPartial)
+    {
+      if (totalBits[index] != 0 && totalBits[index] < newTotalBits)
+        return false;
+
+      totalBits[index] = newTotalBits;
+      length   [index] = newLength;
+      flags    [index] = (hasNonGreedy ? HasNonGreedy : 0) | (isPartial ? IsPartial : 0);
+      return true;
+    }
   };
-  /// all block of compressed data where m_best[x] is the optimum block (regarding all following blocks) which starts at input byte x
-  std::vector<BestBlock> m_best;
-
-  /// for each LZW code store the LZW codes of its children (which is the same as its parent plus one byte, -1 => undefined/no child)
-  typedef std::vector<std::array<int, 256> > Dictionary;
-  Dictionary    m_dictionary;
-  /// number of valid entries in m_dictionary
-  unsigned int  m_dictSize;
+  BestBlocks m_best;
+
+  /// dictionaries, first entry is used by the current thread, all others by background threads
+  std::vector<Scratch> m_scratch;
+  /// profiling counters which don't belong to a thread (m_best is never updated by several threads at the same time)
+  Statistics    m_statistics;
   /// maximum number of codes in the dictionary
   unsigned int  m_maxDictionary;
   /// GIF = 12, LZW = 16
@@ -118,4 +364,6 @@ private:
 
   /// true, if encode as GIF
   bool          m_isGif;
+  /// false if more data follows after m_data (.Z segments), then the last block is followed by a clear code, too
+  bool          m_isFinal;
 };
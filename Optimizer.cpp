@@ -0,0 +1,1227 @@
+// //////////////////////////////////////////////////////////
+// Optimizer.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "Optimizer.h"
+#include "GifImage.h"
+#include "Compress.h"
+#include "ResultCache.h"
+
+#include <iostream>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+
+// local stuff
+namespace
+{
+  /// number of pixels of a frame (even if it isn't decoded yet)
+  unsigned int getNumPixels(const GifImage::Frame& frame)
+  {
+    return frame.width * frame.height;
+  }
+
+  /// heuristic of --early-out: decide whether a frame (or .Z file) most likely can't beat its original LZW data
+  struct EarlyOut
+  {
+    /// original number of bits, zero => never give up
+    unsigned long long originalBits;
+    /// number of pixels/bytes
+    unsigned int       size;
+    /// bits per pixel are measured between the current position and this (earlier processed) position
+    unsigned int       reference;
+
+    /// small frames are too noisy (and fast anyway)
+    enum { MinSize = 8192 };
+
+    EarlyOut(unsigned long long originalBits_, unsigned int size_)
+    : originalBits(size_ >= MinSize ? originalBits_ : 0), size(size_), reference(size_)
+    {}
+
+    /// call after each step of the backward sweep (all block starts in [pos, size) were estimated), true => give up
+    bool check(const LzwEncoder& encoded, unsigned int pos, unsigned int alignment)
+    {
+      if (originalBits == 0 || pos == 0)
+        return false;
+
+      // building a new dictionary dominates the first 1/16 of the sweep, start measuring afterwards
+      if (size - pos < size / 16)
+      {
+        reference = pos;
+        return false;
+      }
+      if (reference - pos < size / 16)
+        return false;
+
+      unsigned long long bits          = encoded.getEstimatedBits(pos,       alignment);
+      unsigned long long referenceBits = encoded.getEstimatedBits(reference, alignment);
+      if (bits == 0 || bits < referenceBits)
+        return false;
+
+      // extrapolate the bits per pixel of [pos, reference) to the remaining pixels,
+      // the cost of a new dictionary is already included in the estimated bits of [pos, size)
+      double projected = bits + pos * double(bits - referenceBits) / (reference - pos);
+      return projected >= originalBits;
+    }
+  };
+
+  /// --auto: at most this many pixels/bytes are sampled (split among up to MaxSamples frames/slices), at least MinTokens per block
+  enum { SampleSize = 65536, MaxSamples = 4, MinTokens = 1000 };
+
+  /// --auto: relative cost of estimating all block starts of size pixels/bytes if a block covers at most maxLength pixels/bytes
+  double getWork(double size, double maxLength)
+  {
+    if (size <= maxLength)
+      return size * size / 2;
+    return maxLength * (size - maxLength / 2);
+  }
+
+  /// --verify: drop pending checks when leaving optimizeGif()/optimizeZ(), even after an exception (checks may borrow the caller's memory),
+  /// must be declared after everything a check borrows so that it waits for a running check before that memory is released
+  struct DiscardChecks
+  {
+    Verifier& verifier;
+
+    explicit DiscardChecks(Verifier& verifier_)
+    : verifier(verifier_)
+    {}
+    ~DiscardChecks()
+    {
+      verifier.discard();
+    }
+  };
+
+  /// seconds since lap, lap is set to the current time
+  double getLapTime(std::chrono::steady_clock::time_point& lap)
+  {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lap).count();
+    lap = now;
+    return seconds;
+  }
+}
+
+/// same defaults as the command-line tool
+Optimizer::Settings::Settings()
+: optimize(),
+  smartGreedy(false),
+  numThreads(1),
+  deinterlace(false),
+  crop(false),
+  remap(false),
+  predefinedBlocks(),
+  compressZ(false),
+  segmentSize(0),
+  verbose(false),
+  showProgress(false),
+  progressFd(-1),
+  timeLimit(0),
+  autoTune(0),
+  keepOriginal(false),
+  earlyOut(false),
+  verify(false),
+  cache(NULL)
+{
+  optimize.minCodeSize         = 8;
+  optimize.alignment           = Alignment;
+  optimize.verbose             = false;
+  optimize.greedy              = true;
+  optimize.minImprovement      = MinImprovement;
+  optimize.minNonGreedyMatch   = MinNonGreedy;
+  optimize.maxDictionary       = 0;
+  optimize.maxTokens           = GifMaxToken;
+  optimize.startWithClearCode  = true;
+  optimize.readOnlyBest        = false;
+  optimize.avoidNonGreedyAgain = false;
+  optimize.dictionaryLayout    = LzwEncoder::OptimizationSettings::LayoutAuto;
+  optimize.incremental         = false;
+  optimize.matchCache          = MatchCache;
+}
+
+
+/// all zero
+Optimizer::Timings::Timings()
+: parse(0),
+  tune(0),
+  decode(0),
+  estimate(0),
+  optimize(0),
+  merge(0),
+  write(0),
+  verify(0),
+  total(0)
+{
+}
+
+
+/// prepare optimizer, starts settings.numThreads - 1 background threads
+Optimizer::Optimizer(const Settings& settings)
+: m_settings(settings),
+  m_ownPool(settings.numThreads > 1 ? settings.numThreads - 1 : 0),
+  m_pool(m_ownPool),
+  m_encoders(),
+  m_decoders(),
+  m_timings(),
+  m_statistics(),
+  m_verifier(),
+  m_progress()
+{
+  if (m_settings.numThreads == 0)
+    m_settings.numThreads = 1;
+  // debug output of the encoder
+  m_settings.optimize.verbose = m_settings.verbose;
+
+  m_encoders.resize(m_settings.numThreads);
+  m_decoders.resize(m_settings.numThreads);
+}
+
+
+/// prepare optimizer, use an existing pool (which may be shared by several optimizers)
+Optimizer::Optimizer(const Settings& settings, ThreadPool& pool)
+: m_settings(settings),
+  m_ownPool(0),
+  m_pool(pool),
+  m_encoders(),
+  m_decoders(),
+  m_timings(),
+  m_statistics(),
+  m_verifier(),
+  m_progress()
+{
+  if (m_settings.numThreads == 0)
+    m_settings.numThreads = 1;
+  // debug output of the encoder
+  m_settings.optimize.verbose = m_settings.verbose;
+
+  m_encoders.resize(m_settings.numThreads);
+  m_decoders.resize(m_settings.numThreads);
+}
+
+
+/// recompress a GIF image
+Optimizer::Bytes Optimizer::optimizeGif(const unsigned char* data, size_t size)
+{
+  Bytes result;
+  optimizeGif(data, size, result);
+  return result;
+}
+
+
+/// recompress a .Z file (or compress raw data if Settings::compressZ is set)
+Optimizer::Bytes Optimizer::optimizeZ(const unsigned char* data, size_t size)
+{
+  Bytes result;
+  optimizeZ(data, size, result);
+  return result;
+}
+
+
+/// choose settings for a GIF or .Z file which meet Settings::autoTune (see --auto), they replace the current settings
+void Optimizer::autoTune(const unsigned char* data, size_t size, bool isGif)
+{
+  if (m_settings.autoTune == 0 || m_settings.timeLimit > 0 || !m_settings.predefinedBlocks.empty())
+    return;
+
+  Pass tuned;
+  if (isGif)
+  {
+    GifImage gif(data, size, false, false);
+    if (gif.getNumFrames() == 0)
+      throw "no frames found";
+    prepareFrames(gif);
+    tuned = tuneFrames(gif, m_settings.optimize);
+  }
+  else
+  {
+    Compress lzw(data, size, m_settings.compressZ, false, &m_decoders[0]);
+    tuned = tuneBytes(lzw.getData(), getSettingsZ());
+  }
+
+  m_settings.optimize    = tuned.optimize;
+  m_settings.smartGreedy = tuned.smartGreedy;
+  m_settings.autoTune    = 0;
+}
+
+
+/// current settings, see autoTune()
+const Optimizer::Settings& Optimizer::getSettings() const
+{
+  return m_settings;
+}
+
+
+/// time spent in each stage of the most recent call
+const Optimizer::Timings& Optimizer::getTimings() const
+{
+  return m_timings;
+}
+
+
+/// profiling counters of the most recent call (all frames and passes)
+const LzwEncoder::Statistics& Optimizer::getStatistics() const
+{
+  return m_statistics;
+}
+
+
+/// recompress a GIF image and append it to output
+void Optimizer::optimizeGif(const unsigned char* data, size_t size, Bytes& output)
+{
+  Clock::time_point startTime = Clock::now();
+  Clock::time_point lap       = startTime;
+  m_timings    = Timings();
+  m_statistics = LzwEncoder::Statistics();
+
+  const bool         verbose    = m_settings.verbose;
+  bool               smartGreedy = m_settings.smartGreedy;
+  LzwEncoder::OptimizationSettings optimize = m_settings.optimize;
+  std::vector<unsigned int> predefinedBlocks = m_settings.predefinedBlocks;
+
+  // load GIF, frames are decoded on demand (and released as soon as they are optimized)
+  GifImage gif(data, size, verbose, false);
+  // declared after gif, so that it's destroyed first (must not outlive anything a check borrows)
+  DiscardChecks discardChecks(m_verifier);
+
+  // error during decoding ?
+  if (gif.getNumFrames() == 0)
+    throw "no frames found";
+
+  // de-interlace, crop and remap frames
+  prepareFrames(gif);
+
+  if (gif.getNumFrames() > 1 && !predefinedBlocks.empty())
+    throw "user-defined block boundaries are not allowed for animated GIFs";
+
+  m_timings.parse += getLapTime(lap);
+
+  // --auto: choose settings for this image
+  if (m_settings.autoTune > 0 && m_settings.timeLimit == 0 && predefinedBlocks.empty())
+  {
+    Pass tuned  = tuneFrames(gif, optimize);
+    optimize    = tuned.optimize;
+    smartGreedy = tuned.smartGreedy;
+    m_timings.tune += getLapTime(lap);
+  }
+
+  // -------------------- generate output --------------------
+
+  if (verbose)
+    std::cout << std::endl << "===== compression in progress ... =====" << std::endl;
+
+  // optimize all frames
+  unsigned int numFrames = gif.getNumFrames();
+  std::vector<BitStream> optimizedFrames(numFrames);
+
+  // no search => no need for several passes
+  if (m_settings.timeLimit == 0 || !predefinedBlocks.empty())
+  {
+    Pass pass = { optimize, smartGreedy };
+    optimizeFrames(gif, pass, NULL, optimizedFrames);
+
+    // all frames must be correct
+    lap = Clock::now();
+    if (m_settings.verify)
+      m_verifier.finish();
+    m_timings.verify += getLapTime(lap);
+
+    // serialize
+    size_t before = output.size();
+    gif.writeOptimized(output, optimizedFrames, optimize.minCodeSize);
+    // remapped frames can't fall back to their original LZW data: keep the whole file if it didn't shrink (unless it has to be deinterlaced)
+    if (m_settings.keepOriginal && !m_settings.deinterlace && predefinedBlocks.empty() && output.size() - before >= size)
+    {
+      output.resize(before);
+      output.insert(output.end(), data, data + size);
+    }
+    m_timings.write += getLapTime(lap);
+    m_timings.total  = getLapTime(startTime);
+    return;
+  }
+
+  // the first pass always finishes, the following passes are aborted when the time is up
+  Clock::time_point deadline = startTime + std::chrono::milliseconds(m_settings.timeLimit);
+  std::vector<Pass> passes = getPasses(optimize);
+  Bytes best;
+  for (size_t i = 0; i < passes.size(); i++)
+  {
+    if (i > 0 && Clock::now() >= deadline)
+      break;
+    if (!optimizeFrames(gif, passes[i], i == 0 ? NULL : &deadline, optimizedFrames))
+      break;
+
+    Bytes current;
+    lap = Clock::now();
+    gif.writeOptimized(current, optimizedFrames, optimize.minCodeSize);
+    m_timings.write += getLapTime(lap);
+    if (verbose)
+      std::cout << "pass " << i+1 << "/" << passes.size() << ": " << current.size() << " bytes" << std::endl;
+
+    // keep the smallest output
+    if (best.empty() || current.size() < best.size())
+      best.swap(current);
+  }
+
+  // all frames of all passes must be correct
+  lap = Clock::now();
+  if (m_settings.verify)
+    m_verifier.finish();
+  m_timings.verify += getLapTime(lap);
+
+  // remapped frames can't fall back to their original LZW data: keep the whole file if it didn't shrink (unless it has to be deinterlaced)
+  if (m_settings.keepOriginal && !m_settings.deinterlace && best.size() >= size)
+    output.insert(output.end(), data, data + size);
+  else
+    output.insert(output.end(), best.begin(), best.end());
+  m_timings.total = getLapTime(startTime);
+}
+
+
+/// optimize all frames of a GIF, return false if the deadline (may be NULL) was hit before
+bool Optimizer::optimizeFrames(GifImage& gif, const Pass& pass, const Clock::time_point* deadline, std::vector<BitStream>& optimizedFrames)
+{
+  const unsigned int numThreads = m_settings.numThreads;
+  const bool         smartGreedy = pass.smartGreedy;
+  const LzwEncoder::OptimizationSettings& optimize = pass.optimize;
+  std::vector<unsigned int> predefinedBlocks = m_settings.predefinedBlocks;
+
+  unsigned int numFrames = gif.getNumFrames();
+
+  // animations: several frames are optimized in parallel, largest frames first (to avoid idle threads at the end)
+  bool parallelFrames = (numThreads > 1 && numFrames > 1);
+  std::vector<unsigned int> order(numFrames);
+  unsigned long long totalPixels = 0;
+  for (unsigned int frame = 0; frame < numFrames; frame++)
+  {
+    order[frame] = frame;
+    totalPixels += getNumPixels(gif.getFrame(frame));
+  }
+  if (parallelFrames)
+    std::stable_sort(order.begin(), order.end(), [&gif](unsigned int a, unsigned int b)
+                     { return getNumPixels(gif.getFrame(a)) > getNumPixels(gif.getFrame(b)); });
+
+  // progress of all frames is shown by a background thread
+  m_progress.start("frames", totalPixels, numFrames, m_settings.showProgress, m_settings.progressFd);
+
+  // frames are optimized in parallel: sum up their times (protected by mutex)
+  std::mutex mutex;
+  auto addTimings = [this](const Timings& timings, const LzwEncoder& encoded)
+  {
+    m_timings.decode   += timings.decode;
+    m_timings.estimate += timings.estimate;
+    m_timings.optimize += timings.optimize;
+    m_timings.merge    += timings.merge;
+    m_statistics       += encoded.getStatistics();
+  };
+
+  std::atomic<unsigned int> nextFrame(0);
+  std::atomic<bool>         timeout(false);
+  m_pool.run([&](unsigned int slot)
+  {
+    while (true)
+    {
+      unsigned int next = nextFrame++;
+      if (next >= numFrames || timeout)
+        break;
+      unsigned int frame = order[next];
+
+      // time spent in each stage of the current frame
+      Timings timings;
+      Clock::time_point lap = Clock::now();
+
+      // get original pixels, the encoder only borrows them => release the decoded frame when finished
+      gif.decodeFrame(frame, &m_decoders[slot]);
+      const GifImage::Frame& current = gif.getFrame(frame);
+      LzwEncoder& encoded = m_encoders[slot];
+      encoded.reset(current.pixels, true);
+      const unsigned int numPixels = (unsigned int)current.pixels.size();
+      LzwEncoder::OptimizationSettings settings = optimize;
+      settings.minCodeSize = current.codeSize;
+      timings.decode = getLapTime(lap);
+
+      // the original LZW data is still valid if the pixels weren't re-ordered or remapped (and the user didn't ask for certain blocks)
+      const bool canKeep = m_settings.keepOriginal && predefinedBlocks.empty() && current.isInterlaced == current.wasInterlaced && !current.isRemapped;
+      const unsigned int originalBits  = current.numLzwBits;
+      const size_t       originalBytes = current.rawLzw.size;
+      EarlyOut earlyOut(m_settings.earlyOut && canKeep ? originalBits : 0, numPixels);
+      bool gaveUp = false;
+
+      // store optimized LZW bytes
+      BitStream optimized;
+
+      // same pixels and settings as a frame seen before ? (user-defined blocks are always processed)
+      ResultCache* cache = predefinedBlocks.empty() ? m_settings.cache : NULL;
+      ResultCache::Key key = { 0, 0 };
+      bool isCached = false;
+      if (cache != NULL)
+      {
+        key      = ResultCache::getKey(current.pixels.data(), numPixels, true, settings, smartGreedy);
+        isCached = cache->lookup(key, optimized);
+      }
+
+      if (isCached)
+      {
+        // nothing to do, just replay the cached bitstream
+        m_progress.add(numPixels);
+        timings.merge = getLapTime(lap);
+      }
+      // look for optimal block boundaries
+      else if (predefinedBlocks.empty())
+      {
+        // process 8 aligned block starts per thread at once
+        const unsigned int chunk = 8 * numThreads * settings.alignment;
+
+        unsigned int pos = numPixels;
+        while (pos > 0)
+        {
+          // all block starts in [i, pos)
+          unsigned int i = (pos - 1) / chunk * chunk;
+
+          // out of time ? (other frames might have noticed it already)
+          if (timeout || (deadline != NULL && Clock::now() >= *deadline))
+          {
+            timeout = true;
+            break;
+          }
+
+          // estimate cost (in --prettygood mode: repeat estimation, this time with greedy search)
+          encoded.estimate(i, pos, settings, smartGreedy, m_pool, numThreads);
+          m_progress.add(pos - i);
+          pos = i;
+
+          // give up if the frame most likely can't beat its original LZW data
+          if (earlyOut.check(encoded, pos, settings.alignment))
+          {
+            gaveUp = true;
+            break;
+          }
+        }
+
+        // pixels skipped by the early-out heuristic
+        if (gaveUp)
+          m_progress.add(pos);
+        timings.estimate = getLapTime(lap);
+        if (timeout)
+        {
+          gif.releaseFrame(frame);
+          std::lock_guard<std::mutex> lock(mutex);
+          addTimings(timings, encoded);
+          break;
+        }
+
+        // final bitstream for current image
+        if (!gaveUp)
+        {
+          std::vector<unsigned int> restarts = encoded.findRestarts(settings);
+          timings.optimize = getLapTime(lap);
+          optimized = encoded.merge(restarts, settings);
+          if (cache != NULL)
+            cache->store(key, optimized);
+        }
+      }
+      else
+      {
+        // remove invalid block boundaries (or should it be an ERROR ?)
+        while (!predefinedBlocks.empty() && predefinedBlocks.back() > numPixels)
+          predefinedBlocks.pop_back();
+
+        // to simplify code, include start and end of file as boundaries, too
+        if (predefinedBlocks.empty() || predefinedBlocks.front() != 0)
+          predefinedBlocks.insert(predefinedBlocks.begin(), 0);
+        if (predefinedBlocks.back() != numPixels)
+          predefinedBlocks.push_back(numPixels);
+
+        // avoid certain optimizer settings that might cause incomplete images
+        settings.maxTokens     = 0;
+        settings.maxDictionary = 0;
+
+        optimized = encoded.merge(predefinedBlocks, settings);
+        m_progress.add(numPixels);
+      }
+
+      // an empty bitstream keeps the original LZW data, which is preferred if the optimized data isn't smaller
+      if (canKeep && !optimized.empty())
+      {
+        size_t numBytes = optimized.getNumBytes();
+        if (numBytes + (numBytes + 254) / 255 + 1 >= originalBytes) // plus GIF's block lengths
+          optimized = BitStream();
+      }
+      timings.merge = getLapTime(lap);
+
+      // --verify: decode the new LZW data on a background thread while the next frame is optimized
+      if (m_settings.verify && !optimized.empty())
+        m_verifier.add(optimized, current.pixels.data(), numPixels, true, true, settings.minCodeSize, 12);
+      gif.releaseFrame(frame);
+
+      optimizedFrames[frame].swap(optimized);
+
+      m_progress.finishPart();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      addTimings(timings, encoded);
+    }
+  }, parallelFrames ? numThreads : 1);
+
+  m_progress.stop(!timeout);
+
+  return !timeout;
+}
+
+
+/// recompress a .Z file (or compress raw data if Settings::compressZ is set) and append it to output
+void Optimizer::optimizeZ(const unsigned char* data, size_t size, Bytes& output)
+{
+  Clock::time_point startTime = Clock::now();
+  Clock::time_point lap       = startTime;
+  m_timings    = Timings();
+  m_statistics = LzwEncoder::Statistics();
+
+  const bool         verbose    = m_settings.verbose;
+  LzwEncoder::OptimizationSettings optimize = getSettingsZ();
+  bool smartGreedy = false; // isn't supported for .Z files (unless chosen by --auto)
+
+  if (!m_settings.predefinedBlocks.empty())
+    throw "predefined blocks not implemented yet for .Z files";
+
+  Compress lzw(data, size, m_settings.compressZ, verbose, &m_decoders[0]);
+  // checks borrow lzw's bytes: declared after lzw, so that it's destroyed first (must not outlive anything a check borrows)
+  DiscardChecks discardChecks(m_verifier);
+
+  // get LZW bytes
+  const std::vector<unsigned char>& bytes = lzw.getData();
+  m_timings.decode += getLapTime(lap);
+
+  // --auto: choose settings for this file
+  if (m_settings.autoTune > 0 && m_settings.timeLimit == 0)
+  {
+    Pass tuned  = tuneBytes(bytes, optimize);
+    optimize    = tuned.optimize;
+    smartGreedy = tuned.smartGreedy;
+    m_timings.tune += getLapTime(lap);
+  }
+
+  if (verbose)
+    std::cout << std::endl << "===== compression in progress ... =====" << std::endl;
+
+  // the original file is preferred if the optimized file isn't smaller (three bytes header, followed by LZW data)
+  const bool canKeep = m_settings.keepOriginal && !m_settings.compressZ && size > 3;
+  const unsigned long long originalBits = canKeep ? 8 * (unsigned long long)(size - 3) : 0;
+
+  // serialize, an empty bitstream means "keep the original"
+  auto write = [&](const BitStream& bits, Bytes& current)
+  {
+    // --verify: decode the new LZW data on a background thread (while the next pass is running)
+    if (m_settings.verify && !bits.empty())
+      m_verifier.add(bits, bytes.data(), bytes.size(), false, false, 8, lzw.getMaxCodeSize());
+
+    if (!bits.empty())
+      lzw.writeOptimized(current, bits);
+    if (canKeep && (bits.empty() || current.size() >= size))
+      current.assign(data, data + size);
+  };
+
+  BitStream optimized;
+  if (m_settings.timeLimit == 0)
+  {
+    Pass pass = { optimize, smartGreedy };
+    optimizeBytes(bytes, pass, NULL, originalBits, optimized);
+
+    // serialize
+    lap = Clock::now();
+    Bytes current;
+    write(optimized, current);
+    m_timings.write += getLapTime(lap);
+
+    // result must be correct
+    if (m_settings.verify)
+      m_verifier.finish();
+    m_timings.verify += getLapTime(lap);
+
+    output.insert(output.end(), current.begin(), current.end());
+    m_timings.total  = getLapTime(startTime);
+    return;
+  }
+
+  // the first pass always finishes, the following passes are aborted when the time is up
+  Clock::time_point deadline = startTime + std::chrono::milliseconds(m_settings.timeLimit);
+  std::vector<Pass> passes = getPasses(optimize);
+  Bytes best;
+  for (size_t i = 0; i < passes.size(); i++)
+  {
+    if (i > 0 && Clock::now() >= deadline)
+      break;
+    if (!optimizeBytes(bytes, passes[i], i == 0 ? NULL : &deadline, originalBits, optimized))
+      break;
+
+    Bytes current;
+    lap = Clock::now();
+    write(optimized, current);
+    m_timings.write += getLapTime(lap);
+    if (verbose)
+      std::cout << "pass " << i+1 << "/" << passes.size() << ": " << current.size() << " bytes" << std::endl;
+
+    // keep the smallest output
+    if (best.empty() || current.size() < best.size())
+      best.swap(current);
+  }
+
+  // all passes must be correct
+  lap = Clock::now();
+  if (m_settings.verify)
+    m_verifier.finish();
+  m_timings.verify += getLapTime(lap);
+
+  output.insert(output.end(), best.begin(), best.end());
+  m_timings.total = getLapTime(startTime);
+}
+
+
+/// optimize .Z contents, return false if the deadline (may be NULL) was hit before,
+/// optimized is empty if the early-out heuristic decided that originalBits (0 => unknown) can't be beaten
+bool Optimizer::optimizeBytes(const LzwEncoder::RawData& bytes, const Pass& pass, const Clock::time_point* deadline, unsigned long long originalBits,
+                              BitStream& optimized)
+{
+  const unsigned int numThreads = m_settings.numThreads;
+  const LzwEncoder::OptimizationSettings& optimize = pass.optimize;
+
+  // huge inputs: optimize several segments in parallel
+  bool isSegmented = (m_settings.segmentSize > 0 && bytes.size() > m_settings.segmentSize);
+
+  // same contents and settings as a file seen before ?
+  ResultCache* cache = m_settings.cache;
+  ResultCache::Key key = { 0, 0 };
+  if (cache != NULL)
+  {
+    key = ResultCache::getKey(bytes.data(), bytes.size(), false, optimize, pass.smartGreedy, isSegmented ? m_settings.segmentSize : 0);
+    if (cache->lookup(key, optimized))
+      return true;
+  }
+
+  if (isSegmented)
+  {
+    if (!optimizeSegments(bytes, pass, deadline, optimized))
+      return false;
+    if (cache != NULL)
+      cache->store(key, optimized);
+    return true;
+  }
+
+  Clock::time_point lap = Clock::now();
+  LzwEncoder& encoded = m_encoders.front();
+  encoded.reset(bytes, false);
+  m_timings.decode += getLapTime(lap);
+
+  // look for optimal block boundaries, process 8 aligned block starts per thread at once
+  const unsigned int chunk = 8 * numThreads * optimize.alignment;
+
+  EarlyOut earlyOut(m_settings.earlyOut ? originalBits : 0, (unsigned int)bytes.size());
+
+  // progress is shown by a background thread
+  m_progress.start("bytes", bytes.size(), 1, m_settings.showProgress, m_settings.progressFd);
+
+  unsigned int pos = (unsigned int)bytes.size();
+  while (pos > 0)
+  {
+    // all block starts in [i, pos)
+    unsigned int i = (pos - 1) / chunk * chunk;
+
+    // out of time ?
+    if (deadline != NULL && Clock::now() >= *deadline)
+    {
+      m_progress.stop(false);
+      m_timings.estimate += getLapTime(lap);
+      m_statistics += encoded.getStatistics();
+      return false;
+    }
+
+    // estimate cost
+    encoded.estimate(i, pos, optimize, pass.smartGreedy, m_pool, numThreads);
+    m_progress.add(pos - i);
+    pos = i;
+
+    // give up if the original most likely can't be beaten
+    if (earlyOut.check(encoded, pos, optimize.alignment))
+    {
+      m_progress.stop(false);
+      m_timings.estimate += getLapTime(lap);
+      m_statistics += encoded.getStatistics();
+      optimized = BitStream();
+      return true;
+    }
+  }
+
+  m_progress.stop(true);
+  m_timings.estimate += getLapTime(lap);
+
+  std::vector<unsigned int> restarts = encoded.findRestarts(optimize);
+  m_timings.optimize += getLapTime(lap);
+  optimized = encoded.merge(restarts, optimize);
+  m_timings.merge += getLapTime(lap);
+  m_statistics += encoded.getStatistics();
+  if (cache != NULL)
+    cache->store(key, optimized);
+  return true;
+}
+
+
+/// optimize .Z contents in independent segments (see Settings::segmentSize), return false if the deadline (may be NULL) was hit before
+bool Optimizer::optimizeSegments(const LzwEncoder::RawData& bytes, const Pass& pass, const Clock::time_point* deadline, BitStream& optimized)
+{
+  const bool         verbose    = m_settings.verbose;
+  const unsigned int numThreads = m_settings.numThreads;
+  const unsigned int alignment  = pass.optimize.alignment;
+  const unsigned int size       = (unsigned int)bytes.size();
+
+  // segment boundaries are aligned, too, and the last segment shouldn't be tiny
+  unsigned int segmentSize = (m_settings.segmentSize + alignment - 1) / alignment * alignment;
+  std::vector<unsigned int> bounds;
+  for (unsigned int pos = 0; pos < size; pos += segmentSize)
+    bounds.push_back(pos);
+  if (bounds.size() > 1 && size - bounds.back() < segmentSize / 2)
+    bounds.pop_back();
+  bounds.push_back(size);
+
+  // segment i covers [bounds[i], bounds[i + 1])
+  unsigned int numSegments = (unsigned int)bounds.size() - 1;
+  std::vector<BitStream> segments(numSegments);
+
+  if (verbose)
+    std::cout << "split " << size << " bytes into " << numSegments << " segments of about " << segmentSize << " bytes" << std::endl;
+
+  // segments are optimized in parallel: sum up their times (protected by mutex)
+  std::mutex mutex;
+  auto addTimings = [this](const Timings& timings, const LzwEncoder& encoded)
+  {
+    m_timings.decode   += timings.decode;
+    m_timings.estimate += timings.estimate;
+    m_timings.optimize += timings.optimize;
+    m_timings.merge    += timings.merge;
+    m_statistics       += encoded.getStatistics();
+  };
+
+  // progress is shown by a background thread, optimizeSegment() reports each chunk of bytes
+  m_progress.start("segments", size, numSegments, m_settings.showProgress, m_settings.progressFd);
+
+  std::atomic<unsigned int> nextSegment(0);
+  std::atomic<bool>         timeout(false);
+  m_pool.run([&](unsigned int slot)
+  {
+    while (true)
+    {
+      unsigned int segment = nextSegment++;
+      if (segment >= numSegments || timeout)
+        break;
+
+      LzwEncoder& encoded = m_encoders[slot];
+      Timings timings;
+      bool finished = optimizeSegment(encoded, bytes.data() + bounds[segment], bounds[segment + 1] - bounds[segment],
+                                      segment + 1 == numSegments, pass, deadline, 1, timings, segments[segment]);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      addTimings(timings, encoded);
+      if (!finished)
+      {
+        timeout = true;
+        break;
+      }
+
+      m_progress.finishPart();
+    }
+  }, numThreads);
+
+  m_progress.stop(!timeout);
+  if (timeout)
+    return false;
+
+  // no path through a segment if -t and -a leave a gap between two blocks (a clear code is possible at every code size):
+  // then join it with the next segment (the last segment never fails)
+  for (unsigned int segment = 0; segment < segments.size(); )
+  {
+    if (!segments[segment].empty())
+    {
+      segment++;
+      continue;
+    }
+
+    bounds.erase(bounds.begin() + segment + 1);
+    segments.erase(segments.begin() + segment + 1);
+    if (verbose)
+      std::cout << "join segment @ " << bounds[segment] << " with the next segment" << std::endl;
+
+    LzwEncoder& encoded = m_encoders.front();
+    Timings timings;
+    bool finished = optimizeSegment(encoded, bytes.data() + bounds[segment], bounds[segment + 1] - bounds[segment],
+                                    segment + 1 == segments.size(), pass, deadline, numThreads, timings, segments[segment]);
+    addTimings(timings, encoded);
+    if (!finished)
+      return false;
+  }
+
+  // stitch all segments together, each of them (except for the last) ends with a clear code and its padding
+  Clock::time_point lap = Clock::now();
+  optimized = BitStream();
+  for (size_t i = 0; i < segments.size(); i++)
+    optimized.append(segments[i]);
+  m_timings.merge += getLapTime(lap);
+
+  return true;
+}
+
+
+/// optimize a single segment, if isFinal is false then it ends with a clear code (optimized stays empty if that's impossible),
+/// return false if the deadline (may be NULL) was hit before
+bool Optimizer::optimizeSegment(LzwEncoder& encoded, const unsigned char* data, unsigned int size, bool isFinal, const Pass& pass,
+                                const Clock::time_point* deadline, unsigned int numThreads, Timings& timings, BitStream& optimized)
+{
+  const LzwEncoder::OptimizationSettings& optimize = pass.optimize;
+
+  Clock::time_point lap = Clock::now();
+  encoded.reset(data, size, false, isFinal);
+  optimized = BitStream();
+  timings.decode += getLapTime(lap);
+
+  // same as optimizeBytes(), just without early-out (progress is reported to the current task of optimizeSegments)
+  const unsigned int chunk = 8 * numThreads * optimize.alignment;
+  unsigned int pos = size;
+  while (pos > 0)
+  {
+    // all block starts in [i, pos)
+    unsigned int i = (pos - 1) / chunk * chunk;
+
+    // out of time ?
+    if (deadline != NULL && Clock::now() >= *deadline)
+    {
+      timings.estimate += getLapTime(lap);
+      return false;
+    }
+
+    encoded.estimate(i, pos, optimize, pass.smartGreedy, m_pool, numThreads);
+    m_progress.add(pos - i);
+    pos = i;
+  }
+  timings.estimate += getLapTime(lap);
+
+  // no sequence of blocks covers this segment (gap between two blocks), optimizeSegments() joins it with the next one
+  if (!isFinal && !encoded.hasPath())
+    return true;
+
+  std::vector<unsigned int> restarts = encoded.findRestarts(optimize);
+  timings.optimize += getLapTime(lap);
+  optimized = encoded.merge(restarts, optimize);
+  timings.merge += getLapTime(lap);
+  return true;
+}
+
+
+/// cheapest pass first, the last pass is what the user asked for
+std::vector<Optimizer::Pass> Optimizer::getPasses(const LzwEncoder::OptimizationSettings& optimize) const
+{
+  std::vector<Pass> result;
+
+  // greedy search, every pass checks four times as many block starts as the previous one
+  Pass greedy = { optimize, false };
+  greedy.optimize.greedy = true;
+  for (unsigned int alignment = LadderAlignment; alignment > optimize.alignment; alignment /= 4)
+  {
+    greedy.optimize.alignment = alignment;
+    result.push_back(greedy);
+  }
+  greedy.optimize.alignment = optimize.alignment;
+  result.push_back(greedy);
+
+  // and finally non-greedy search: either the user's settings or the same as --prettygood
+  Pass nonGreedy = { optimize, m_settings.smartGreedy };
+  if (optimize.greedy)
+  {
+    nonGreedy.optimize.greedy              = false;
+    nonGreedy.optimize.avoidNonGreedyAgain = true;
+    nonGreedy.smartGreedy                  = true;
+  }
+  result.push_back(nonGreedy);
+
+  return result;
+}
+
+
+/// de-interlace, crop and remap frames (according to the settings)
+void Optimizer::prepareFrames(GifImage& gif) const
+{
+  // de-interlace all frames
+  if (m_settings.deinterlace)
+    gif.setInterlacing(false);
+
+  // remove unchanged pixels of animations (frames fall back to their original data if that's smaller, see keepOriginal)
+  if (m_settings.crop)
+    gif.cropFrames();
+  // smaller color maps and code sizes (remapped frames always get new LZW data)
+  if (m_settings.remap)
+    gif.remapColors();
+}
+
+
+/// the optimizer settings adjusted for .Z files
+LzwEncoder::OptimizationSettings Optimizer::getSettingsZ() const
+{
+  LzwEncoder::OptimizationSettings optimize = m_settings.optimize;
+
+  // increase token limit
+  if (optimize.maxTokens == GifMaxToken)
+    optimize.maxTokens = LzwMaxToken;
+
+  // disable GIF-only optimizations
+  optimize.startWithClearCode = false;
+
+  // always the full ASCII alphabet
+  optimize.minCodeSize = 8;
+  // dictionary limit is 2^16 instead of 2^12
+  if (optimize.maxDictionary == GifMaxDictionary || optimize.maxDictionary == GifMaxDictionaryCompatible)
+    optimize.maxDictionary = LzwMaxDictionary; // 0 is an option, too, ... it disables the limit check
+
+  return optimize;
+}
+
+
+/// --auto: take samples of the largest frames and call tune()
+Optimizer::Pass Optimizer::tuneFrames(GifImage& gif, const LzwEncoder::OptimizationSettings& optimize)
+{
+  unsigned int numFrames = gif.getNumFrames();
+
+  // largest frames first
+  std::vector<unsigned int> order(numFrames);
+  std::vector<unsigned int> sizes(numFrames);
+  for (unsigned int frame = 0; frame < numFrames; frame++)
+  {
+    order[frame] = frame;
+    sizes[frame] = getNumPixels(gif.getFrame(frame));
+  }
+  std::stable_sort(order.begin(), order.end(), [&sizes](unsigned int a, unsigned int b) { return sizes[a] > sizes[b]; });
+
+  // the middle part of each sampled frame
+  unsigned int numSamples = std::min(numFrames, (unsigned int)MaxSamples);
+  std::vector<Sample> samples;
+  for (unsigned int i = 0; i < numSamples; i++)
+  {
+    unsigned int frame = order[i];
+    gif.decodeFrame(frame, &m_decoders[0]);
+    const GifImage::Frame& current = gif.getFrame(frame);
+
+    unsigned int numPixels = (unsigned int)current.pixels.size();
+    unsigned int length    = std::min(numPixels, (unsigned int)SampleSize / numSamples);
+    if (length > 0)
+    {
+      Sample sample;
+      unsigned int from = (numPixels - length) / 2;
+      sample.data.assign(current.pixels.begin() + from, current.pixels.begin() + from + length);
+      sample.codeSize = current.codeSize;
+      samples.push_back(sample);
+    }
+
+    gif.releaseFrame(frame);
+  }
+
+  return tune(samples, sizes, true, optimize);
+}
+
+
+/// --auto: take samples of .Z contents and call tune()
+Optimizer::Pass Optimizer::tuneBytes(const LzwEncoder::RawData& bytes, const LzwEncoder::OptimizationSettings& optimize)
+{
+  const unsigned int size = (unsigned int)bytes.size();
+
+  // segments are optimized independently
+  std::vector<unsigned int> sizes;
+  unsigned int segmentSize = m_settings.segmentSize > 0 ? m_settings.segmentSize : size;
+  for (unsigned int pos = 0; pos < size; pos += segmentSize)
+    sizes.push_back(std::min(segmentSize, size - pos));
+
+  // evenly spaced slices
+  unsigned int numSamples = size <= SampleSize ? 1 : MaxSamples;
+  unsigned int length     = std::min(size, (unsigned int)SampleSize / numSamples);
+  std::vector<Sample> samples;
+  for (unsigned int i = 0; i < numSamples && length > 0; i++)
+  {
+    Sample sample;
+    unsigned int from = (unsigned int)((size - length) * (2ULL * i + 1) / (2 * numSamples));
+    sample.data.assign(bytes.begin() + from, bytes.begin() + from + length);
+    sample.codeSize = 8;
+    samples.push_back(sample);
+  }
+
+  return tune(samples, sizes, false, optimize);
+}
+
+
+/// --auto: time the passes of getPasses() on a few samples and return the most thorough pass which meets Settings::autoTune
+Optimizer::Pass Optimizer::tune(const std::vector<Sample>& samples, const std::vector<unsigned int>& sizes, bool isGif,
+                                const LzwEncoder::OptimizationSettings& optimize)
+{
+  const bool         verbose    = m_settings.verbose;
+  const unsigned int numThreads = m_settings.numThreads;
+
+  // same candidates as the time-limited mode, but non-greedy search first tries a larger minimum match length (fewer probes)
+  std::vector<Pass> passes = getPasses(optimize);
+  Pass nonGreedy = passes.back();
+  passes.pop_back();
+  for (unsigned int minMatch = 8; minMatch > nonGreedy.optimize.minNonGreedyMatch; minMatch /= 2)
+  {
+    Pass cheaper = nonGreedy;
+    cheaper.optimize.minNonGreedyMatch = minMatch;
+    passes.push_back(cheaper);
+  }
+  passes.push_back(nonGreedy);
+
+  // time budget of all blocks
+  unsigned long long totalSize = 0;
+  for (unsigned int size : sizes)
+    totalSize += size;
+  const double budget = totalSize / (m_settings.autoTune * 1000.0);
+
+  // the first run measures the average match length: maxTokens => longest block
+  double bytesPerToken = 0;
+  auto getMaxLength = [&bytesPerToken](const Pass& pass)
+  {
+    return pass.optimize.maxTokens > 0 ? pass.optimize.maxTokens * bytesPerToken : 1e18;
+  };
+
+  // estimate all samples, return false if the extrapolated time exceeds the budget (aborts as soon as that's clear)
+  auto run = [&](const Pass& pass, unsigned long long& bits, double& extrapolated) -> bool
+  {
+    if (verbose)
+    {
+      std::cout << "auto-tune: " << (pass.optimize.greedy ? "greedy" : "non-greedy")
+                << " -a=" << pass.optimize.alignment << " -t=" << pass.optimize.maxTokens;
+      if (!pass.optimize.greedy)
+        std::cout << " -n=" << pass.optimize.minNonGreedyMatch;
+      std::cout << ": " << std::flush;
+    }
+
+    // the encoder estimates all block starts of a sample: its blocks are shorter than those of the whole frame/file
+    double sampleWork = 0;
+    double totalWork  = 0;
+    bool   hasLength  = bytesPerToken > 0;
+    if (hasLength)
+    {
+      for (const Sample& sample : samples)
+        sampleWork += getWork((double)sample.data.size(), getMaxLength(pass));
+      for (unsigned int size : sizes)
+        totalWork  += getWork(size, getMaxLength(pass));
+    }
+
+    // the very first run always finishes
+    Clock::time_point start    = Clock::now();
+    Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+                                   std::chrono::duration<double>(hasLength ? budget * sampleWork / totalWork : 1e9));
+
+    LzwEncoder& encoded = m_encoders[0];
+    LzwEncoder::Statistics statistics;
+    bits = 0;
+    for (const Sample& sample : samples)
+    {
+      LzwEncoder::OptimizationSettings settings = pass.optimize;
+      settings.minCodeSize = sample.codeSize;
+      settings.verbose     = false;
+      encoded.reset(sample.data, isGif);
+
+      const unsigned int chunk = 8 * numThreads * settings.alignment;
+      unsigned int pos = (unsigned int)sample.data.size();
+      while (pos > 0)
+      {
+        if (Clock::now() >= deadline)
+        {
+          if (verbose)
+            std::cout << "too slow" << std::endl;
+          return false;
+        }
+
+        unsigned int i = (pos - 1) / chunk * chunk;
+        encoded.estimate(i, pos, settings, pass.smartGreedy, m_pool, numThreads);
+        pos = i;
+      }
+
+      std::vector<unsigned int> restarts = encoded.findRestarts(settings);
+      bits += encoded.merge(restarts, settings).size();
+      statistics += encoded.getStatistics();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (!hasLength)
+    {
+      bytesPerToken = statistics.numSearches > 0 ? statistics.searchDepth / double(statistics.numSearches) : 1;
+      for (const Sample& sample : samples)
+        sampleWork += getWork((double)sample.data.size(), getMaxLength(pass));
+      for (unsigned int size : sizes)
+        totalWork  += getWork(size, getMaxLength(pass));
+    }
+
+    extrapolated = seconds * totalWork / sampleWork;
+    if (verbose)
+      std::cout << bits << " bits in " << seconds << "s, about " << extrapolated << "s for everything"
+                << (extrapolated > budget ? " => too slow" : "") << std::endl;
+
+    return extrapolated <= budget;
+  };
+
+  // cheapest pass: fewer tokens per block until it's fast enough
+  Pass best = passes.front();
+  unsigned long long bestBits = 0;
+  double bestSeconds = 0;
+  while (!run(best, bestBits, bestSeconds))
+  {
+    unsigned int maxTokens = best.optimize.maxTokens;
+    if (maxTokens > 0 && maxTokens <= MinTokens)
+      return best;
+    if (maxTokens == 0)
+      maxTokens = isGif ? GifMaxToken : LzwMaxToken;
+
+    maxTokens = std::max(maxTokens / 4, (unsigned int)MinTokens);
+    for (Pass& pass : passes)
+      pass.optimize.maxTokens = maxTokens;
+    best = passes.front();
+  }
+
+  // more thorough passes as long as they are fast enough, but only if they are better, too
+  double seconds = bestSeconds;
+  for (size_t i = 1; i < passes.size(); i++)
+  {
+    // greedy search: time is proportional to the number of block starts, don't run passes which are obviously too slow
+    const LzwEncoder::OptimizationSettings& previous = passes[i - 1].optimize;
+    const LzwEncoder::OptimizationSettings& current  = passes[i    ].optimize;
+    if (current.greedy && seconds * previous.alignment / current.alignment > budget)
+    {
+      if (verbose)
+        std::cout << "auto-tune: greedy -a=" << current.alignment << " needs about "
+                  << seconds * previous.alignment / current.alignment << "s => too slow" << std::endl;
+      break;
+    }
+
+    unsigned long long bits;
+    if (!run(passes[i], bits, seconds))
+      break;
+
+    if (bits < bestBits)
+    {
+      best     = passes[i];
+      bestBits = bits;
+    }
+  }
+
+  return best;
+}
+
+
+/// recompress a GIF image (convenience function, creates a temporary Optimizer)
+Optimizer::Bytes optimizeGif(const unsigned char* data, size_t size, const Optimizer::Settings& settings)
+{
+  Optimizer optimizer(settings);
+  return optimizer.optimizeGif(data, size);
+}
+
+
+/// recompress a .Z file (convenience function, creates a temporary Optimizer)
+Optimizer::Bytes optimizeZ(const unsigned char* data, size_t size, const Optimizer::Settings& settings)
+{
+  Optimizer optimizer(settings);
+  return optimizer.optimizeZ(data, size);
+}
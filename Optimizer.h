@@ -0,0 +1,221 @@
+// //////////////////////////////////////////////////////////
+// Optimizer.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include "LzwEncoder.h"
+#include "LzwDecoder.h"
+#include "ThreadPool.h"
+#include "Verifier.h"
+#include "Progress.h"
+
+#include <vector>
+#include <chrono>
+
+class GifImage;
+class ResultCache;
+
+/// recompress GIF and .Z files in memory, the whole pipeline of flexiGIF without any file I/O
+/** errors throw an exception (const char*), there is no global state:
+    several Optimizer objects can run at the same time, either with their own or with a shared ThreadPool,
+    each Optimizer keeps its LZW encoders (and their memory) for the next image **/
+class Optimizer
+{
+public:
+  // -------------------- data types --------------------
+  /// a continuous block of bytes
+  typedef std::vector<unsigned char> Bytes;
+
+  /// default values of the optimizer
+  enum DefaultValues
+  {
+    GifMaxToken      =  20000,
+    LzwMaxToken      = 100000,
+    GifMaxDictionary =   4096,
+    LzwMaxDictionary =  65536,
+    GifMaxDictionaryCompatible = GifMaxDictionary - 3, // 4093
+    Alignment        =      1,
+    MinImprovement   =      1,
+    MinNonGreedy     =      2,
+    LadderAlignment  =     64, // first pass of the time-limited mode
+    AutoTune         =     20, // kilopixels per second of --auto
+    MatchCache       =      0  // memoized matches per thread (16 bytes each), disabled by default
+  };
+
+  /// all parameters
+  struct Settings
+  {
+    /// LZW optimizer settings, minCodeSize is determined automatically
+    LzwEncoder::OptimizationSettings optimize;
+    /// try greedy search after non-greedy search (--prettygood)
+    bool smartGreedy;
+    /// number of threads, 1 => single-threaded
+    unsigned int numThreads;
+    /// GIF only: ensure that output is not interlaced
+    bool deinterlace;
+    /// GIF only: crop animation frames to the pixels which differ from the previous frame (same rendering, see GifImage::cropFrames)
+    bool crop;
+    /// GIF only: remove unused colors, remap indices and lower the LZW code size (same rendering, see GifImage::remapColors)
+    bool remap;
+    /// insert clear codes at these user-defined positions instead of searching (ascendingly sorted, empty => search)
+    std::vector<unsigned int> predefinedBlocks;
+    /// .Z only: input isn't compressed yet
+    bool compressZ;
+    /// .Z only: split huge inputs into segments of about this many bytes which are optimized independently (and in parallel), 0 => whole input at once
+    unsigned int segmentSize;
+    /// show debug messages
+    bool verbose;
+    /// show progress and estimated remaining time
+    bool showProgress;
+    /// write progress as JSON lines to this file descriptor (see Progress), -1 => disabled
+    int  progressFd;
+    /// milliseconds, 0 => no limit: run once with the settings above,
+    /// else start with cheap greedy passes and refine while time is left, the settings above are the last pass
+    unsigned int timeLimit;
+    /// kilopixels (.Z: kilobytes) per second, 0 => disabled: else choose alignment, maxTokens and non-greedy search per file (see autoTune),
+    /// the settings above are the most thorough choice, ignored if timeLimit or predefinedBlocks are set
+    unsigned int autoTune;
+    /// keep the original LZW data of a frame (or .Z file) if the optimized data isn't smaller,
+    /// note: the original isn't checked against maxDictionary and startWithClearCode
+    bool keepOriginal;
+    /// give up a frame (or .Z file) as soon as the extrapolated estimate can't beat the original LZW data (heuristic, requires keepOriginal)
+    bool earlyOut;
+    /// decode all new LZW data (in the background) and throw an exception instead of returning output if it doesn't match the input
+    bool verify;
+    /// optional: replay the bitstreams of frames/files which were optimized before with the same settings (not owned, NULL => disabled)
+    ResultCache* cache;
+
+    /// same defaults as the command-line tool
+    Settings();
+  };
+
+  /// wall-clock time (seconds) of each stage of the most recent optimizeGif()/optimizeZ() call,
+  /// frames optimized in parallel add their times, so the sum of all stages may exceed total
+  struct Timings
+  {
+    /// parse input file structure (GIF only, .Z files are parsed while decoding)
+    double parse;
+    /// choose settings (--auto)
+    double tune;
+    /// decompress LZW data
+    double decode;
+    /// estimate cost of all blocks
+    double estimate;
+    /// find the best block boundaries
+    double optimize;
+    /// generate the final bitstream
+    double merge;
+    /// serialize output
+    double write;
+    /// wait for --verify (only the time which isn't hidden behind the optimization)
+    double verify;
+    /// whole call
+    double total;
+
+    /// all zero
+    Timings();
+  };
+
+  // -------------------- methods --------------------
+  /// prepare optimizer, starts settings.numThreads - 1 background threads
+  explicit Optimizer(const Settings& settings);
+  /// prepare optimizer, use an existing pool (which may be shared by several optimizers)
+  Optimizer(const Settings& settings, ThreadPool& pool);
+
+  /// recompress a GIF image and append it to output
+  void  optimizeGif(const unsigned char* data, size_t size, Bytes& output);
+  /// recompress a .Z file (or compress raw data if Settings::compressZ is set) and append it to output
+  void  optimizeZ  (const unsigned char* data, size_t size, Bytes& output);
+
+  /// recompress a GIF image
+  Bytes optimizeGif(const unsigned char* data, size_t size);
+  /// recompress a .Z file (or compress raw data if Settings::compressZ is set)
+  Bytes optimizeZ  (const unsigned char* data, size_t size);
+
+  /// choose settings for a GIF or .Z file which meet Settings::autoTune (see --auto), they replace the current settings
+  /// and autoTune is disabled afterwards (so the next optimizeGif()/optimizeZ() call doesn't tune again)
+  void  autoTune(const unsigned char* data, size_t size, bool isGif);
+  /// current settings, see autoTune()
+  const Settings& getSettings() const;
+
+  /// time spent in each stage of the most recent call
+  const Timings& getTimings() const;
+  /// profiling counters of the most recent call (all frames and passes)
+  const LzwEncoder::Statistics& getStatistics() const;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  /// one pass of the time-limited mode (or the only pass without a time limit)
+  struct Pass
+  {
+    /// LZW optimizer settings
+    LzwEncoder::OptimizationSettings optimize;
+    /// try greedy search after non-greedy search
+    bool smartGreedy;
+  };
+  /// cheapest pass first, the last pass is what the user asked for
+  std::vector<Pass> getPasses(const LzwEncoder::OptimizationSettings& optimize) const;
+
+  /// --auto: a slice of a frame (or of a .Z file)
+  struct Sample
+  {
+    /// pixels/bytes
+    Bytes data;
+    /// minimum LZW code size
+    unsigned char codeSize;
+  };
+  /// --auto: time the passes of getPasses() on a few samples and return the most thorough pass which (extrapolated to
+  /// all blocks of the given sizes) meets Settings::autoTune, maxTokens is reduced if even the cheapest pass is too slow
+  Pass tune(const std::vector<Sample>& samples, const std::vector<unsigned int>& sizes, bool isGif, const LzwEncoder::OptimizationSettings& optimize);
+  /// --auto: take samples of the largest frames and call tune()
+  Pass tuneFrames(GifImage& gif, const LzwEncoder::OptimizationSettings& optimize);
+  /// --auto: take samples of .Z contents and call tune()
+  Pass tuneBytes(const LzwEncoder::RawData& bytes, const LzwEncoder::OptimizationSettings& optimize);
+
+  /// de-interlace, crop and remap frames (according to the settings)
+  void prepareFrames(GifImage& gif) const;
+  /// the optimizer settings adjusted for .Z files
+  LzwEncoder::OptimizationSettings getSettingsZ() const;
+
+  /// optimize all frames of a GIF, return false if the deadline (may be NULL) was hit before
+  /// frames which should keep their original LZW data get an empty bitstream
+  bool optimizeFrames(GifImage& gif, const Pass& pass, const Clock::time_point* deadline, std::vector<BitStream>& optimizedFrames);
+  /// optimize .Z contents, return false if the deadline (may be NULL) was hit before,
+  /// optimized is empty if the early-out heuristic decided that originalBits (0 => unknown) can't be beaten
+  bool optimizeBytes(const LzwEncoder::RawData& bytes, const Pass& pass, const Clock::time_point* deadline, unsigned long long originalBits,
+                     BitStream& optimized);
+  /// optimize .Z contents in independent segments (see Settings::segmentSize), return false if the deadline (may be NULL) was hit before
+  bool optimizeSegments(const LzwEncoder::RawData& bytes, const Pass& pass, const Clock::time_point* deadline, BitStream& optimized);
+  /// optimize a single segment, if isFinal is false then it ends with a clear code (optimized stays empty if that's impossible),
+  /// return false if the deadline (may be NULL) was hit before
+  bool optimizeSegment(LzwEncoder& encoded, const unsigned char* data, unsigned int size, bool isFinal, const Pass& pass,
+                       const Clock::time_point* deadline, unsigned int numThreads, Timings& timings, BitStream& optimized);
+
+  /// all parameters
+  Settings   m_settings;
+  /// background threads, unused if the pool was provided by the caller
+  ThreadPool m_ownPool;
+  /// current thread plus background threads
+  ThreadPool& m_pool;
+  /// one encoder per thread, their memory is reused for all frames/images
+  std::vector<LzwEncoder> m_encoders;
+  /// one decoder per thread, their memory is reused for all frames/images, too
+  std::vector<LzwDecoder::Tables> m_decoders;
+  /// time spent in each stage of the most recent call
+  Timings    m_timings;
+  /// profiling counters of the most recent call
+  LzwEncoder::Statistics m_statistics;
+  /// decode and compare new LZW data in the background
+  Verifier   m_verifier;
+  /// show progress of the current pass on a background thread
+  Progress   m_progress;
+};
+
+
+/// recompress a GIF image (convenience function, creates a temporary Optimizer)
+Optimizer::Bytes optimizeGif(const unsigned char* data, size_t size, const Optimizer::Settings& settings);
+/// recompress a .Z file (convenience function, creates a temporary Optimizer)
+Optimizer::Bytes optimizeZ  (const unsigned char* data, size_t size, const Optimizer::Settings& settings);
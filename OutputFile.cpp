@@ -0,0 +1,101 @@
+// //////////////////////////////////////////////////////////
+// OutputFile.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "OutputFile.h"
+
+#include <fstream>
+#include <atomic>
+
+#ifndef _WIN32
+#define ALLOW_POSIX
+#endif
+
+#ifdef ALLOW_POSIX
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#endif
+
+
+// local stuff
+namespace
+{
+  /// make names of temporary files unique even if several threads write at the same time
+  std::atomic<unsigned int> numTemporaryFiles(0);
+}
+
+
+/// store a memory block in a file with a single write() call
+void writeFile(const std::string& filename, const unsigned char* data, size_t size, bool atomic)
+{
+#ifdef ALLOW_POSIX
+  // only regular files can be replaced, keep their permissions
+  struct stat info;
+  bool   exists = (stat(filename.c_str(), &info) == 0);
+  if (exists && !S_ISREG(info.st_mode))
+    atomic = false;
+
+  std::string target = filename;
+  int handle = -1;
+  if (atomic)
+  {
+    // temporary file in the same directory because rename() doesn't work across file systems
+    for (unsigned int attempt = 0; attempt < 100 && handle < 0; attempt++)
+    {
+      target = filename + "." + std::to_string(getpid()) + "-" + std::to_string(numTemporaryFiles++) + ".tmp";
+      handle = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (handle < 0 && errno != EEXIST)
+        break;
+    }
+    if (handle >= 0 && exists)
+      fchmod(handle, info.st_mode & 07777);
+  }
+  else
+    handle = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (handle < 0)
+    throw "failed to write OUTPUTFILE";
+
+  // usually a single call, unless the OS decides to split it
+  bool success = true;
+  while (size > 0)
+  {
+    ssize_t written = write(handle, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+    {
+      success = false;
+      break;
+    }
+
+    data += written;
+    size -= (size_t)written;
+  }
+
+  if (close(handle) != 0)
+    success = false;
+  if (success && atomic && rename(target.c_str(), filename.c_str()) != 0)
+    success = false;
+
+  if (!success)
+  {
+    if (atomic)
+      unlink(target.c_str());
+    throw "failed to write OUTPUTFILE";
+  }
+#else
+  // fallback: not atomic
+  (void)atomic;
+  std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+  if (size > 0)
+    file.write((const char*)data, size);
+  file.close();
+  if (!file)
+    throw "failed to write OUTPUTFILE";
+#endif
+}
@@ -0,0 +1,19 @@
+// //////////////////////////////////////////////////////////
+// OutputFile.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+using std::size_t;
+
+
+/// store a memory block in a file with a single write() call
+/** if atomic is set then the data goes to a temporary file in the same directory which replaces filename when it's complete,
+    so that other processes never see a partially written file (it isn't flushed to disk, though, a system crash may lose it);
+    non-regular files (e.g. /dev/stdout) and systems without POSIX file I/O are always written directly,
+    errors throw an exception (const char*) **/
+void writeFile(const std::string& filename, const unsigned char* data, size_t size, bool atomic = true);
@@ -0,0 +1,205 @@
+// //////////////////////////////////////////////////////////
+// Progress.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "Progress.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <cerrno>
+#else
+#include <io.h>
+#endif
+
+
+// local stuff
+namespace
+{
+  /// how often the background thread reports
+  const std::chrono::milliseconds Interval(250);
+}
+
+
+/// no task, the background thread isn't running
+Progress::Progress()
+: m_done(0),
+  m_finishedParts(0),
+  m_total(0),
+  m_numParts(0),
+  m_task(),
+  m_showConsole(false),
+  m_fd(-1),
+  m_start(),
+  m_lineLength(0),
+  m_thread(),
+  m_quit(false),
+  m_mutex(),
+  m_wakeUp()
+{
+}
+
+
+/// stop the background thread (without a final report)
+Progress::~Progress()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_wakeUp.notify_all();
+
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+
+/// begin a new task
+void Progress::start(const char* task, unsigned long long total, unsigned int numParts, bool showConsole, int fd)
+{
+  // previous task wasn't stopped properly
+  if (m_thread.joinable())
+    stop(false);
+
+  m_done          = 0;
+  m_finishedParts = 0;
+  m_total         = total;
+  m_numParts      = numParts;
+  m_task          = task;
+  m_showConsole   = showConsole;
+  m_fd            = fd;
+  m_start         = Clock::now();
+  m_lineLength    = 0;
+
+  if (!m_showConsole && m_fd < 0)
+    return;
+
+  if (m_fd >= 0)
+  {
+    std::ostringstream line;
+    line << "{\"event\":\"start\",\"task\":\"" << m_task << "\",\"total\":" << m_total << ",\"numParts\":" << m_numParts << "}\n";
+    writeLine(line.str());
+  }
+
+  m_quit   = false;
+  m_thread = std::thread(&Progress::process, this);
+}
+
+
+/// end the current task, completed is false if it was aborted (e.g. deadline hit) or gave up early
+void Progress::stop(bool completed)
+{
+  if (!m_thread.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_wakeUp.notify_all();
+  m_thread.join();
+
+  report(true, completed);
+}
+
+
+/// main loop of the background thread
+void Progress::process()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (!m_wakeUp.wait_for(lock, Interval, [this] { return m_quit; }))
+  {
+    lock.unlock();
+    report(false, false);
+    lock.lock();
+  }
+}
+
+
+/// show current state, isFinal => "done" event / end console line
+void Progress::report(bool isFinal, bool completed)
+{
+  unsigned long long done          = m_done;
+  unsigned int       finishedParts = m_finishedParts;
+  if (isFinal && completed)
+  {
+    done          = m_total;
+    finishedParts = m_numParts;
+  }
+  if (done > m_total)
+    done = m_total;
+
+  // ETA based on wall-clock time, assuming that all units are equally expensive
+  double elapsed   = std::chrono::duration<double>(Clock::now() - m_start).count();
+  double fraction  = m_total > 0 ? done / double(m_total) : 1;
+  double remaining = fraction > 0 ? elapsed / fraction - elapsed : -1;
+
+  if (m_showConsole)
+  {
+    std::ostringstream line;
+    if (m_numParts > 1)
+      line << finishedParts << "/" << m_numParts << " " << m_task << " finished: ";
+    line << (unsigned int)(100 * fraction) << "% done";
+    if (!isFinal && elapsed > 3 && remaining >= 1)
+      line << " (after " << (int)elapsed << "s, about " << (int)remaining << "s left)";
+
+    // overwrite the previous status line completely
+    std::string text = line.str();
+    size_t length = text.size();
+    if (text.size() < m_lineLength)
+      text.append(m_lineLength - text.size(), ' ');
+    m_lineLength = length;
+
+    std::cout << "\r" << text;
+    if (isFinal)
+      std::cout << std::endl;
+    else
+      std::cout << std::flush;
+  }
+
+  if (m_fd >= 0)
+  {
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3)
+         << "{\"event\":\"" << (isFinal ? "done" : "progress") << "\",\"task\":\"" << m_task << "\""
+         << ",\"done\":"  << done  << ",\"total\":"    << m_total
+         << ",\"parts\":" << finishedParts << ",\"numParts\":" << m_numParts
+         << ",\"percent\":" << 100 * fraction << ",\"elapsed\":" << elapsed;
+    if (isFinal)
+      line << ",\"completed\":" << (completed ? "true" : "false");
+    else if (remaining >= 0)
+      line << ",\"remaining\":" << remaining;
+    else
+      line << ",\"remaining\":null";
+    line << "}\n";
+    writeLine(line.str());
+  }
+}
+
+
+/// write a whole line to m_fd (usually a single call, so lines don't interleave with other writers)
+void Progress::writeLine(const std::string& line) const
+{
+  // errors are silently ignored, progress is just informative
+  const char* data = line.c_str();
+  size_t      left = line.size();
+  while (left > 0)
+  {
+#ifndef _WIN32
+    ssize_t written = ::write(m_fd, data, left);
+    if (written < 0 && errno == EINTR)
+      continue;
+#else
+    int written = _write(m_fd, data, (unsigned int)left);
+#endif
+    if (written <= 0)
+      return;
+
+    data += written;
+    left -= (size_t)written;
+  }
+}
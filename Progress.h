@@ -0,0 +1,86 @@
+// //////////////////////////////////////////////////////////
+// Progress.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// show progress and the estimated remaining time of a task on a background thread
+/** the optimizer's loops only update atomic counters (add() and finishPart()),
+    a background thread wakes up a few times per second and prints a status line and/or
+    writes JSON lines to a file descriptor (see --progress-fd), its ETA is based on wall-clock time **/
+class Progress
+{
+public:
+  /// no task, the background thread isn't running
+  Progress();
+  /// stop the background thread (without a final report)
+  ~Progress();
+
+  /// begin a new task: total units (pixels or bytes) split into numParts parts (frames or segments),
+  /// showConsole => update a status line on STDOUT, fd >= 0 => write JSON lines to that file descriptor,
+  /// if neither is requested then only the counters are reset and no thread is started
+  void start(const char* task, unsigned long long total, unsigned int numParts, bool showConsole, int fd);
+  /// end the current task, completed is false if it was aborted (e.g. deadline hit) or gave up early
+  void stop(bool completed);
+
+  /// more units are finished (the only call inside hot loops)
+  void add(unsigned long long units)
+  {
+    m_done.fetch_add(units, std::memory_order_relaxed);
+  }
+  /// another part is finished
+  void finishPart()
+  {
+    m_finishedParts.fetch_add(1, std::memory_order_relaxed);
+  }
+
+private:
+  /// disable copying
+  Progress(const Progress&);
+  Progress& operator=(const Progress&);
+
+  typedef std::chrono::steady_clock Clock;
+
+  /// main loop of the background thread
+  void process();
+  /// show current state, isFinal => "done" event / end console line
+  void report(bool isFinal, bool completed);
+  /// write a whole line to m_fd (usually a single call, so lines don't interleave with other writers)
+  void writeLine(const std::string& line) const;
+
+  /// finished units of the current task
+  std::atomic<unsigned long long> m_done;
+  /// finished parts of the current task
+  std::atomic<unsigned int> m_finishedParts;
+  /// number of units of the current task
+  unsigned long long m_total;
+  /// number of parts of the current task
+  unsigned int       m_numParts;
+  /// name of the current task ("frames", "bytes" or "segments")
+  std::string        m_task;
+  /// show status line
+  bool               m_showConsole;
+  /// JSON lines, -1 => disabled
+  int                m_fd;
+  /// when the current task began
+  Clock::time_point  m_start;
+  /// length of the most recent status line (shorter lines must overwrite it with spaces)
+  size_t             m_lineLength;
+
+  /// background thread
+  std::thread             m_thread;
+  /// true if the background thread should terminate
+  bool                    m_quit;
+  /// protect m_quit
+  std::mutex              m_mutex;
+  /// wake up background thread
+  std::condition_variable m_wakeUp;
+};
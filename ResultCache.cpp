@@ -0,0 +1,243 @@
+// //////////////////////////////////////////////////////////
+// ResultCache.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "ResultCache.h"
+#include "InputSource.h"
+#include "OutputFile.h"
+
+#include <cstring>
+
+
+// local stuff
+namespace
+{
+  /// first bytes of a cache file, followed by a version number
+  const char         FileMagic[4] = { 'F', 'L', 'X', 'C' };
+  const unsigned int FileVersion  = 1;
+
+  /// final mixing step of MurmurHash3 (every input bit affects every output bit)
+  unsigned long long mix(unsigned long long x)
+  {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  /// two independent 64 bit hashes
+  struct Hasher
+  {
+    unsigned long long low;
+    unsigned long long high;
+
+    Hasher()
+    : low(0x9E3779B97F4A7C15ULL), high(0xD6E8FEB86659FD93ULL)
+    {}
+
+    void add(unsigned long long word)
+    {
+      low  = (low ^ word) * 0x100000001B3ULL;
+      low  = (low << 31) | (low >> 33);
+      high = (high + word) * 0x9FB21C651E98DF25ULL;
+      high ^= high >> 29;
+    }
+  };
+
+  /// append a little-endian number to a file's contents
+  void writeNumber(std::vector<unsigned char>& output, unsigned long long value, unsigned int numBytes)
+  {
+    for (unsigned int i = 0; i < numBytes; i++)
+      output.push_back((unsigned char)(value >> (8 * i)));
+  }
+
+  /// read a little-endian number, advance pos
+  unsigned long long readNumber(const unsigned char* data, size_t size, size_t& pos, unsigned int numBytes)
+  {
+    if (pos + numBytes > size)
+      throw "cache file is corrupted";
+
+    unsigned long long result = 0;
+    for (unsigned int i = 0; i < numBytes; i++)
+      result |= (unsigned long long)data[pos + i] << (8 * i);
+    pos += numBytes;
+    return result;
+  }
+}
+
+
+/// empty cache, in memory only
+ResultCache::ResultCache()
+: m_entries(),
+  m_mutex(),
+  m_filename(),
+  m_modified(false),
+  m_numHits(0),
+  m_numMisses(0)
+{
+}
+
+
+/// load cache from disk, a missing file is the same as an empty cache, save() writes to the same file
+ResultCache::ResultCache(const std::string& filename)
+: m_entries(),
+  m_mutex(),
+  m_filename(filename),
+  m_modified(false),
+  m_numHits(0),
+  m_numMisses(0)
+{
+  InputSource file(filename);
+  if (file.empty())
+    return;
+
+  // header
+  const unsigned char* data = file.getData();
+  size_t size = file.getSize();
+  size_t pos  = sizeof(FileMagic);
+  if (size < pos || memcmp(data, FileMagic, sizeof(FileMagic)) != 0)
+    throw "not a flexiGIF cache file";
+  if (readNumber(data, size, pos, 4) != FileVersion)
+    throw "unsupported version of flexiGIF cache file";
+
+  // key, number of bits, bytes
+  while (pos < size)
+  {
+    Key key;
+    key.low  = readNumber(data, size, pos, 8);
+    key.high = readNumber(data, size, pos, 8);
+    unsigned long long numBits  = readNumber(data, size, pos, 8);
+    unsigned long long numBytes = (numBits + 7) / 8;
+    if (pos + numBytes > size)
+      throw "cache file is corrupted";
+
+    BitStream& bits = m_entries[key];
+    bits = BitStream();
+    bits.reserve((size_t)numBits);
+    for (unsigned long long i = 0; i < numBytes; i++)
+    {
+      unsigned char numBitsCurrentByte = (i + 1 < numBytes || numBits % 8 == 0) ? 8 : (unsigned char)(numBits % 8);
+      bits.add(data[pos++], numBitsCurrentByte);
+    }
+  }
+}
+
+
+/// nothing special
+ResultCache::~ResultCache()
+{
+}
+
+
+/// hash uncompressed data and all settings which affect the optimized bitstream
+ResultCache::Key ResultCache::getKey(const unsigned char* data, size_t size, bool isGif, const LzwEncoder::OptimizationSettings& optimize, bool smartGreedy,
+                                     unsigned int segmentSize)
+{
+  Hasher hasher;
+
+  // eight bytes at once
+  size_t pos = 0;
+  for (; pos + 8 <= size; pos += 8)
+  {
+    unsigned long long word;
+    memcpy(&word, data + pos, 8);
+    hasher.add(word);
+  }
+  // remaining bytes
+  unsigned long long last = 0;
+  for (unsigned int shift = 0; pos < size; pos++, shift += 8)
+    last |= (unsigned long long)data[pos] << shift;
+  hasher.add(last);
+
+  // settings (verbose, readOnlyBest, dictionaryLayout, incremental and matchCache don't change the output)
+  hasher.add(size);
+  hasher.add(isGif);
+  hasher.add(optimize.minCodeSize);
+  hasher.add(optimize.startWithClearCode);
+  hasher.add(optimize.greedy);
+  hasher.add(optimize.minNonGreedyMatch);
+  hasher.add(optimize.minImprovement);
+  hasher.add(optimize.maxDictionary);
+  hasher.add(optimize.maxTokens);
+  hasher.add(optimize.alignment);
+  hasher.add(optimize.avoidNonGreedyAgain);
+  hasher.add(smartGreedy);
+  hasher.add(segmentSize);
+
+  Key key;
+  key.low  = mix(hasher.low);
+  key.high = mix(hasher.high ^ key.low);
+  return key;
+}
+
+
+/// return true and copy the bitstream if key is known
+bool ResultCache::lookup(const Key& key, BitStream& bits)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto found = m_entries.find(key);
+  if (found == m_entries.end())
+  {
+    m_numMisses++;
+    return false;
+  }
+
+  m_numHits++;
+  bits = found->second;
+  return true;
+}
+
+
+/// remember a bitstream
+void ResultCache::store(const Key& key, const BitStream& bits)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_entries[key] = bits;
+  m_modified = true;
+}
+
+
+/// write all entries to disk (unless no filename was given)
+void ResultCache::save()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_filename.empty() || !m_modified)
+    return;
+
+  std::vector<unsigned char> output(FileMagic, FileMagic + sizeof(FileMagic));
+  writeNumber(output, FileVersion, 4);
+  for (auto i = m_entries.begin(); i != m_entries.end(); i++)
+  {
+    const BitStream& bits = i->second;
+    writeNumber(output, i->first.low,  8);
+    writeNumber(output, i->first.high, 8);
+    writeNumber(output, bits.size(),   8);
+
+    size_t numBytes = bits.getNumBytes();
+    output.resize(output.size() + numBytes);
+    bits.copyBytes(0, numBytes, output.data() + output.size() - numBytes);
+  }
+
+  // never leave a half-written cache file behind
+  writeFile(m_filename, output.data(), output.size());
+  m_modified = false;
+}
+
+
+/// number of successful lookups
+unsigned int ResultCache::getNumHits() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_numHits;
+}
+
+
+/// number of failed lookups
+unsigned int ResultCache::getNumMisses() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_numMisses;
+}
@@ -0,0 +1,82 @@
+// //////////////////////////////////////////////////////////
+// ResultCache.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include "LzwEncoder.h"
+#include "BitStream.h"
+
+#include <unordered_map>
+#include <string>
+#include <mutex>
+
+/// remember the optimized LZW bitstreams of frames (or .Z files) which were already seen, optionally stored on disk
+/** the key is a 128 bit hash of the uncompressed data and all settings which affect the output,
+    lookup() and store() are thread-safe and can be overridden to plug in a different key-value store,
+    errors throw an exception (const char*) **/
+class ResultCache
+{
+public:
+  /// 128 bit hash
+  struct Key
+  {
+    unsigned long long low;
+    unsigned long long high;
+
+    bool operator==(const Key& other) const
+    {
+      return low == other.low && high == other.high;
+    }
+  };
+
+  /// empty cache, in memory only
+  ResultCache();
+  /// load cache from disk, a missing file is the same as an empty cache, save() writes to the same file
+  explicit ResultCache(const std::string& filename);
+  /// nothing special
+  virtual ~ResultCache();
+
+  /// hash uncompressed data and all settings which affect the optimized bitstream (segmentSize: see Optimizer::Settings, 0 => whole input)
+  static Key getKey(const unsigned char* data, size_t size, bool isGif, const LzwEncoder::OptimizationSettings& optimize, bool smartGreedy,
+                    unsigned int segmentSize = 0);
+
+  /// return true and copy the bitstream if key is known
+  virtual bool lookup(const Key& key, BitStream& bits);
+  /// remember a bitstream
+  virtual void store (const Key& key, const BitStream& bits);
+  /// write all entries to disk (unless no filename was given)
+  virtual void save();
+
+  /// number of successful lookups
+  unsigned int getNumHits()   const;
+  /// number of failed lookups
+  unsigned int getNumMisses() const;
+
+private:
+  /// disable copying
+  ResultCache(const ResultCache&);
+  ResultCache& operator=(const ResultCache&);
+
+  /// the key is a hash already
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      return (size_t)key.low;
+    }
+  };
+
+  /// all bitstreams
+  std::unordered_map<Key, BitStream, KeyHash> m_entries;
+  /// protect m_entries and the counters
+  mutable std::mutex m_mutex;
+  /// empty if in memory only
+  std::string  m_filename;
+  /// true if entries were added since the file was loaded/saved
+  bool         m_modified;
+  /// statistics
+  unsigned int m_numHits;
+  unsigned int m_numMisses;
+};
@@ -0,0 +1,176 @@
+// //////////////////////////////////////////////////////////
+// ThreadPool.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "ThreadPool.h"
+
+#include <memory>
+#include <exception>
+
+namespace
+{
+  /// shared state of a single call of ThreadPool::run()
+  struct Batch
+  {
+    /// user-defined function
+    ThreadPool::Worker      worker;
+    /// next slot number
+    unsigned int            nextSlot;
+    /// number of background threads currently running worker()
+    unsigned int            active;
+    /// true if no more background threads may join
+    bool                    closed;
+    /// first exception thrown by a background thread
+    std::exception_ptr      error;
+    /// protect all members
+    std::mutex              mutex;
+    /// signal when a background thread is finished
+    std::condition_variable finished;
+  };
+}
+
+
+/// create numThreads background threads (0 => no background threads at all)
+ThreadPool::ThreadPool(unsigned int numThreads)
+: m_threads(),
+  m_queue(),
+  m_mutex(),
+  m_wakeUp(),
+  m_quit(false)
+{
+  for (unsigned int i = 0; i < numThreads; i++)
+    m_threads.push_back(std::thread(&ThreadPool::process, this));
+}
+
+
+/// wait until all background threads are finished
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_wakeUp.notify_all();
+
+  for (size_t i = 0; i < m_threads.size(); i++)
+    m_threads[i].join();
+}
+
+
+/// number of background threads
+unsigned int ThreadPool::getNumThreads() const
+{
+  return (unsigned int)m_threads.size();
+}
+
+
+/// recommended number of threads (never zero)
+unsigned int ThreadPool::getHardwareThreads()
+{
+  unsigned int result = std::thread::hardware_concurrency();
+  return result > 0 ? result : 1;
+}
+
+
+/// call worker() on the current thread and on up to maxSlots - 1 idle background threads, return when all of them are finished
+void ThreadPool::run(const Worker& worker, unsigned int maxSlots)
+{
+  // no helpers at all ?
+  unsigned int numHelpers = maxSlots > 0 ? maxSlots - 1 : 0;
+  if (numHelpers > m_threads.size())
+    numHelpers = (unsigned int)m_threads.size();
+  if (numHelpers == 0)
+  {
+    worker(0);
+    return;
+  }
+
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->worker   = worker;
+  batch->nextSlot = 1;
+  batch->active   = 0;
+  batch->closed   = false;
+
+  // a helper may start long after the current thread finished its work (e.g. if all background threads are busy),
+  // then it skips the worker because the batch was already closed
+  std::function<void()> helper = [batch]()
+  {
+    unsigned int slot;
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      if (batch->closed)
+        return;
+      slot = batch->nextSlot++;
+      batch->active++;
+    }
+
+    try
+    {
+      batch->worker(slot);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      if (!batch->error)
+        batch->error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    batch->active--;
+    batch->finished.notify_all();
+  };
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (unsigned int i = 0; i < numHelpers; i++)
+      m_queue.push_back(helper);
+  }
+  m_wakeUp.notify_all();
+
+  // current thread does its share, too
+  std::exception_ptr error;
+  try
+  {
+    worker(0);
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+
+  // wait for all helpers which already started
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->closed = true;
+  while (batch->active > 0)
+    batch->finished.wait(lock);
+
+  if (!error)
+    error = batch->error;
+  lock.unlock();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+
+/// main loop of a background thread
+void ThreadPool::process()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (m_queue.empty() && !m_quit)
+        m_wakeUp.wait(lock);
+      if (m_queue.empty())
+        return;
+
+      job = m_queue.front();
+      m_queue.pop_front();
+    }
+
+    job();
+  }
+}
@@ -0,0 +1,58 @@
+// //////////////////////////////////////////////////////////
+// ThreadPool.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// a fixed number of background threads which help running parallel loops
+/** the calling thread always participates, therefore nested calls of run() can't dead-lock
+    and a pool without any background threads runs everything on the calling thread **/
+class ThreadPool
+{
+public:
+  /// a worker is called once per participating thread, slot is 0 for the calling thread and 1,2,3,... for background threads
+  typedef std::function<void(unsigned int slot)> Worker;
+
+  /// create numThreads background threads (0 => no background threads at all)
+  explicit ThreadPool(unsigned int numThreads = 0);
+  /// wait until all background threads are finished
+  ~ThreadPool();
+
+  /// number of background threads
+  unsigned int getNumThreads() const;
+
+  /// call worker() on the current thread and on up to maxSlots - 1 idle background threads, return when all of them are finished
+  /** each worker is supposed to fetch its jobs from a shared counter/queue until nothing is left,
+      the first exception thrown by any worker is re-thrown by run() **/
+  void run(const Worker& worker, unsigned int maxSlots);
+
+  /// recommended number of threads (never zero)
+  static unsigned int getHardwareThreads();
+
+private:
+  /// disable copying
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  /// main loop of a background thread
+  void process();
+
+  /// all background threads
+  std::vector<std::thread> m_threads;
+  /// pending jobs
+  std::deque<std::function<void()> > m_queue;
+  /// protect m_queue and m_quit
+  std::mutex               m_mutex;
+  /// wake up background threads
+  std::condition_variable  m_wakeUp;
+  /// true if threads should terminate
+  bool                     m_quit;
+};
@@ -0,0 +1,182 @@
+// //////////////////////////////////////////////////////////
+// Verifier.cpp
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#include "Verifier.h"
+#include "BinaryInputBuffer.h"
+
+#include <cstring>
+#include <algorithm>
+
+
+/// exchange contents (avoids copying the bitstream and pixels/bytes)
+void Verifier::Job::swap(Job& other)
+{
+  bits.swap(other.bits);
+  copy.swap(other.copy);
+  std::swap(expected,    other.expected);
+  std::swap(size,        other.size);
+  std::swap(isGif,       other.isGif);
+  std::swap(minCodeSize, other.minCodeSize);
+  std::swap(maxCodeSize, other.maxCodeSize);
+}
+
+
+/// no pending checks, the background thread isn't running yet
+Verifier::Verifier()
+: m_thread(),
+  m_queue(),
+  m_running(0),
+  m_numChecked(0),
+  m_failed(false),
+  m_quit(false),
+  m_mutex(),
+  m_wakeUp(),
+  m_idle(),
+  m_tables()
+{
+}
+
+
+/// discard pending checks and stop the background thread
+Verifier::~Verifier()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.clear();
+    m_quit = true;
+  }
+  m_wakeUp.notify_all();
+
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+
+/// queue a GIF frame or the contents of a .Z file
+void Verifier::add(const BitStream& bits, const unsigned char* expected, size_t size, bool copy,
+                   bool isGif, unsigned char minCodeSize, unsigned char maxCodeSize)
+{
+  Job job;
+  job.bits        = bits;
+  job.expected    = copy ? NULL : expected;
+  job.size        = size;
+  if (copy)
+    job.copy.assign(expected, expected + size);
+  job.isGif       = isGif;
+  job.minCodeSize = minCodeSize;
+  job.maxCodeSize = maxCodeSize;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.push_back(Job());
+    m_queue.back().swap(job);
+
+    // start background thread on demand
+    if (!m_thread.joinable())
+      m_thread = std::thread(&Verifier::process, this);
+  }
+  m_wakeUp.notify_one();
+}
+
+
+/// wait until all queued bitstreams were checked, throw an exception if at least one of them failed
+void Verifier::finish()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this] { return m_queue.empty() && m_running == 0; });
+
+  if (m_failed)
+  {
+    m_failed = false;
+    throw "verification failed: optimized LZW data doesn't decode to the original pixels/bytes";
+  }
+}
+
+
+/// drop all pending checks and their results, wait for the current check
+void Verifier::discard()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_queue.clear();
+  m_idle.wait(lock, [this] { return m_running == 0; });
+  m_failed = false;
+}
+
+
+/// number of bitstreams checked so far (including failed ones)
+unsigned int Verifier::getNumChecked() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_numChecked;
+}
+
+
+/// main loop of the background thread
+void Verifier::process()
+{
+  while (true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeUp.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+      if (m_quit)
+        return;
+
+      job.swap(m_queue.front());
+      m_queue.pop_front();
+      m_running++;
+    }
+
+    bool ok = check(job);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running--;
+    m_numChecked++;
+    if (!ok)
+      m_failed = true;
+    if (m_queue.empty() && m_running == 0)
+      m_idle.notify_all();
+  }
+}
+
+
+/// decode and compare, return false if the bitstream is invalid or produces different pixels/bytes
+bool Verifier::check(const Job& job)
+{
+  // GIF: split into blocks of at most 255 bytes, each preceded by its length, followed by an empty block (same as GifImage::writeOptimized)
+  Bytes lzw;
+  size_t numBytes = job.bits.getNumBytes();
+  if (job.isGif)
+  {
+    const size_t MaxBytesPerBlock = 255;
+    lzw.reserve(numBytes + numBytes / MaxBytesPerBlock + 2);
+    for (size_t pos = 0; pos < numBytes; pos += MaxBytesPerBlock)
+    {
+      size_t length = std::min(numBytes - pos, MaxBytesPerBlock);
+      lzw.push_back((unsigned char)length);
+      lzw.resize(lzw.size() + length);
+      job.bits.copyBytes(pos, length, &lzw[lzw.size() - length]);
+    }
+    lzw.push_back(0);
+  }
+  else
+    lzw = job.bits.toBytes();
+
+  const unsigned char* expected = job.expected != NULL ? job.expected : job.copy.data();
+  try
+  {
+    BinaryInputBuffer input(lzw.data(), (unsigned int)lzw.size());
+    LzwDecoder decoder(input, job.isGif, job.minCodeSize, job.maxCodeSize, (unsigned int)job.size, false, &m_tables);
+
+    const Bytes& decoded = decoder.getBytes();
+    return decoded.size() == job.size && (job.size == 0 || memcmp(decoded.data(), expected, job.size) == 0);
+  }
+  catch (const char*)
+  {
+    // broken bitstream
+    return false;
+  }
+}
@@ -0,0 +1,96 @@
+// //////////////////////////////////////////////////////////
+// Verifier.h
+// Copyright (c) 2018 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
+
+#pragma once
+
+#include "BitStream.h"
+#include "LzwDecoder.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// decode optimized LZW bitstreams on a background thread and compare them to the original pixels/bytes (see --verify)
+/** the background thread is started by the first add(), finish() waits for all pending checks,
+    errors throw an exception (const char*) **/
+class Verifier
+{
+public:
+  /// a continuous block of bytes
+  typedef std::vector<unsigned char> Bytes;
+
+  /// no pending checks, the background thread isn't running yet
+  Verifier();
+  /// discard pending checks and stop the background thread
+  ~Verifier();
+
+  /// queue a GIF frame (maxCodeSize = 12) or the contents of a .Z file (minCodeSize = 8):
+  /// copy is true => keep a copy of expected, else expected must remain valid until finish() returns
+  void add(const BitStream& bits, const unsigned char* expected, size_t size, bool copy,
+           bool isGif, unsigned char minCodeSize, unsigned char maxCodeSize);
+  /// wait until all queued bitstreams were checked, throw an exception if at least one of them failed (and forget about it)
+  void finish();
+  /// drop all pending checks and their results, wait for the current check (afterwards no borrowed memory is accessed anymore)
+  void discard();
+
+  /// number of bitstreams checked so far (including failed ones)
+  unsigned int getNumChecked() const;
+
+private:
+  /// disable copying
+  Verifier(const Verifier&);
+  Verifier& operator=(const Verifier&);
+
+  /// a single check
+  struct Job
+  {
+    /// optimized LZW data
+    BitStream     bits;
+    /// original pixels/bytes, borrowed from the caller (NULL => see copy)
+    const unsigned char* expected;
+    size_t        size;
+    /// copy of the original pixels/bytes if the caller asked for it
+    Bytes         copy;
+    /// LZW format
+    bool          isGif;
+    unsigned char minCodeSize;
+    unsigned char maxCodeSize;
+
+    Job()
+    : bits(), expected(NULL), size(0), copy(), isGif(true), minCodeSize(8), maxCodeSize(12)
+    {}
+
+    /// exchange contents (avoids copying the bitstream and pixels/bytes)
+    void swap(Job& other);
+  };
+
+  /// main loop of the background thread
+  void process();
+  /// decode and compare, return false if the bitstream is invalid or produces different pixels/bytes
+  bool check(const Job& job);
+
+  /// background thread
+  std::thread             m_thread;
+  /// pending checks
+  std::deque<Job>         m_queue;
+  /// number of checks which were started but aren't finished yet (0 or 1)
+  unsigned int            m_running;
+  /// number of finished checks
+  unsigned int            m_numChecked;
+  /// true if at least one check failed since the last finish()
+  bool                    m_failed;
+  /// true if the background thread should terminate
+  bool                    m_quit;
+  /// protect all members above
+  mutable std::mutex      m_mutex;
+  /// wake up background thread
+  std::condition_variable m_wakeUp;
+  /// signal when the queue is empty
+  std::condition_variable m_idle;
+  /// decoder's memory, reused for all checks (only accessed by the background thread)
+  LzwDecoder::Tables      m_tables;
+};
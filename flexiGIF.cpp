@@ -3,16 +3,27 @@
 // Copyright (c) 2018 Stephan Brumme. All rights reserved.
 // see https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/
 
+#include "Optimizer.h"
 #include "GifImage.h"
 #include "Compress.h"
-#include "LzwDecoder.h"
-#include "LzwEncoder.h"
+#include "InputSource.h"
+#include "OutputFile.h"
+#include "ResultCache.h"
+#include "ThreadPool.h"
 
 #include <vector>
+#include <map>
+#include <memory>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #include <cstdlib>
-#include <ctime>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
 
 namespace
 {
@@ -38,23 +49,22 @@ namespace
     DebuggingMode           = 99
   };
 
-  /// default values of the optimizer
-  enum DefaultValues
-  {
-    GifMaxToken      =  20000,
-    LzwMaxToken      = 100000,
-    GifMaxDictionary =   4096,
-    LzwMaxDictionary =  65536,
-    GifMaxDictionaryCompatible = GifMaxDictionary - 3, // 4093
-    Alignment        =      1,
-    MinImprovement   =      1,
-    MinNonGreedy     =      2
-  };
+  // default values of the optimizer
+  const unsigned int GifMaxToken                = Optimizer::GifMaxToken;
+  const unsigned int LzwMaxToken                = Optimizer::LzwMaxToken;
+  const unsigned int GifMaxDictionary           = Optimizer::GifMaxDictionary;
+  const unsigned int GifMaxDictionaryCompatible = Optimizer::GifMaxDictionaryCompatible;
+  const unsigned int Alignment                  = Optimizer::Alignment;
+  const unsigned int MinImprovement             = Optimizer::MinImprovement;
+  const unsigned int MinNonGreedy               = Optimizer::MinNonGreedy;
+  const unsigned int MatchCache                 = Optimizer::MatchCache;
+  const unsigned int AutoTune                   = Optimizer::AutoTune;
+  const unsigned int MatchCacheEntriesPerMB     = 1024 * 1024 / 16; // see LzwEncoder::CachedMatch
 }
 
 
-/// terminate program, show help
-void help(const std::string& errorMsg = "", int errorCode = NoError, bool showHelp = true)
+/// show help and return errorCode (which is supposed to be returned by main)
+int help(const std::string& errorMsg = "", int errorCode = NoError, bool showHelp = true)
 {
   // error
   if (!errorMsg.empty())
@@ -78,14 +88,32 @@ void help(const std::string& errorMsg = "", int errorCode = NoError, bool showHe
               << " -m=x  --minimprovement=x   minimum number of bytes saved by a non-greedy match (requires parameter -n, default is -m=" << MinImprovement << ")" << std::endl
               << " -i    --info               analyze internal structure of INPUTFILE" << std::endl
               << " -f    --force              overwrite OUTPUTFILE if it already exists" << std::endl
-              << " -r    --splitruns          allow partial matching of long runs of the same byte (requires parameter -n)" << std::endl
+              << " -r    --splitruns          deprecated, has no effect (runs are always split like any other match)" << std::endl
               << " -u=x  --userdefined=x      don't search but set custom block boundaries, x is an ascendingly sorted list, e.g. -u=500,2000,9000" << std::endl
               << " -s    --summary            when finished, compare filesize of INPUTFILE and OUTPUTFILE" << std::endl
               << " -v    --verbose            show debug messages" << std::endl
               << " -q    --quiet              no output during compression" << std::endl
               << " -Z                         INPUTFILE and OUTPUTFILE are stored in .Z file format instead of .gif" << std::endl
-              << " -b=x  --benchmark=x        benchmark GIF decoder, x stands for the number of iterations (default: x=100)" << std::endl
+              << " -b=x  --benchmark=x        benchmark all stages, x stands for the number of iterations (default: x=10)" << std::endl
+              << "       --report=x           store benchmark results in x, a JSON file (if x ends with .json) or a CSV file" << std::endl
               << " -y    --immediately        avoid initial clear code and start immediately with compressed data" << std::endl
+              << "       --threads=x          number of threads (default is --threads=1, 0 means \"all CPU cores\")" << std::endl
+              << "       --arraydictionary    always use a flat  LZW dictionary (same output, for benchmarking only)" << std::endl
+              << "       --hashdictionary     always use a hashed LZW dictionary (same output, for benchmarking only)" << std::endl
+              << "       --incremental        greedy search reuses the tokens of a nearby block start (same output, experimental)" << std::endl
+              << "       --matchcache=x       non-greedy search memoizes matches in x MB per thread (default is --matchcache=" << MatchCache / MatchCacheEntriesPerMB << ", same output)" << std::endl
+              << "       --time-limit=x       cheap greedy search first, then refine until x milliseconds are over (keeps the best result)" << std::endl
+              << "       --auto=x             choose -a, -t and -n for each file such that x kilopixels/second are processed (default is --auto=" << AutoTune << ")" << std::endl
+              << "       --crop               animations only: crop frames to the pixels which differ from the previous frame (same rendering)" << std::endl
+              << "       --remap              remove unused colors from the color maps and reduce the LZW code size (same rendering)" << std::endl
+              << "       --keep-original      keep the original LZW data of a frame (or .Z file) if the optimized data isn't smaller" << std::endl
+              << "       --early-out          stop optimizing a frame as soon as it most likely can't beat the original (heuristic, implies --keep-original)" << std::endl
+              << "       --verify             decode the optimized LZW data (in the background) and write OUTPUTFILE only if it matches INPUTFILE" << std::endl
+              << "       --progress-fd=x      write progress and estimated remaining time as JSON lines to file descriptor x (e.g. a pipe)" << std::endl
+              << "       --segment=x          .Z only: optimize segments of x KB independently and in parallel (faster for huge files, slightly larger)" << std::endl
+              << "       --cache=x            remember optimized frames/files in x and skip them next time (same settings and pixels => same output)" << std::endl
+              << "       --stats              show profiling counters and the time spent in each stage when finished" << std::endl
+              << "       --batch              INPUTFILE is a directory or a text file listing one file per line, OUTPUTFILE is a directory" << std::endl
               //<< "      --ppm=x               store x-th frame in PPM format in OUTPUTFILE" << std::endl
               //<< "      --indices=x           store x-th frame's indices in OUTPUTFILE" << std::endl
               //<< "      --compress            INPUTFILE isn't compressed yet and OUTPUTFILE will be a .Z file" << std::endl
@@ -94,7 +122,457 @@ void help(const std::string& errorMsg = "", int errorCode = NoError, bool showHe
               << std::endl
               << "See https://create.stephan-brumme.com/flexigif-lossless-gif-lzw-optimization/ for more infos" << std::endl;
 
-  exit(errorCode);
+  return errorCode;
+}
+
+
+/// compare filesizes of INPUTFILE and OUTPUTFILE (-s)
+void printSummary(const std::string& input, const std::string& output, int before, int now, float seconds,
+                  const LzwEncoder::OptimizationSettings& optimize)
+{
+  // smaller, larger ?
+  int diff   = before - now;
+  if (diff == 0)
+    std::cout << "no optimization found for '" << input << "', same size as before (" << now << " bytes).";
+  if (diff >  0)
+    std::cout << "'" << output << "' is " <<  diff << " bytes smaller than '" << input << "' (" << now << " vs " << before << " bytes) => "
+              << "you saved " << std::fixed << std::setprecision(3) << (diff * 100.0f / before) << "%.";
+  if (diff <  0)
+  {
+    std::cout << "'" << output << "' is " << -diff << " bytes larger than '" << input << "' (" << now << " vs " << before << " bytes).";
+    if (optimize.alignment > 1 || optimize.greedy)
+      std::cout << " Please use more aggressive optimization settings.";
+  }
+
+  std::cout << " Finished after " << std::fixed << std::setprecision(2) << seconds << " seconds." << std::endl;
+}
+
+
+/// true if a file has to be treated as a .Z file (same auto-detection as for a single file)
+bool isZFile(const std::string& filename, bool compressZ)
+{
+  return compressZ ||
+         (filename.size() > 2 && filename[filename.size() - 2] == '.' && filename[filename.size() - 1] == 'Z');
+}
+
+
+/// all GIF/.Z files of a directory (sorted by name, anyFile => all files) or all files listed in a text file, return false if input doesn't exist
+bool listFiles(const std::string& input, bool anyFile, std::vector<std::string>& files)
+{
+  namespace fs = std::filesystem;
+  std::error_code error;
+
+  if (fs::is_directory(input, error))
+  {
+    for (fs::directory_iterator entry(input, error); !error && entry != fs::directory_iterator(); entry.increment(error))
+    {
+      if (!entry->is_regular_file(error))
+        continue;
+
+      // --compress accepts any file, else only GIF and .Z files
+      std::string extension = entry->path().extension().string();
+      if (anyFile || extension == ".gif" || extension == ".GIF" || extension == ".Z")
+        files.push_back(entry->path().string());
+    }
+    std::sort(files.begin(), files.end());
+    return true;
+  }
+
+  std::ifstream list(input.c_str());
+  if (!list)
+    return false;
+
+  std::string line;
+  while (std::getline(list, line))
+  {
+    // Windows line endings
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.resize(line.size() - 1);
+    if (!line.empty())
+      files.push_back(line);
+  }
+  return true;
+}
+
+
+/// show profiling counters and time spent in each stage of the most recent optimization (--stats)
+void printStatistics(const Optimizer& optimizer, size_t bytesWritten, const ResultCache* cache)
+{
+  const Optimizer::Timings&      timings    = optimizer.getTimings();
+  const LzwEncoder::Statistics&  statistics = optimizer.getStatistics();
+
+  std::cout << std::fixed << std::setprecision(3)
+            << "statistics:" << std::endl
+            << "  parse:                " << std::setw(12) << timings.parse    * 1000 << " ms" << std::endl
+            << "  auto-tune:            " << std::setw(12) << timings.tune     * 1000 << " ms" << std::endl
+            << "  decode:               " << std::setw(12) << timings.decode   * 1000 << " ms" << std::endl
+            << "  estimate:             " << std::setw(12) << timings.estimate * 1000 << " ms" << std::endl
+            << "  optimize:             " << std::setw(12) << timings.optimize * 1000 << " ms" << std::endl
+            << "  merge:                " << std::setw(12) << timings.merge    * 1000 << " ms" << std::endl
+            << "  write:                " << std::setw(12) << timings.write    * 1000 << " ms" << std::endl
+            << "  verify:               " << std::setw(12) << timings.verify   * 1000 << " ms" << std::endl
+            << "  total:                " << std::setw(12) << timings.total    * 1000 << " ms" << std::endl
+            << "  bytes written:        " << std::setw(8)  << bytesWritten << std::endl
+            << "  blocks:               " << std::setw(8)  << statistics.numBlocks   << " (each starts with an empty dictionary)" << std::endl
+            << "  dictionary resets:    " << std::setw(8)  << statistics.numRestarts << " (clear codes in output)" << std::endl
+            << "  dictionary searches:  " << std::setw(8)  << statistics.numSearches;
+  if (statistics.numSearches > 0)
+    std::cout << " (average depth " << std::setprecision(2) << statistics.searchDepth / double(statistics.numSearches) << ")";
+  std::cout << std::endl
+            << "  non-greedy probes:    " << std::setw(8)  << statistics.numNonGreedyProbes
+            << " (" << statistics.numNonGreedyAccepted << " accepted)" << std::endl
+            << "  best block updates:   " << std::setw(8)  << statistics.numBestUpdates << std::endl;
+
+  unsigned long long numTokens = statistics.numParsedTokens + statistics.numReusedTokens;
+  if (numTokens > 0)
+    std::cout << "  incremental tokens:   " << std::setw(8)  << statistics.numReusedTokens << " of " << numTokens << " reused ("
+              << std::setprecision(1) << 100.0 * statistics.numReusedTokens / numTokens << "%)" << std::endl;
+
+  unsigned long long numLookups = statistics.numCacheHits + statistics.numCacheMisses;
+  if (numLookups > 0)
+    std::cout << "  match cache hits:     " << std::setw(8)  << statistics.numCacheHits << " of " << numLookups << " lookups ("
+              << std::setprecision(1) << 100.0 * statistics.numCacheHits / numLookups << "%)" << std::endl;
+
+  if (cache != NULL)
+    std::cout << "  result cache hits:    " << std::setw(8)  << cache->getNumHits() << " of " << cache->getNumHits() + cache->getNumMisses()
+              << " frames/files" << std::endl;
+}
+
+
+/// recompress all GIF/.Z files of a directory (or all files listed in a text file) and store them in outputDirectory
+int batch(const std::string& input, const std::string& outputDirectory, Optimizer::Settings settings,
+          bool overwrite, bool showSummary, bool quiet)
+{
+  namespace fs = std::filesystem;
+  std::error_code error;
+
+  // collect all filenames
+  std::vector<std::string> files;
+  if (!listFiles(input, settings.compressZ, files))
+    return help("batch list or directory '" + input + "' not found", MissingParameter, false);
+  if (files.empty())
+    return help("no files found in '" + input + "'", MissingParameter, false);
+
+  fs::create_directories(outputDirectory, error);
+  if (!fs::is_directory(outputDirectory, error))
+    return help("OUTPUTFILE must be a directory in batch mode", InvalidParameter, false);
+
+  // output filenames consist of the input's filename only: files with the same name in different directories would overwrite each other
+  std::vector<std::string> outputs(files.size());
+  std::vector<size_t>      sameOutput(files.size());
+  std::map<std::string, size_t> firstOutput;
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    outputs[i] = (fs::path(outputDirectory) / fs::path(files[i]).filename()).string();
+    if (settings.compressZ)
+      outputs[i] += ".Z";
+    sameOutput[i] = firstOutput.insert(std::make_pair(outputs[i], i)).first->second;
+  }
+
+  // several files are processed in parallel, their progress can't be shown
+  settings.showProgress = false;
+  settings.progressFd   = -1;
+
+  // all threads share the same pool: threads without a file of their own help estimating other files' blocks
+  ThreadPool pool(settings.numThreads > 1 ? settings.numThreads - 1 : 0);
+  std::atomic<size_t> nextFile(0);
+
+  std::mutex   displayMutex;
+  unsigned int numFinished = 0;
+  unsigned int numErrors   = 0;
+  unsigned long long totalBefore = 0;
+  unsigned long long totalAfter  = 0;
+  std::chrono::steady_clock::time_point batchStart = std::chrono::steady_clock::now();
+
+  pool.run([&](unsigned int /*slot*/)
+  {
+    // each thread keeps its optimizer, therefore the encoders' memory is reused for all of its files
+    Optimizer optimizer(settings, pool);
+
+    while (true)
+    {
+      size_t next = nextFile++;
+      if (next >= files.size())
+        break;
+
+      const std::string& current = files[next];
+      const std::string& output  = outputs[next];
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      std::string errorMessage;
+      int before = 0;
+      int now    = 0;
+      try
+      {
+        if (sameOutput[next] != next)
+          throw std::runtime_error("same OUTPUTFILE as '" + files[sameOutput[next]] + "', please rename one of them");
+
+        std::error_code fileError;
+        if (fs::equivalent(current, output, fileError))
+          throw "INPUTFILE and OUTPUTFILE cannot be the same filename";
+        if (!overwrite && fs::exists(output, fileError))
+          throw "OUTPUTFILE already exists, please use -f to overwrite an existing file";
+
+        InputSource source(current);
+        Optimizer::Bytes optimized;
+        if (isZFile(current, settings.compressZ))
+          optimizer.optimizeZ  (source.getData(), source.getSize(), optimized);
+        else
+          optimizer.optimizeGif(source.getData(), source.getSize(), optimized);
+
+        writeFile(output, optimized.data(), optimized.size());
+
+        before = (int)source.getSize();
+        now    = (int)optimized.size();
+      }
+      catch (const char* e)
+      {
+        errorMessage = e ? e : "(no message)";
+      }
+      catch (std::exception& e)
+      {
+        errorMessage = e.what() ? e.what() : "(no message)";
+      }
+
+      float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+      // one line per file
+      std::lock_guard<std::mutex> lock(displayMutex);
+      numFinished++;
+      if (!errorMessage.empty())
+      {
+        numErrors++;
+        std::cerr << "ERROR: " << current << ": " << errorMessage << std::endl;
+        continue;
+      }
+
+      totalBefore += before;
+      totalAfter  += now;
+      if (showSummary)
+        printSummary(current, output, before, now, seconds, settings.optimize);
+      else if (!quiet)
+        std::cout << "[" << numFinished << "/" << files.size() << "] '" << current << "' => '" << output << "': "
+                  << before << " => " << now << " bytes, "
+                  << std::fixed << std::setprecision(2) << seconds << " seconds" << std::endl;
+    }
+  }, settings.numThreads > 1 ? settings.numThreads : 1);
+
+  if (!quiet)
+  {
+    float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - batchStart).count();
+    std::cout << files.size() - numErrors << " of " << files.size() << " files optimized: "
+              << totalBefore << " => " << totalAfter << " bytes, finished after "
+              << std::fixed << std::setprecision(2) << seconds << " seconds." << std::endl;
+  }
+
+  return numErrors == 0 ? NoError : GenericException;
+}
+
+
+/// percentile (nearest rank) of a few measurements, samples will be sorted
+double getPercentile(std::vector<double>& samples, unsigned int percent)
+{
+  if (samples.empty())
+    return 0;
+
+  std::sort(samples.begin(), samples.end());
+  size_t rank = (samples.size() * percent + 99) / 100;
+  if (rank == 0)
+    rank = 1;
+  return samples[rank - 1];
+}
+
+
+/// optimize a single file or all GIF/.Z files of a directory several times and measure each stage's wall-clock time,
+/// all files are loaded into memory before, report is a JSON (if its name ends with .json) or CSV file (may be empty)
+int runBenchmark(const std::string& input, unsigned int iterations, Optimizer::Settings settings, const std::string& report)
+{
+  namespace fs = std::filesystem;
+  std::error_code error;
+
+  // a single file or a corpus
+  std::vector<std::string> files;
+  if (fs::is_directory(input, error))
+    listFiles(input, settings.compressZ, files);
+  else
+    files.push_back(input);
+  if (files.empty())
+    return help("no files found in '" + input + "'", MissingParameter, false);
+
+  // preload all files, keep track of their number of pixels (or bytes for .Z files)
+  std::vector<Optimizer::Bytes>   contents(files.size());
+  std::vector<unsigned long long> numPixels(files.size(), 0);
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    InputSource source(files[i]);
+    if (source.empty())
+      return help("file '" + files[i] + "' not found or empty", MissingParameter, false);
+    contents[i].assign(source.getData(), source.getData() + source.getSize());
+
+    if (isZFile(files[i], settings.compressZ))
+    {
+      Compress lzw(source.getData(), source.getSize(), settings.compressZ, false);
+      numPixels[i] = lzw.getData().size();
+    }
+    else
+    {
+      GifImage gif(source.getData(), source.getSize(), false, false);
+      for (unsigned int frame = 0; frame < gif.getNumFrames(); frame++)
+        numPixels[i] += gif.getFrame(frame).width * gif.getFrame(frame).height;
+    }
+  }
+
+  std::cout << "benchmarking " << files.size() << (files.size() == 1 ? " file, " : " files, ")
+            << iterations << " iterations, " << settings.numThreads << (settings.numThreads == 1 ? " thread" : " threads") << std::endl;
+
+  // the same optimizer for all files, no progress bar
+  settings.showProgress = false;
+  settings.progressFd   = -1;
+  Optimizer optimizer(settings);
+
+  const unsigned int NumStages = 9;
+  const char* stageNames[NumStages] = { "parse", "tune", "decode", "estimate", "optimize", "merge", "write", "verify", "total" };
+
+  // statistics of all files for the final report, times in milliseconds
+  struct Result
+  {
+    size_t       file;
+    size_t       optimized;
+    const char*  stage;
+    double       p50;
+    double       p99;
+    double       mean;
+  };
+  std::vector<Result> results;
+
+  double totalSeconds = 0;
+  unsigned long long totalPixels = 0;
+  unsigned int numErrors = 0;
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    std::vector<double> samples[NumStages];
+    Optimizer::Bytes optimized;
+    try
+    {
+      for (unsigned int iteration = 0; iteration < iterations; iteration++)
+      {
+        optimized.clear();
+        if (isZFile(files[i], settings.compressZ))
+          optimizer.optimizeZ  (&contents[i][0], contents[i].size(), optimized);
+        else
+          optimizer.optimizeGif(&contents[i][0], contents[i].size(), optimized);
+
+        const Optimizer::Timings& timings = optimizer.getTimings();
+        samples[0].push_back(timings.parse    * 1000);
+        samples[1].push_back(timings.tune     * 1000);
+        samples[2].push_back(timings.decode   * 1000);
+        samples[3].push_back(timings.estimate * 1000);
+        samples[4].push_back(timings.optimize * 1000);
+        samples[5].push_back(timings.merge    * 1000);
+        samples[6].push_back(timings.write    * 1000);
+        samples[7].push_back(timings.verify   * 1000);
+        samples[8].push_back(timings.total    * 1000);
+      }
+    }
+    catch (const char* e)
+    {
+      numErrors++;
+      std::cerr << "ERROR: " << files[i] << ": " << (e ? e : "(no message)") << std::endl;
+      continue;
+    }
+    catch (std::exception& e)
+    {
+      numErrors++;
+      std::cerr << "ERROR: " << files[i] << ": " << (e.what() ? e.what() : "(no message)") << std::endl;
+      continue;
+    }
+
+    std::cout << "'" << files[i] << "': " << numPixels[i] << " pixels, "
+              << contents[i].size() << " => " << optimized.size() << " bytes" << std::endl
+              << "  stage      p50 (ms)    p99 (ms)   mean (ms)" << std::endl;
+    for (unsigned int stage = 0; stage < NumStages; stage++)
+    {
+      double sum = 0;
+      for (size_t j = 0; j < samples[stage].size(); j++)
+        sum += samples[stage][j];
+
+      Result result;
+      result.file      = i;
+      result.optimized = optimized.size();
+      result.stage     = stageNames[stage];
+      result.p50       = getPercentile(samples[stage], 50);
+      result.p99       = getPercentile(samples[stage], 99);
+      result.mean      = sum / iterations;
+      results.push_back(result);
+
+      std::cout << "  " << std::left << std::setw(8) << result.stage << std::right << std::fixed << std::setprecision(3)
+                << std::setw(12) << result.p50 << std::setw(12) << result.p99 << std::setw(12) << result.mean << std::endl;
+    }
+
+    // throughput of the whole pipeline
+    const Result& total = results.back();
+    if (total.p50 > 0)
+      std::cout << "  throughput: " << std::setprecision(3) << numPixels[i] / (total.p50 * 1000) << " megapixel/second" << std::endl;
+
+    totalSeconds += total.p50 / 1000;
+    totalPixels  += numPixels[i];
+  }
+
+  if (files.size() > 1 && totalSeconds > 0)
+    std::cout << "all files: " << totalPixels << " pixels, " << std::fixed << std::setprecision(3) << totalSeconds << " seconds (sum of p50), "
+              << totalPixels / (totalSeconds * 1000000) << " megapixel/second" << std::endl;
+
+  // machine-readable report
+  if (!report.empty())
+  {
+    std::ofstream file(report.c_str());
+    if (!file)
+      return help("can't create benchmark report '" + report + "'", GenericException, false);
+
+    bool isJson = report.size() > 5 && report.compare(report.size() - 5, 5, ".json") == 0;
+
+    // JSON escapes quotes and backslashes, CSV doubles quotes
+    auto quote = [isJson](const std::string& text)
+    {
+      std::string result = "\"";
+      for (size_t i = 0; i < text.size(); i++)
+      {
+        if (isJson && (text[i] == '"' || text[i] == '\\'))
+          result += '\\';
+        if (!isJson && text[i] == '"')
+          result += '"';
+        result += text[i];
+      }
+      return result + "\"";
+    };
+    file << std::fixed << std::setprecision(4);
+    if (isJson)
+      file << "{\"version\":" << quote(Version) << ",\"iterations\":" << iterations << ",\"threads\":" << settings.numThreads << ",\"results\":[";
+    else
+      file << "version,iterations,threads,file,bytes,optimized,pixels,stage,p50_ms,p99_ms,mean_ms,megapixel_per_second" << std::endl;
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      const Result& result = results[i];
+      double throughput = result.p50 > 0 ? numPixels[result.file] / (result.p50 * 1000) : 0;
+
+      if (isJson)
+        file << (i == 0 ? "" : ",") << std::endl
+             << "{\"file\":"    << quote(files[result.file])
+             << ",\"bytes\":"   << contents[result.file].size() << ",\"optimized\":" << result.optimized
+             << ",\"pixels\":"  << numPixels[result.file]       << ",\"stage\":"     << quote(result.stage)
+             << ",\"p50_ms\":"  << result.p50 << ",\"p99_ms\":" << result.p99 << ",\"mean_ms\":" << result.mean
+             << ",\"megapixel_per_second\":" << throughput << "}";
+      else
+        file << Version << "," << iterations << "," << settings.numThreads << "," << quote(files[result.file]) << ","
+             << contents[result.file].size() << "," << result.optimized << "," << numPixels[result.file] << "," << result.stage << ","
+             << result.p50 << "," << result.p99 << "," << result.mean << "," << throughput << std::endl;
+    }
+    if (isJson)
+      file << std::endl << "]}" << std::endl;
+  }
+
+  return numErrors == 0 ? NoError : GenericException;
 }
 
 
@@ -103,45 +581,41 @@ int main(int argc, char** argv)
 {
   // no parameters at all ?
   if (argc == 1)
-    help();
+    return help();
 
   // filenames
   std::string input;
   std::string output;
 
+  // optimizer, initialized with default values
+  Optimizer::Settings settings;
+  LzwEncoder::OptimizationSettings& optimize = settings.optimize;
+
   // other parameters
   bool isGif       = true;  // if false then .Z file format
   bool inputInfo   = false; // just one filename: show some compression details of input file
   bool showSummary = false; // after finishing recompression: display how many bytes were saved
   bool overwrite   = false; // overwrite an existing OUTPUTFILE
   bool quiet       = false; // no console output
-  bool verbose     = false; // lots of console output
-  bool deinterlace = false; // deinterlace a GIF image
+  bool splitRuns   = false; // deprecated -r, has no effect
+  bool& verbose     = settings.verbose;     // lots of console output
+  bool& deinterlace = settings.deinterlace; // deinterlace a GIF image
 
-  bool smartGreedy = false;
-  bool benchmark   = false; // decompress INPUTFILE several times and measure throughput in MB/sec
+  bool& smartGreedy = settings.smartGreedy;
+  unsigned int& numThreads = settings.numThreads; // number of threads, 1 => single-threaded
+  bool benchmark   = false; // optimize INPUTFILE (or all files of a directory) several times and measure each stage
   unsigned int iterations = 10;  // benchmark only: repeat x times
+  std::string report;            // benchmark only: write results to a JSON/CSV file
   bool showDecompressed = false; // dump a frame in PPM format to OUTPUTFILE
   bool showIndices      = false; // dump a frame's indices to OUTPUTFILE
   unsigned int ppmFrame = 0;     // only relevant if showDecompressed is true
-  bool compressZ   = false; // decompress INPUTFILE to OUTPUTFILE (.Z format only)
-  bool decompressZ = false; // compress INPUTFILE to OUTPUTFILE (.Z format)
-
-  std::vector<unsigned int> predefinedBlocks; // insert clear codes at these user-defined positions
-
-  // optimizer
-  LzwEncoder::OptimizationSettings optimize;
-  optimize.alignment           = Alignment;
-  optimize.verbose             = false;
-  optimize.greedy              = true;
-  optimize.minImprovement      = MinImprovement;
-  optimize.minNonGreedyMatch   = MinNonGreedy;
-  optimize.splitRuns           = false;
-  optimize.maxDictionary       = 0;
-  optimize.maxTokens           = GifMaxToken;
-  optimize.startWithClearCode  = true;
-  optimize.readOnlyBest        = false;
-  optimize.avoidNonGreedyAgain = false;
+  bool& compressZ  = settings.compressZ; // INPUTFILE isn't compressed yet (.Z format only)
+  bool decompressZ = false; // store decompressed contents of INPUTFILE (.Z format)
+  bool batchMode   = false; // INPUTFILE is a directory/list of files, OUTPUTFILE a directory
+  bool showStatistics = false; // after finishing recompression: display profiling counters and timings
+  std::string cacheFile;       // replay results of frames/files which were optimized before
+
+  std::vector<unsigned int>& predefinedBlocks = settings.predefinedBlocks; // insert clear codes at these user-defined positions
 
   // parse parameters
   std::string current;
@@ -201,12 +675,12 @@ int main(int argc, char** argv)
       }
 
       // but at most two filenames ...
-      help("more than two filenames specified", MoreThanTwoFilenames);
+      return help("more than two filenames specified", MoreThanTwoFilenames);
     }
 
     // help
     if (currentShort == 'h' || current == "--help")
-      help();
+      return help();
 
     // info
     if (currentShort == 'i' || current == "--info")
@@ -219,7 +693,7 @@ int main(int argc, char** argv)
     if (currentShort == 's' || current == "--summary")
     {
       if (quiet)
-        help("flag -s (show summary) contradicts -q (quiet)", ContradictingParameters, false);
+        return help("flag -s (show summary) contradicts -q (quiet)", ContradictingParameters, false);
       showSummary = true;
       continue;
     }
@@ -235,13 +709,10 @@ int main(int argc, char** argv)
     if (currentShort == 'v' || current == "--verbose")
     {
       if (quiet)
-        help("flag -v (verbose) contradicts -q (quiet)", ContradictingParameters, false);
+        return help("flag -v (verbose) contradicts -q (quiet)", ContradictingParameters, false);
 
-      verbose             = true;
-      optimize.verbose    = true;
-      GifImage::verbose   = true;
-      Compress::verbose   = true;
-      LzwDecoder::verbose = true;
+      verbose          = true;
+      optimize.verbose = true;
       continue;
     }
 
@@ -249,9 +720,9 @@ int main(int argc, char** argv)
     if (currentShort == 'q' || current == "--quiet")
     {
       if (verbose)
-        help("flag -q (quiet) contradicts -v (verbose)",      ContradictingParameters, false);
+        return help("flag -q (quiet) contradicts -v (verbose)",      ContradictingParameters, false);
       if (showSummary)
-        help("flag -q (quiet) contradicts -s (show summary)", ContradictingParameters, false);
+        return help("flag -q (quiet) contradicts -s (show summary)", ContradictingParameters, false);
 
       quiet = true;
       continue;
@@ -264,10 +735,10 @@ int main(int argc, char** argv)
       continue;
     }
 
-    // split runs
+    // split runs (deprecated: runs are always split like any other match)
     if (currentShort == 'r' || current == "--splitruns")
     {
-      optimize.splitRuns = true;
+      splitRuns = true;
       continue;
     }
 
@@ -321,6 +792,32 @@ int main(int argc, char** argv)
       continue;
     }
 
+    // dictionary layout
+    if (current == "--arraydictionary")
+    {
+      optimize.dictionaryLayout = LzwEncoder::OptimizationSettings::LayoutArray;
+      continue;
+    }
+    if (current == "--hashdictionary")
+    {
+      optimize.dictionaryLayout = LzwEncoder::OptimizationSettings::LayoutHash;
+      continue;
+    }
+
+    // incremental estimation
+    if (current == "--incremental")
+    {
+      optimize.incremental = true;
+      continue;
+    }
+
+    // process many files
+    if (current == "--batch")
+    {
+      batchMode = true;
+      continue;
+    }
+
     // INPUTFILE isn't compressed (applies to .Z files only)
     if (current == "--compress")
     {
@@ -351,7 +848,7 @@ int main(int argc, char** argv)
     if (current == "-a" || current == "--alignment")
     {
       if (value <= 0)
-        help("parameter -a/--alignment cannot be zero", ParameterOutOfRange, false);
+        return help("parameter -a/--alignment cannot be zero", ParameterOutOfRange, false);
 
       optimize.alignment = (unsigned int)value;
       continue;
@@ -361,7 +858,7 @@ int main(int argc, char** argv)
     if (current == "-d" || current == "--dictionary")
     {
       if (value <= 0)
-        help("parameter -d/--dictionary cannot be zero", ParameterOutOfRange, false);
+        return help("parameter -d/--dictionary cannot be zero", ParameterOutOfRange, false);
 
       optimize.maxDictionary = (unsigned int)value;
       continue;
@@ -381,7 +878,7 @@ int main(int argc, char** argv)
     if (current == "-m" || current == "--minimprovement")
     {
       if (value <= 0)
-        help("parameter -m/--minimprovement cannot be zero", ParameterOutOfRange, false);
+        return help("parameter -m/--minimprovement cannot be zero", ParameterOutOfRange, false);
 
       optimize.minImprovement = (unsigned int)value;
       continue;
@@ -394,7 +891,7 @@ int main(int argc, char** argv)
       optimize.minNonGreedyMatch = hasValue ? (unsigned int)value : MinNonGreedy;
 
       if (value < 2)
-        help("parameter -n/--nongreedy cannot be less than 2", ParameterOutOfRange, false);
+        return help("parameter -n/--nongreedy cannot be less than 2", ParameterOutOfRange, false);
 
       continue;
     }
@@ -415,7 +912,7 @@ int main(int argc, char** argv)
         }
 
         if (oneByte < '0' || oneByte > '9')
-          help("invalid syntax for parameter -u/--userdefined: it must be a sorted list of numbers", InvalidParameter, false);
+          return help("invalid syntax for parameter -u/--userdefined: it must be a sorted list of numbers", InvalidParameter, false);
 
         // process digit
         predefinedBlocks.back() *= 10;
@@ -425,7 +922,7 @@ int main(int argc, char** argv)
       // check whether the list is in ascending order (duplicates are disallowed, too)
       for (size_t i = 1; i < predefinedBlocks.size(); i++)
         if (predefinedBlocks[i - 1] >= predefinedBlocks[i])
-          help("invalid syntax for parameter -u/--userdefined: it must be a sorted list of numbers", InvalidParameter, false);
+          return help("invalid syntax for parameter -u/--userdefined: it must be a sorted list of numbers", InvalidParameter, false);
 
       continue;
     }
@@ -434,9 +931,130 @@ int main(int argc, char** argv)
     if (current == "-b" || current == "--benchmark")
     {
       benchmark  = true;
-      iterations = hasValue ? value : 100; // default: decode 100x
+      iterations = hasValue ? value : 10; // default: optimize 10x
       if (value < 1)
-        help("parameter -b/--benchmark cannot be zero", ParameterOutOfRange, false);
+        return help("parameter -b/--benchmark cannot be zero", ParameterOutOfRange, false);
+      continue;
+    }
+
+    // profiling counters
+    if (current == "--stats")
+    {
+      showStatistics = true;
+      continue;
+    }
+
+    // persistent cache of optimized frames/files
+    if (current == "--cache")
+    {
+      if (strValue.empty())
+        return help("parameter --cache requires a filename", MissingParameter, false);
+      cacheFile = strValue;
+      continue;
+    }
+
+    // benchmark results in a machine-readable format
+    if (current == "--report")
+    {
+      if (strValue.empty())
+        return help("parameter --report requires a filename", MissingParameter, false);
+      report = strValue;
+      continue;
+    }
+
+    // multi-threading
+    if (current == "--threads")
+    {
+      if (value < 0)
+        return help("parameter --threads cannot be negative", ParameterOutOfRange, false);
+
+      numThreads = value > 0 ? (unsigned int)value : ThreadPool::getHardwareThreads();
+      continue;
+    }
+
+    // memoized matches of non-greedy search
+    if (current == "--matchcache")
+    {
+      if (value < 0)
+        return help("parameter --matchcache cannot be negative", ParameterOutOfRange, false);
+
+      optimize.matchCache = (unsigned int)value * MatchCacheEntriesPerMB;
+      continue;
+    }
+
+    // anytime mode
+    if (current == "--time-limit")
+    {
+      if (value <= 0)
+        return help("parameter --time-limit must be at least 1 millisecond", ParameterOutOfRange, false);
+
+      settings.timeLimit = (unsigned int)value;
+      continue;
+    }
+
+    // choose alignment, token limit and non-greedy search per file
+    if (current == "--auto")
+    {
+      if (hasValue && value <= 0)
+        return help("parameter --auto must be at least 1 kilopixel per second", ParameterOutOfRange, false);
+
+      settings.autoTune = hasValue ? (unsigned int)value : AutoTune;
+      continue;
+    }
+
+    // remove unchanged pixels of animations
+    if (current == "--crop")
+    {
+      settings.crop = true;
+      continue;
+    }
+
+    // remove unused colors
+    if (current == "--remap")
+    {
+      settings.remap = true;
+      continue;
+    }
+
+    // never make a frame (or .Z file) larger
+    if (current == "--keep-original")
+    {
+      settings.keepOriginal = true;
+      continue;
+    }
+
+    // give up as soon as the original can't be beaten
+    if (current == "--early-out")
+    {
+      settings.keepOriginal = true;
+      settings.earlyOut     = true;
+      continue;
+    }
+
+    // decode all optimized frames/files again
+    if (current == "--verify")
+    {
+      settings.verify = true;
+      continue;
+    }
+
+    // machine-readable progress
+    if (current == "--progress-fd")
+    {
+      if (!hasValue || value < 0)
+        return help("parameter --progress-fd requires a file descriptor, e.g. --progress-fd=3", ParameterOutOfRange, false);
+
+      settings.progressFd = value;
+      continue;
+    }
+
+    // .Z only: split huge files
+    if (current == "--segment")
+    {
+      if (value <= 0)
+        return help("parameter --segment must be at least 1 KB", ParameterOutOfRange, false);
+
+      settings.segmentSize = (unsigned int)value * 1024;
       continue;
     }
 
@@ -457,7 +1075,7 @@ int main(int argc, char** argv)
     }
 
     // whoopsie ...
-    help("unknown parameter " + current, 1);
+    return help("unknown parameter " + current, 1);
   }
 
   try
@@ -476,8 +1094,46 @@ int main(int argc, char** argv)
     }
 
     // check parameter combinations
-    if (optimize.splitRuns && optimize.greedy)
-      help("parameter -r requires -n", MissingParameter);
+    if (splitRuns && verbose)
+      std::cerr << "WARNING: parameter -r is deprecated and has no effect" << std::endl;
+    if (settings.timeLimit > 0 && !predefinedBlocks.empty())
+      return help("parameter --time-limit can't be combined with -u", ContradictingParameters);
+    if (settings.autoTune > 0 && settings.timeLimit > 0)
+      return help("parameter --auto can't be combined with --time-limit", ContradictingParameters);
+    if (settings.autoTune > 0 && !predefinedBlocks.empty())
+      return help("parameter --auto can't be combined with -u", ContradictingParameters);
+    bool limitsDictionary = optimize.maxDictionary != 0 && optimize.maxDictionary < (isGif ? GifMaxDictionary : (unsigned int)Optimizer::LzwMaxDictionary);
+    if (settings.keepOriginal && (limitsDictionary || (isGif && !optimize.startWithClearCode)))
+      return help("parameters --keep-original and --early-out can't be combined with -c, -d or -y (the original LZW data might violate them)",
+                  ContradictingParameters);
+    if (!cacheFile.empty() && benchmark)
+      return help("parameter --cache can't be combined with -b", ContradictingParameters);
+
+    // load results of earlier runs
+    std::unique_ptr<ResultCache> cache;
+    if (!cacheFile.empty())
+    {
+      cache.reset(new ResultCache(cacheFile));
+      settings.cache = cache.get();
+    }
+
+    // batch mode
+    if (batchMode)
+    {
+      if (input .empty())
+        return help("missing INPUTFILE (a directory or a text file listing one file per line)", MissingParameter);
+      if (output.empty())
+        return help("missing OUTPUTFILE (a directory)", MissingParameter);
+      if (inputInfo || benchmark || showDecompressed || showIndices || decompressZ)
+        return help("batch mode can only optimize files", ContradictingParameters, false);
+
+      if (!quiet)
+        std::cout << "flexiGIF " << Version << ", written by Stephan Brumme" << std::endl;
+      int result = batch(input, output, settings, overwrite, showSummary, quiet);
+      if (cache)
+        cache->save();
+      return result;
+    }
 
     // only one parameter: a file name => automatically switch to "info mode"
     if (argc == 2 && !input.empty())
@@ -487,108 +1143,58 @@ int main(int argc, char** argv)
     if (inputInfo)
     {
       if ( input .empty())
-        help("no filename provided", MissingParameter, false);
+        return help("no filename provided", MissingParameter, false);
       if (!output.empty())
-        help("too many filenames provided (accepting only one)", MoreThanTwoFilenames, false);
+        return help("too many filenames provided (accepting only one)", MoreThanTwoFilenames, false);
 
       // just load and parse
       if (isGif)
-      {
-        GifImage::verbose = true;
-        GifImage info(input);
-      }
+        GifImage info(input, true);
       else
-      {
-        Compress::verbose = true;
-        Compress info(input);
-      }
+        Compress info(input, false, true);
       return NoError;
     }
 
+    if (!report.empty() && !benchmark)
+      return help("parameter --report requires -b", MissingParameter);
+
     // benchmark
     if (benchmark)
     {
       if (input.empty())
-        help("missing INPUTFILE", MissingParameter, false);
-
-      std::cout << "benchmarking '" << input << "' ..." << std::endl
-                << "decoding file, " << iterations << " iterations" << std::endl;
-
-      clock_t start = clock();
-
-      unsigned int numDecodedFrames = 0;
-      unsigned long long numPixels  = 0;
-
-      for (unsigned int i = 0; i < iterations; i++)
-      {
-        if (isGif)
-        {
-          // parse file
-          GifImage gif(input);
-
-          // error during decoding
-          if (gif.getNumFrames() == 0)
-            help("no frames found in " + input, NoFrameFound, false);
-
-          // statistics
-          numDecodedFrames += gif.getNumFrames();
-          for (unsigned int frame = 0; frame < gif.getNumFrames(); frame++)
-            numPixels += gif.getFrame(frame).pixels.size();
-
-          // disable verbose output for the 2..n iteration
-          GifImage::verbose = false;
-        }
-        else
-        {
-          // parse file
-          Compress lzw(input, compressZ);
-          numDecodedFrames++;
-          numPixels += lzw.getData().size();
-          // disable verbose output for the 2..n iteration
-          Compress::verbose = false;
-        }
-      }
+        return help("missing INPUTFILE", MissingParameter, false);
+      if (!output.empty())
+        return help("too many filenames provided (benchmark accepts only INPUTFILE)", MoreThanTwoFilenames, false);
 
-      clock_t finish   = clock();
-      float seconds    = (finish - start) / float(CLOCKS_PER_SEC);
-      float perFile    = seconds / iterations;
-      float perFrame   = seconds / numDecodedFrames;
-      float throughput = numPixels / seconds;
-      std::cout   << std::fixed
-                  << "elapsed:    " << std::setw(8) << std::setprecision(6) << seconds  << " seconds" << std::endl
-                  << "per file:   " << std::setw(8) << std::setprecision(6) << perFile  << " seconds" << std::endl;
-      if (iterations != numDecodedFrames)
-        std::cout << "per frame:  " << std::setw(8) << std::setprecision(6) << perFrame << " seconds" << std::endl;
-      std::cout   << "throughput: " << std::setw(8) << std::setprecision(3) << throughput / 1000000 << " megapixel/second" << std::endl;
-      return NoError;
+      return runBenchmark(input, iterations, settings, report);
     }
 
     if (input .empty())
-      help("missing INPUTFILE",  MissingParameter);
+      return help("missing INPUTFILE",  MissingParameter);
     if (output.empty())
-      help("missing OUTPUTFILE", MissingParameter);
+      return help("missing OUTPUTFILE", MissingParameter);
 
     // same name ?
     if (input == output)
-      help("INPUTFILE and OUTPUTFILE cannot be the same filename", SameFile, false);
+      return help("INPUTFILE and OUTPUTFILE cannot be the same filename", SameFile, false);
 
     // don't overwrite by default
     if (!overwrite)
     {
       std::fstream checkOutput(output.c_str());
       if (checkOutput)
-        help("OUTPUTFILE already exists, please use -f to overwrite an existing file", DontOverwrite, false);
+        return help("OUTPUTFILE already exists, please use -f to overwrite an existing file", DontOverwrite, false);
     }
 
     // store a single frame in PPM format
     if (showDecompressed || showIndices)
     {
-      GifImage gif(input);
+      GifImage gif(input, verbose);
 
       // use 0-index internally instead of 1-index
       ppmFrame--;
       if (ppmFrame >= gif.getNumFrames()) // note: if ppmFrame was 0 => -1 => 0xFFFFFF... => a very large number
-        help("please specify a valid frame number", ParameterOutOfRange);
+        return help("please specify a valid frame number", ParameterOutOfRange);
 
       // write PPM (or plain indices)
       bool ok = false;
@@ -603,7 +1209,7 @@ int main(int argc, char** argv)
     // decompress .Z file
     if (decompressZ)
     {
-      Compress lzw(input, compressZ);
+      Compress lzw(input, compressZ, verbose);
       if (lzw.dump(output))
         return NoError;
       else
@@ -612,10 +1218,24 @@ int main(int argc, char** argv)
 
     // -------------------- process input --------------------
 
-    clock_t start = clock();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
     if (!quiet)
       std::cout << "flexiGIF " << Version << ", written by Stephan Brumme" << std::endl;
+
+    // load input
+    InputSource inputFile(input);
+
+    // --auto: choose settings before showing them
+    settings.showProgress = !quiet;
+    Optimizer optimizer(settings);
+    if (settings.autoTune > 0)
+    {
+      optimizer.autoTune(inputFile.getData(), inputFile.getSize(), isGif);
+      optimize    = optimizer.getSettings().optimize;
+      smartGreedy = optimizer.getSettings().smartGreedy;
+    }
+
     if (verbose)
     {
       std::cout << "used options:";
@@ -637,8 +1257,6 @@ int main(int argc, char** argv)
         std::cout << " -p";
       if (quiet)
         std::cout << " -q";
-      if (optimize.splitRuns && !optimize.greedy)
-        std::cout << " -r";
       if (showSummary)
         std::cout << " -s";
       std::cout << " -t=" << optimize.maxTokens;
@@ -654,6 +1272,38 @@ int main(int argc, char** argv)
         std::cout << " --indices=" << ppmFrame;
       if (showDecompressed)
         std::cout << " --ppm=" << ppmFrame;
+      if (numThreads > 1)
+        std::cout << " --threads=" << numThreads;
+      if (optimize.dictionaryLayout == LzwEncoder::OptimizationSettings::LayoutArray)
+        std::cout << " --arraydictionary";
+      if (optimize.dictionaryLayout == LzwEncoder::OptimizationSettings::LayoutHash)
+        std::cout << " --hashdictionary";
+      if (optimize.incremental)
+        std::cout << " --incremental";
+      if (optimize.matchCache != MatchCache)
+        std::cout << " --matchcache=" << optimize.matchCache / MatchCacheEntriesPerMB;
+      if (settings.timeLimit > 0)
+        std::cout << " --time-limit=" << settings.timeLimit;
+      if (settings.autoTune > 0)
+        std::cout << " --auto=" << settings.autoTune;
+      if (settings.crop)
+        std::cout << " --crop";
+      if (settings.remap)
+        std::cout << " --remap";
+      if (settings.earlyOut)
+        std::cout << " --early-out";
+      else if (settings.keepOriginal)
+        std::cout << " --keep-original";
+      if (settings.verify)
+        std::cout << " --verify";
+      if (settings.progressFd >= 0)
+        std::cout << " --progress-fd=" << settings.progressFd;
+      if (settings.segmentSize > 0)
+        std::cout << " --segment=" << settings.segmentSize / 1024;
+      if (showStatistics)
+        std::cout << " --stats";
+      if (!cacheFile.empty())
+        std::cout << " --cache=" << cacheFile;
 
       std::cout << std::endl;
     }
@@ -661,243 +1311,37 @@ int main(int argc, char** argv)
     if (verbose)
       std::cout << std::endl << "===== decompress '" << input << "' =====" << std::endl;
 
-    if (isGif) // ---------- recompress GIF frames ----------
-    {
-      // load GIF
-      GifImage gif(input);
-
-      // error during decoding ?
-      if (gif.getNumFrames() == 0)
-        help("no frames found in " + input, NoFrameFound, false);
-
-      // determine minCodeSize, often 8 (up to 256 colors)
-      optimize.minCodeSize = 1;
-      // look for largest byte in each frame
-      unsigned char maxValue = 0;
-      const unsigned char EightBits = 0x80;
-      for (unsigned int frame = 0; frame < gif.getNumFrames() && maxValue < EightBits; frame++)
-      {
-        // get bytes / pixels
-        const GifImage::Bytes& indices = gif.getFrame(frame).pixels;
-        for (size_t i = 0; i < indices.size(); i++)
-          // larger ?
-          if (maxValue < indices[i])
-          {
-            maxValue = indices[i];
-            // at least 8 bits ? => maximum
-            if (maxValue >= EightBits)
-              break;
-          }
-      }
-      // compute number of bits
-      while (maxValue >= (1 << optimize.minCodeSize))
-        optimize.minCodeSize++;
-      // codeSize = 1 is not allowed by spec, even b/w images have codeSize = 2
-      if (optimize.minCodeSize == 1)
-        optimize.minCodeSize = 2;
-
-      // de-interlace non-animated GIFs
-      if (deinterlace)
-      {
-        if (gif.getNumFrames() > 1)
-          help("de-interlacing is not supported yet for animated GIFs", NotImplemented, false);
-        gif.setInterlacing(false);
-      }
-
-      if (gif.getNumFrames() > 1 && !predefinedBlocks.empty())
-        help("user-defined block boundaries are not allowed for animated GIFs", NotImplemented, false);
-
-      // -------------------- generate output --------------------
-
-      if (verbose)
-        std::cout << std::endl << "===== compression in progress ... =====" << std::endl;
-
-      // optimize all frames
-      unsigned int numFrames = gif.getNumFrames();
-      std::vector<std::vector<bool> > optimizedFrames;
-      for (unsigned int frame = 0; frame < numFrames; frame++)
-      {
-        // get original LZW bytes
-        const GifImage::Frame& current = gif.getFrame(frame);
-        const std::vector<unsigned char>& indices = current.pixels;
-        LzwEncoder encoded(indices, isGif);
-        optimize.minCodeSize = current.codeSize;
-
-        // store optimized LZW bytes
-        LzwEncoder::BitStream optimized;
-
-        // look for optimal block boundaries
-        if (predefinedBlocks.empty())
-        {
-          unsigned int lastDisplay = 0;
-          int pos = (int)indices.size() - 1;
-          for (int i = pos; i >= 0; i--)
-          {
-            // only if block start is aligned
-            if (i % optimize.alignment != 0)
-              continue;
-
-            // show progress
-            if (!quiet && (i / optimize.alignment) % 8 == 0 && clock() != lastDisplay)
-            {
-              unsigned int percentage = 100 - (100 * i / indices.size());
-              std::cout << "    \rframe " << frame+1 << "/" << numFrames << " (" << indices.size() << " pixels): "
-                        << percentage << "% done";
-
-              // ETA
-              clock_t now     = clock();
-              float elapsed   = (now - start) / float(CLOCKS_PER_SEC);
-              float estimated = elapsed * 100 / (percentage + 0.000001f) - elapsed;
-
-              if (elapsed > 3 && numFrames == 1 && estimated >= 1)
-                std::cout << " (after " << (int)elapsed << "s, about " << (int)estimated << "s left)";
-              std::cout << std::flush;
-
-              lastDisplay = now;
-            }
-
-            // estimate cost
-            encoded.optimizePartial(i, 0, false, true, optimize);
-
-            // repeat estimation, this time with non-greedy search
-            if (smartGreedy && !optimize.greedy)
-            {
-              optimize.greedy = true;
-              encoded.optimizePartial(i, 0, false, true, optimize);
-              optimize.greedy = false;
-            }
-          }
-
-          if (!quiet)
-            std::cout << "                            " << std::endl;
-
-          // final bitstream for current image
-          optimized = encoded.optimize(optimize);
-        }
-        else
-        {
-          // remove invalid block boundaries (or should it be an ERROR ?)
-          while (predefinedBlocks.back() > indices.size())
-            predefinedBlocks.pop_back();
-
-          // to simplify code, include start and end of file as boundaries, too
-          if (predefinedBlocks.empty() || predefinedBlocks.front() != 0)
-            predefinedBlocks.insert(predefinedBlocks.begin(), 0);
-          if (predefinedBlocks.back() != indices.size())
-            predefinedBlocks.push_back(indices.size());
-
-          // avoid certain optimizer settings that might cause incomplete images
-          optimize.maxTokens     = 0;
-          optimize.maxDictionary = 0;
-
-          optimized = encoded.merge(predefinedBlocks, optimize);
-        }
-
-        optimizedFrames.push_back(optimized);
-      }
-
-      // write to disk
-      gif.writeOptimized(output, optimizedFrames, optimize.minCodeSize);
-    }
-    else // ---------- .Z file format ----------
-    {
-      if (!predefinedBlocks.empty())
-        help("predefined blocks not implemented yet for .Z files", NotImplemented);
-
-      // disable GIF-only optimizations
-      optimize.startWithClearCode = false;
-
-      Compress lzw(input, compressZ);
-
-      // get LZW bytes
-      const std::vector<unsigned char>& bytes = lzw.getData();
-      LzwEncoder encoded(bytes, isGif);
-
-      // adjust optimizer:
-      // always the full ASCII alphabet
-      optimize.minCodeSize = 8;
-      // dictionary limit is 2^16 instead of 2^12
-      if (optimize.maxDictionary == GifMaxDictionary || optimize.maxDictionary == GifMaxDictionaryCompatible)
-        optimize.maxDictionary = LzwMaxDictionary; // 0 is an option, too, ... it disables the limit check
-
-      if (verbose)
-        std::cout << std::endl << "===== compression in progress ... =====" << std::endl;
-
-      // store optimized LZW bytes
-      LzwEncoder::BitStream optimized;
-
-      // look for optimal block boundaries
-      unsigned int percentageDone = 0;
-      int pos = (int)bytes.size() - 1;
-      for (int i = pos; i >= 0; i--)
-      {
-        // only if block start is aligned
-        if (i % optimize.alignment != 0)
-          continue;
-
-        // show progress
-        float percentage = 100 - (100 * float(i) / bytes.size());
-        if (percentage != percentageDone && !quiet)
-        {
-          // ETA
-          clock_t now     = clock();
-          float elapsed   = (now - start) / float(CLOCKS_PER_SEC);
-          float estimated = elapsed * 100 / (percentage + 0.000001f) - elapsed;
-
-          std::cout << "    \r" << (int)percentage << "% done";
-          if (elapsed > 3 && estimated >= 1)
-            std::cout << " (after " << (int)elapsed << "s, about " << (int)estimated << "s left)";
-          std::cout << std::flush;
-
-          percentageDone = (unsigned int)percentage;
-        }
-
-        // estimate cost
-        encoded.optimizePartial(i, 0, false, true, optimize);
-      }
+    // recompress
+    Optimizer::Bytes optimized;
+    if (isGif)
+      optimizer.optimizeGif(inputFile.getData(), inputFile.getSize(), optimized);
+    else
+      optimizer.optimizeZ  (inputFile.getData(), inputFile.getSize(), optimized);
 
-      if (!quiet)
-        std::cout << "                            " << std::endl;
-
-      // write to disk
-      optimized = encoded.optimize(optimize);
-      lzw.writeOptimized(output, optimized);
-    }
+    // write to disk (atomically replace an existing file)
+    writeFile(output, optimized.data(), optimized.size());
 
     // -------------------- bonus output :-) --------------------
     if (showSummary)
     {
-      // measure duration
-      clock_t finish  = clock();
-      float   seconds = (finish - start) / float(CLOCKS_PER_SEC);
+      // measure duration (wall-clock, CPU time would add up all threads)
+      float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
 
       // get filesizes
-      std::fstream in (input .c_str(), std::ios::in | std::ios::binary);
-      std::fstream out(output.c_str(), std::ios::in | std::ios::binary);
-      in .seekg(0, in .end);
-      out.seekg(0, out.end);
-      int before = (int)in .tellg();
-      int now    = (int)out.tellg();
+      int before = (int)inputFile.getSize();
+      int now    = (int)optimized.size();
 
       if (verbose)
         std::cout << std::endl << "===== done ! =====" << std::endl;
 
-      // smaller, larger ?
-      int diff   = before - now;
-      if (diff == 0)
-        std::cout << "no optimization found for '" << input << "', same size as before (" << now << " bytes).";
-      if (diff >  0)
-        std::cout << "'" << output << "' is " <<  diff << " bytes smaller than '" << input << "' (" << now << " vs " << before << " bytes) => "
-                  << "you saved " << std::fixed << std::setprecision(3) << (diff * 100.0f / before) << "%.";
-      if (diff <  0)
-      {
-        std::cout << "'" << output << "' is " << -diff << " bytes larger than '" << input << "' (" << now << " vs " << before << " bytes).";
-        if (optimize.alignment > 1 || optimize.greedy)
-          std::cout << " Please use more aggressive optimization settings.";
-      }
-
-      std::cout << " Finished after " << std::fixed << std::setprecision(2) << seconds << " seconds." << std::endl;
+      printSummary(input, output, before, now, seconds, optimize);
     }
+
+    if (cache)
+      cache->save();
+
+    if (showStatistics)
+      printStatistics(optimizer, optimized.size(), cache.get());
   }
   catch (const char* e)
   {
@@ -0,0 +1,53 @@
+#!/bin/sh
+# command-line regression tests, usage: sh tests/cli.sh [path/to/flexiGIF]
+
+FLEXIGIF=${1:-./flexiGIF}
+TESTS=$(dirname "$0")
+TEMP=$(mktemp -d)
+trap 'rm -rf "$TEMP"' EXIT
+
+numFailed=0
+fail()
+{
+  echo "FAILED: $1"
+  numFailed=$((numFailed + 1))
+}
+
+# largest dictionary of all blocks (as shown by -i)
+maxDictionary()
+{
+  "$FLEXIGIF" -i "$1" | sed -n 's/.*dict= *\([0-9]*\).*/\1/p' | sort -n | tail -n 1
+}
+
+# -d must be honored even if the optimized file is larger than the original (whose dictionary grows to 3872 entries)
+if "$FLEXIGIF" -q -f -a=2 -d=1000 "$TESTS/dictionary.gif" "$TEMP/dictionary.gif"; then
+  if cmp -s "$TESTS/dictionary.gif" "$TEMP/dictionary.gif"; then
+    fail "-d=1000 returned the original file"
+  fi
+  numEntries=$(maxDictionary "$TEMP/dictionary.gif")
+  if [ -z "$numEntries" ] || [ "$numEntries" -gt 1000 ]; then
+    fail "-d=1000 produced a dictionary with $numEntries entries"
+  fi
+else
+  fail "-d=1000"
+fi
+
+# the original LZW data might violate -d
+if "$FLEXIGIF" -q -f -d=1000 --keep-original "$TESTS/dictionary.gif" "$TEMP/keep.gif" > /dev/null 2>&1; then
+  fail "--keep-original accepted -d"
+fi
+
+# the dictionary reaches 512 entries exactly at the end-of-stream code of the second block: it needs 10 instead of 9 bits
+if "$FLEXIGIF" -q -f -u=364 "$TESTS/endofstream.gif" "$TEMP/endofstream.gif"; then
+  if ! "$FLEXIGIF" -i "$TEMP/endofstream.gif" > /dev/null 2>&1; then
+    fail "end-of-stream code can't be decoded"
+  fi
+else
+  fail "-u=364"
+fi
+
+if [ $numFailed -ne 0 ]; then
+  echo "$numFailed test(s) failed"
+  exit 1
+fi
+echo "all tests passed"